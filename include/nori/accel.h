@@ -19,17 +19,53 @@
 #pragma once
 
 #include <nori/mesh.h>
+#include <nori/pagecache.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+
+/// Maximum number of rays in a packet traced by \ref Accel::rayIntersectPacket()
+#define NORI_PACKET_SIZE 16
 
 NORI_NAMESPACE_BEGIN
 
+/// Array of tree nodes whose storage starts at a cache line boundary
+template <typename T> using NodeVector = std::vector<T, tbb::cache_aligned_allocator<T>>;
+
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
- * The current implementation falls back to a brute force loop
- * through the geometry.
+ * The current implementation is a bounding volume hierarchy (BVH) over the
+ * triangles of all registered meshes. It is constructed top-down and in
+ * parallel using the surface area heuristic (SAH), where candidate split
+ * planes are evaluated by binning the triangle centroids along each axis.
+ *
+ * The properties controlling the width, leaf format, builder, node layout
+ * and memory footprint of the hierarchy are described where the constructor
+ * parses them (accel.cpp). The builders live in bvhbuilder.cpp, the lazy
+ * construction in lazybvh.cpp, and the packet and stream traversal in
+ * raypacket.cpp.
+ *
+ * An SAH kd-tree over the same triangles is available as well (see
+ * \ref KDTree); it reuses the leaf and instancing machinery of this class.
+ *
+ * Meshes that are placed into the scene several times using \ref Instance
+ * are only stored once: every distinct mesh receives its own bottom-level
+ * hierarchy (with the same parameters), and a top-level binary BVH over
+ * the world-space bounds of all instances refers to them. Rays are
+ * transformed into object space before they enter a bottom-level hierarchy.
+ *
+ * For animations that only move instances or slightly deform meshes, the
+ * hierarchy can be updated using \ref refit() instead of being rebuilt.
  */
-class Accel {
+class Accel : public NoriObject {
 public:
+    /// Create an empty acceleration data structure
+    Accel(const PropertyList &propList);
+
     /**
      * \brief Register a triangle mesh for inclusion in the acceleration
      * data structure
@@ -38,36 +74,826 @@ public:
      */
     void addMesh(Mesh *mesh);
 
-    /// Build the acceleration data structure (currently a no-op)
+    /**
+     * \brief Register an instance of a (possibly shared) mesh
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void addInstance(Instance *instance);
+
+    /// Build the acceleration data structure
     void build();
 
+    /**
+     * \brief Build the bottom-level hierarchy of a mesh ahead of \ref build()
+     *
+     * Meshes that are referenced by an instance or registered while the
+     * \c meshHierarchies property is set receive a bottom-level hierarchy.
+     * This function builds it as soon as the mesh is loaded, i.e. possibly
+     * before the mesh is registered. It can be called from several threads
+     * at once, but not concurrently with \ref build().
+     */
+    void buildMesh(Mesh *mesh);
+
+    /// Does every registered mesh receive its own bottom-level hierarchy?
+    bool hasMeshHierarchies() const { return m_meshHierarchies; }
+
+    /**
+     * \brief Update the bounding boxes of all nodes after the vertex positions
+     * of the registered meshes (see \ref Mesh::setVertexPositions()) or the
+     * transformations of the instances (see \ref Instance::setToWorld())
+     * have changed
+     *
+     * The bounds are recomputed bottom-up and in parallel without changing
+     * the structure of the hierarchy. Afterwards, the SAH cost of every
+     * refitted hierarchy (including the bottom-level and top-level
+     * hierarchies of instances) is compared to its cost after the last full
+     * build, and the hierarchy is rebuilt if it exceeds the \c rebuildThreshold.
+     *
+     * This function must not be called while other threads trace rays.
+     *
+     * \return \c true if any of the hierarchies had to be rebuilt
+     */
+    virtual bool refit();
+
+    /**
+     * \brief Write the built hierarchy to a snapshot
+     *
+     * Includes the bottom-level hierarchies of all mesh instances.
+     */
+    void serialize(Snapshot &snapshot) const;
+
+    /**
+     * \brief Load the hierarchy from a snapshot (instead of calling \ref build())
+     *
+     * The meshes and instances must have been registered in the same
+     * order as when the snapshot was written.
+     */
+    void unserialize(Snapshot &snapshot);
+
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
+    /// Return the total number of triangles stored in the hierarchy
+    uint32_t getTriangleCount() const { return m_meshOffset.back(); }
+
+    /// Return the number of registered mesh instances
+    uint32_t getInstanceCount() const { return (uint32_t) m_instances.size(); }
+
+    /// Return the number of nodes in the hierarchy
+    virtual uint32_t getNodeCount() const;
+
+    /**
+     * \brief Return the depth of the hierarchy over the triangles
+     *
+     * This bounds the number of entries on the (fixed-size) traversal
+     * stack and is included in the build report. Lazily built hierarchies
+     * return the depth that the expansion of their nodes has reached so far.
+     */
+    uint32_t getStackDepth() const { return m_lazyBuild ? m_lazyDepth.load() : m_stackDepth; }
+
+    /// Return the branching factor of the hierarchy (2, 4, or 8)
+    int getWidth() const { return m_width; }
+
+    /// Structural statistics of a hierarchy (see \ref getStatistics())
+    struct Statistics {
+        float sahCost = 0.0f;            ///< SAH cost under the cost model of the builder (relative to the root)
+        float overlap = 0.0f;            ///< Summed surface area of the overlap of sibling nodes (relative to the root)
+        uint32_t innerNodes = 0;         ///< Number of inner nodes
+        uint32_t leaves = 0;             ///< Number of leaves
+        uint32_t references = 0;         ///< Number of triangle references stored in the leaves
+        std::vector<uint32_t> leafDepth; ///< Number of leaves at every depth (the root has depth 0)
+        std::vector<uint32_t> leafSize;  ///< Number of leaves that reference a given number of triangles
+        size_t nodeMemory = 0;           ///< Memory used by the nodes (in bytes)
+        size_t leafMemory = 0;           ///< Memory used by the triangle indices and packets (in bytes)
+
+        /// Record a leaf at the given depth
+        void addLeaf(uint32_t depth, uint32_t triangles) {
+            if (leafDepth.size() <= depth)
+                leafDepth.resize(depth + 1, 0);
+            if (leafSize.size() <= triangles)
+                leafSize.resize(triangles + 1, 0);
+            ++leafDepth[depth];
+            ++leafSize[triangles];
+            ++leaves;
+            references += triangles;
+        }
+    };
+
+    /**
+     * \brief Analyze the hierarchy over the triangles of the registered meshes
+     *
+     * Walks the entire hierarchy, hence this is meant for tools such as
+     * \c bvhstat rather than for use during rendering. Wide hierarchies are
+     * analyzed as they are stored, i.e. every wide node counts as a single
+     * inner node, and the bounds of compressed nodes are recomputed exactly.
+     */
+    virtual Statistics getStatistics() const;
+
+    /// Return the page cache of the leaf data (or \c nullptr if it is stored in memory)
+    const PageCache *getPageCache() const { return m_pageCache.get(); }
+
+    /// Return the page cache of the mesh buffers (or \c nullptr if they are stored in memory)
+    const PageCache *getMeshPageCache() const { return m_meshPageCache.get(); }
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene and
-     * return detailed intersection information
+     * return a hit record
      *
      * \param ray
      *    A 3-dimensional ray data structure with minimum/maximum extent
      *    information
      *
      * \param its
-     *    A detailed intersection record, which will be filled by the
-     *    intersection query
+     *    An intersection record, whose hit information (distance, mesh,
+     *    triangle, barycentric coordinates) will be filled by the intersection
+     *    query. Call \ref Intersection::finalize() to compute the rest.
      *
      * \param shadowRay
      *    \c true if this is a shadow ray query, i.e. a query that only aims to
      *    find out whether the ray is blocked or not without returning detailed
-     *    intersection information.
+     *    intersection information (equivalent to \ref rayOccluded()).
      *
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
 
-private:
-    Mesh         *m_mesh = nullptr; ///< Mesh (only a single one for now)
-    BoundingBox3f m_bbox;           ///< Bounding box of the entire scene
+    /**
+     * \brief Check whether a ray intersects any triangle stored in the scene
+     *
+     * This is a dedicated any-hit traversal for shadow rays: children are
+     * visited in storage order, the traversal terminates at the first
+     * intersection, and no intersection record is filled. Every thread
+     * remembers the triangle that occluded its most recent shadow ray and
+     * tests it before traversing the hierarchy.
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayOccluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Intersect a packet of rays against all triangles stored in
+     * the scene
+     *
+     * The rays are traversed together, so that every node is fetched only
+     * once for the entire packet. This works best when the rays are
+     * coherent (e.g. camera rays through neighboring pixels), in which case
+     * most nodes missed by the packet are culled using a single conservative
+     * test based on interval arithmetic.
+     *
+     * Packet traversal uses the binary hierarchy; other configurations (wide
+     * nodes, instancing) call \ref rayIntersect() for every ray.
+     *
+     * \param rays
+     *    An array of \c count rays
+     *
+     * \param count
+     *    The number of rays (at most \ref NORI_PACKET_SIZE)
+     *
+     * \param its
+     *    An array of \c count intersection records. Records of rays that
+     *    intersect the scene are filled by the intersection query
+     *
+     * \param shadowRay
+     *    \c true if this is a shadow ray query (see \ref rayIntersect())
+     *
+     * \return A bit mask, whose <tt>i</tt>-th bit is set when an intersection
+     *    was found for the <tt>i</tt>-th ray
+     */
+    uint32_t rayIntersectPacket(const Ray3f *rays, uint32_t count, Intersection *its,
+                                bool shadowRay) const;
+
+    /**
+     * \brief Intersect a large stream of (possibly incoherent) rays against
+     * all triangles stored in the scene
+     *
+     * The rays are sorted by direction octant and ray origin. Chunks of
+     * rays with the same octant are then filtered through the hierarchy
+     * together: every node is fetched once for all rays that reach it, and
+     * the triangles of a leaf are intersected with all of these rays in turn,
+     * while they are still in the cache. This amortizes the memory traffic
+     * of secondary rays (e.g. diffuse interreflection).
+     *
+     * Streams use the binary hierarchy; other configurations (wide
+     * nodes, instancing) call \ref rayIntersect() for every ray.
+     *
+     * \param rays
+     *    An array of \c count rays
+     *
+     * \param count
+     *    The number of rays
+     *
+     * \param its
+     *    An array of \c count intersection records. Records of rays that
+     *    intersect the scene are filled by the intersection query
+     *
+     * \param hits
+     *    An array of \c count flags, which specify whether an intersection
+     *    was found for the corresponding ray
+     *
+     * \param shadowRay
+     *    \c true if this is a shadow ray query (see \ref rayIntersect())
+     *
+     * \return The number of rays that intersect the scene
+     */
+    uint32_t intersectStream(const Ray3f *rays, uint32_t count, Intersection *its, bool *hits,
+                             bool shadowRay) const;
+
+    /// Return a string summary of the acceleration data structure
+    std::string toString() const;
+
+    EClassType getClassType() const { return EAccel; }
+
+protected:
+    friend class BVHBuilder;
+    friend class SpatialBVHBuilder;
+
+    /**
+     * \brief BVH node in 32 bytes
+     *
+     * The two children of an inner node are stored next to each other
+     * (starting at an even index, so that they share a cache line), and
+     * only the index of the first one needs to be recorded. Leaf nodes
+     * reference a contiguous range of \c m_indices.
+     *
+     * In lazily built hierarchies, leaves with the \c unbuilt flag cover
+     * a range of triangles that has not been split yet. Such a leaf is
+     * atomically replaced by an inner node (or a regular leaf) when a ray
+     * first enters it, see \ref expandNode().
+     *
+     * While a hierarchy is being built, the builders instead store the
+     * left child directly after its parent and the index of the right
+     * child in \c children (see \ref layoutNodes()).
+     */
+    struct BVHNode {
+        union {
+            struct {
+                unsigned flag : 1;
+                unsigned unbuilt : 1;  ///< Not split yet (lazy construction)
+                uint32_t size : 30;
+                uint32_t start;
+            } leaf;
+
+            struct {
+                unsigned flag : 1;
+                unsigned axis : 2;     ///< Split axis
+                unsigned reversed : 1; ///< Does the first child lie above the split (along \c axis)?
+                uint32_t unused : 28;
+                uint32_t children;     ///< Index of the first child
+            } inner;
+
+            uint64_t data;
+        };
+        BoundingBox3f bbox;
+
+        bool isLeaf() const {
+            return leaf.flag == 1;
+        }
+
+        bool isInner() const {
+            return leaf.flag == 0;
+        }
+
+        uint32_t start() const {
+            return leaf.start;
+        }
+
+        uint32_t end() const {
+            return leaf.start + leaf.size;
+        }
+    };
+
+    /**
+     * \brief Node storage of lazily built hierarchies
+     *
+     * The nodes are stored in fixed-size segments, which are allocated as
+     * \ref expandNode() creates nodes and never move. Other threads can thus
+     * keep traversing the hierarchy while it grows. Only the table of segment
+     * pointers is sized for the largest possible hierarchy up front.
+     */
+    class LazyNodes {
+    public:
+        /// Release all nodes
+        ~LazyNodes() { reset(0); }
+
+        /// Release all nodes and make room for at most \c capacity of them
+        void reset(size_t capacity);
+
+        /// Allocate a pair of nodes (sharing a segment) and return the index of the first one
+        uint32_t allocatePair();
+
+        /// Return the number of allocated nodes
+        uint32_t size() const { return m_size.load(); }
+
+        /// Return the memory used by the allocated segments (in bytes)
+        size_t memoryUsage() const;
+
+        /**
+         * \brief Access a node directly
+         *
+         * Only valid while no other thread splits nodes (e.g. for statistics
+         * and serialization), or for a node that is locked by the caller.
+         */
+        inline BVHNode &operator[](uint32_t idx) const;
+
+        /// Return the depth of a node within the hierarchy
+        inline uint8_t &depth(uint32_t idx) const;
+
+        /**
+         * \brief Copy a node that another thread may be splitting
+         *
+         * Its type and flags are read using a single atomic load (with acquire
+         * semantics), so that the children of an inner node are visible as well.
+         */
+        inline const BVHNode &load(uint32_t idx, BVHNode &copy) const;
+
+        /// Publish the new type and flags of a node, after its children were written
+        inline void store(uint32_t idx, uint64_t data) const;
+
+    private:
+        struct Segment;
+
+        inline Segment *segment(uint32_t idx) const;
+
+        std::unique_ptr<std::atomic<Segment *>[]> m_segments;
+        size_t m_segmentCount = 0;
+        std::atomic<uint32_t> m_size { 0 };
+    };
+
+    /// Per-ray constants of the vectorized slab test (see accel.cpp)
+    template <int Width> struct SlabRay;
+
+    /**
+     * \brief Per-ray constants of the watertight ray-triangle intersection test
+     *
+     * The coordinate axes are permuted so that \c kz is the dominant axis of
+     * the ray direction, and a shear transformation maps the ray direction
+     * onto the positive z axis. See "Watertight Ray/Triangle Intersection" by
+     * Woop, Benthin, and Wald (JCGT 2013).
+     */
+    struct PacketRay {
+        int kx, ky, kz;
+        float Sx, Sy, Sz;
+        float ox, oy, oz;
+
+        PacketRay() { }
+
+        PacketRay(const Ray3f &ray) {
+            Vector3f absD = ray.d.cwiseAbs();
+            kz = absD.x() > absD.y() ? (absD.x() > absD.z() ? 0 : 2)
+                                     : (absD.y() > absD.z() ? 1 : 2);
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+            if (ray.d[kz] < 0)
+                std::swap(kx, ky);
+
+            Sx = ray.d[kx] / ray.d[kz];
+            Sy = ray.d[ky] / ray.d[kz];
+            Sz = 1.0f / ray.d[kz];
+            ox = ray.o[kx];
+            oy = ray.o[ky];
+            oz = ray.o[kz];
+        }
+    };
+
+    /**
+     * \brief Node of a 4- or 8-wide BVH
+     *
+     * The bounding boxes of all children are stored in SoA form in the
+     * order <tt>minX, maxX, minY, maxY, minZ, maxZ</tt>. Unused slots have
+     * an empty bounding box, which never intersects a ray.
+     */
+    template <int Width> struct WideBVHNode {
+        float bounds[6][Width]; ///< Bounding boxes of the children
+        uint32_t child[Width];  ///< Wide node index or start of the triangle range
+        uint32_t size[Width];   ///< Number of triangles (leaves) or zero (inner nodes)
+
+        /// Intersect the ray with all children and return a bit mask of the hits
+        int intersect(const SlabRay<Width> &ray, float maxt, float *tNear) const;
+
+        /// Look up the wide node index or leaf range of the given child slot
+        void getChild(int i, uint32_t &child, uint32_t &size) const {
+            child = this->child[i];
+            size = this->size[i];
+        }
+
+        /// Is the given child slot unused?
+        bool isUnused(int i) const { return child[i] == (uint32_t) -1; }
+    };
+
+    /**
+     * \brief Compressed node of a 4- or 8-wide BVH
+     *
+     * The bounding boxes of the children are quantized to 8 bits per plane
+     * on a grid that spans the bounding box of the node itself, and whose
+     * spacing along each axis is a power of two. Inner children are stored
+     * consecutively starting at \c childBase, and the leaf children refer to
+     * consecutive ranges starting at \c leafBase. A bit mask and the leaf
+     * sizes thus suffice to locate every child.
+     */
+    template <int Width> struct QuantizedBVHNode {
+        float origin[3];          ///< Lower corner of the quantization grid
+        int8_t exponent[3];       ///< Grid spacing along each axis (base-2 exponent)
+        uint8_t innerMask;        ///< Bit mask of the slots that refer to inner nodes
+        uint32_t childBase;       ///< Index of the first inner child
+        uint32_t leafBase;        ///< Start of the first leaf range
+        uint8_t bounds[6][Width]; ///< Quantized bounding boxes of the children
+        uint8_t size[Width];      ///< Size of the leaf ranges (zero for inner nodes)
+
+        /// Intersect the ray with all children and return a bit mask of the hits
+        int intersect(const SlabRay<Width> &ray, float maxt, float *tNear) const;
+
+        /**
+         * \brief Quantize the bounding boxes of the children on a grid
+         * spanning \c bbox (empty boxes mark unused slots)
+         */
+        void setBounds(const BoundingBox3f &bbox, const BoundingBox3f *childBBoxes);
+
+        /// Look up the wide node index or leaf range of the given child slot
+        void getChild(int i, uint32_t &child, uint32_t &size) const {
+            child = leafBase;
+            size = this->size[i];
+            if (innerMask & (1 << i)) {
+                child = childBase;
+                for (int j = 0; j < i; ++j)
+                    child += (innerMask >> j) & 1;
+            } else {
+                for (int j = 0; j < i; ++j)
+                    child += this->size[j];
+            }
+        }
+
+        /// Is the given child slot unused?
+        bool isUnused(int i) const { return !(innerMask & (1 << i)) && size[i] == 0; }
+    };
+
+    typedef WideBVHNode<4> BVH4Node;
+    typedef WideBVHNode<8> BVH8Node;
+    typedef QuantizedBVHNode<4> QBVH4Node;
+    typedef QuantizedBVHNode<8> QBVH8Node;
+
+    /// Arrangement of the binary BVH nodes in memory (see the \c nodeLayout property in the constructor)
+    enum ENodeLayout {
+        EDepthFirst = 0,
+        EHotChild,
+        ETreelet
+    };
+
+    /// Bounding box and (unnormalized) SAH cost of a subtree, as computed by \ref refit()
+    struct SubtreeBounds {
+        BoundingBox3f bbox;
+        float cost = 0.0f;
+    };
+
+    /**
+     * \brief Packet of triangles that are intersected together
+     *
+     * Vertex positions are stored as <tt>p[vertex][axis][lane]</tt>. Unused
+     * lanes contain NaN vertices, which never intersect a ray.
+     */
+    template <int Width> struct TrianglePacket {
+        float p[3][3][Width];  ///< Vertex positions of all triangles
+        uint32_t index[Width]; ///< Global triangle index of every lane
+
+        /**
+         * \brief Intersect a ray with all triangles of the packet (see accel.cpp)
+         *
+         * Returns a bit mask of the triangles that are intersected within the
+         * segment <tt>[mint, maxt]</tt>. When \c t is given, the distances and
+         * barycentric coordinates of all lanes are stored in \c t, \c u, and \c v.
+         */
+        int intersect(const PacketRay &ray, float mint, float maxt, float *t = nullptr,
+                      float *u = nullptr, float *v = nullptr) const;
+    };
+
+    /// Range <tt>(first, size)</tt> of \c m_indices whose triangles are gathered into one packet
+    typedef std::pair<uint32_t, uint32_t> PacketRange;
+
+    /// SoA copy of a packet of rays that are traversed together (see raypacket.cpp)
+    struct RayPacket;
+
+    /// Triangle that most recently occluded a shadow ray
+    struct Occluder {
+        uint32_t instance; ///< Top-level entry (or <tt>(uint32_t) -1</tt> if the triangle is not in a bottom-level hierarchy)
+        uint32_t triangle; ///< Global triangle index (or <tt>(uint32_t) -1</tt> if unknown)
+
+        Occluder() : instance((uint32_t) -1), triangle((uint32_t) -1) { }
+    };
+
+    typedef tbb::enumerable_thread_specific<Occluder,
+        tbb::cache_aligned_allocator<Occluder>, tbb::ets_key_per_instance> OccluderCache;
+
+    /**
+     * \brief Compute the mesh and triangle indices corresponding to
+     * a primitive index used by the hierarchy
+     *
+     * Triangles of all meshes are numbered consecutively; \c m_meshOffset
+     * records the index of the first triangle of every mesh.
+     */
+    uint32_t findMesh(uint32_t &idx) const {
+        auto it = std::upper_bound(m_meshOffset.begin(), m_meshOffset.end(), idx) - 1;
+        idx -= *it;
+        return (uint32_t) (it - m_meshOffset.begin());
+    }
+
+    /**
+     * \brief Record an access to the buffers of the given triangles (given
+     * as primitive indices) if their meshes are paged (see \ref Mesh::touch())
+     */
+    void touchTriangles(const uint32_t *indices, uint32_t count) const;
+
+    /// Find the closest intersection with the triangles of the registered meshes
+    virtual bool traverseTriangles(Ray3f &ray, Intersection &its, uint32_t &f, bool shadowRay) const;
+
+    /// Find the closest intersection with the registered mesh instances
+    bool traverseInstances(Ray3f &ray, Intersection &its, uint32_t &f,
+                           const Instance *&instance, bool shadowRay) const;
+
+    /// Create a bottom-level hierarchy for a mesh (with the parameters of this one)
+    std::unique_ptr<Accel> createMeshAccel(Mesh *mesh) const;
+
+    /**
+     * \brief Create (but do not build) a bottom-level hierarchy for every
+     * distinct instanced mesh (and every registered mesh if \c m_meshHierarchies)
+     *
+     * Hierarchies that were already built using \ref buildMesh() are reused.
+     */
+    void createInstanceAccels();
+
+    /// Return the world-space bounds of an entry of the top-level hierarchy (an instance or a mesh)
+    BoundingBox3f getEntryBoundingBox(uint32_t idx) const;
+
+    /// Build the bottom-level hierarchies and the top-level hierarchy over all instances
+    void buildInstances();
+
+    /// Build the hierarchy over the triangles of the registered meshes
+    virtual void buildTriangles();
+
+    /// Build the top-level hierarchy over the instances
+    void buildTopLevel();
+
+    /**
+     * \brief Store a binary hierarchy in the given layout
+     *
+     * \c nodes refers to a hierarchy in the format used during construction
+     * (see \ref BVHNode), rooted at index 0. The root of the result is stored
+     * at index 0 as well, and all pairs of children start at even indices.
+     */
+    static void layoutNodes(const BVHNode *nodes, NodeVector<BVHNode> &output, ENodeLayout layout);
+
+    /**
+     * \brief Prepare the expansion of a lazily built hierarchy
+     *
+     * The nodes that were already created (at least the root and the padding
+     * after it) must be stored in \c m_nodes. They are moved to
+     * \c m_lazyNodes, which receives the nodes created by \ref expandNode().
+     */
+    void prepareExpansion();
+
+    /**
+     * \brief Split an unbuilt leaf of a lazily built hierarchy
+     *
+     * Partitions the triangles of the leaf using binned SAH and atomically
+     * replaces it by an inner node with two unbuilt children (or by a regular
+     * leaf if splitting does not pay off). Only one thread splits any given
+     * node, while others that reach it wait; all remaining threads continue
+     * their traversal. Returns immediately if the node was already split.
+     */
+    void expandNode(uint32_t nodeIdx) const;
+
+    /// Return the depth of a binary hierarchy, i.e. the maximum number of entries on its traversal stack
+    static uint32_t stackDepth(const NodeVector<BVHNode> &nodes);
+
+    /**
+     * \brief Recompute the bounds of all nodes over the triangles of the
+     * registered meshes and return the SAH cost of the hierarchy
+     *
+     * When \c store is \c false, the nodes are not modified.
+     */
+    float updateBounds(bool store);
+
+    /// Recompute the bounds of the top-level nodes and return the SAH cost of the hierarchy
+    float updateInstanceBounds(bool store);
+
+    /// Return the bounding box of the triangles of a leaf
+    BoundingBox3f leafBounds(uint32_t start, uint32_t size) const;
+
+    /// Return the number of triangles of a leaf (excluding the padding lanes of packets)
+    uint32_t leafTriangleCount(uint32_t start, uint32_t size) const;
+
+    /// Return the memory used by the triangle indices and packets of the leaves
+    size_t leafMemory() const;
+
+    /// Gather the statistics of the binary hierarchy below the given node (see \ref getStatistics())
+    void binaryStatistics(uint32_t nodeIdx, uint32_t depth, Statistics &stats) const;
+
+    /// Gather the statistics of the wide hierarchy below the given node and return its bounds
+    template <int Width, typename Node> BoundingBox3f wideStatistics(uint32_t nodeIdx, uint32_t depth,
+                                                                     Statistics &stats) const;
+
+    /// Refit the binary hierarchy below the given node (leaf bounds are provided by a callback)
+    template <typename LeafBounds> SubtreeBounds refitBinary(NodeVector<BVHNode> &nodes,
+        uint32_t nodeIdx, const LeafBounds &leafBounds, bool store, uint32_t depth);
+
+    /// Refit the wide hierarchy below the given node
+    template <int Width> SubtreeBounds refitWide(uint32_t nodeIdx, bool store, uint32_t depth);
+
+    /// Refit the compressed wide hierarchy below the given node (children are requantized)
+    template <int Width> SubtreeBounds refitCompressed(uint32_t nodeIdx, bool store, uint32_t depth);
+
+    /// Copy the current vertex positions of the meshes into the triangle packets
+    template <int Width> void refitPackets();
+
+    /// Read the hierarchy from a snapshot (see \ref unserialize())
+    void load(Snapshot &snapshot);
+
+    /// Write the hierarchy over the triangles of the registered meshes to a snapshot
+    virtual void serializeTriangles(Snapshot &snapshot) const;
+
+    /// Read the hierarchy over the triangles of the registered meshes from a snapshot
+    virtual void loadTriangles(Snapshot &snapshot);
+
+    /// Traverse the binary hierarchy with a packet of rays and return a bit mask of the hits
+    uint32_t traversePacket(RayPacket &packet, bool shadowRay) const;
+
+    /// Check whether the ray intersects any triangle of the registered meshes and return the occluder
+    virtual bool occludedTriangles(const Ray3f &ray, uint32_t &triangle) const;
+
+    /// Check whether the ray intersects any of the registered mesh instances and return the occluder
+    bool occludedInstances(const Ray3f &ray, Occluder &occluder) const;
+
+    /// Check whether the ray intersects the triangle with the given global index (using the test of the leaves)
+    bool occludedBy(const Ray3f &ray, uint32_t triangle) const;
+
+    /// Any-hit traversal of the binary hierarchy
+    bool occludedBinary(const PacketRay &pray, const Ray3f &ray, uint32_t &triangle) const;
+
+    /// Any-hit traversal of the wide hierarchy with the given branching factor and node type
+    template <int Width, typename Node>
+    bool occludedWide(const PacketRay &pray, const Ray3f &ray, uint32_t &triangle) const;
+
+    /// Check whether the ray intersects any triangle (packet) of a leaf
+    bool occludedLeaf(uint32_t start, uint32_t end, const PacketRay &pray, const Ray3f &ray,
+                      uint32_t &triangle) const;
+
+    /// Traverse the binary hierarchy
+    bool traverseBinary(const PacketRay &pray, Ray3f &ray, Intersection &its, uint32_t &f,
+                        bool shadowRay) const;
+
+    /// Traverse the wide hierarchy with the given branching factor and node type
+    template <int Width, typename Node>
+    bool traverseWide(const PacketRay &pray, Ray3f &ray, Intersection &its, uint32_t &f,
+                      bool shadowRay) const;
+
+    /**
+     * \brief Intersect the ray against the triangles of a leaf node
+     *
+     * Depending on \c m_packetWidth, <tt>[start, end)</tt> either refers to
+     * a range of \c m_indices or to a range of triangle packets.
+     */
+    bool intersectLeaf(uint32_t start, uint32_t end, const PacketRay &pray, Ray3f &ray,
+                       Intersection &its, uint32_t &f, bool shadowRay) const;
+
+    /// Intersect the ray against a range of triangle packets
+    template <int Width> bool intersectPackets(uint32_t start, uint32_t end, const PacketRay &pray,
+                                               Ray3f &ray, Intersection &its, uint32_t &f,
+                                               bool shadowRay) const;
+
+    /**
+     * \brief Split the triangles of all leaves into packets and point the
+     * leaves to them
+     *
+     * The triangles of every packet are returned in \c ranges. Unless the
+     * leaf data is paged (in which case \ref pageLeaves() generates them),
+     * the packets are also created in memory.
+     */
+    template <int Width> void buildPackets(std::vector<PacketRange> &ranges);
+
+    /// Create the triangle packets in memory from the ranges computed by \ref buildPackets()
+    template <int Width> void fillPackets(const std::vector<PacketRange> &ranges);
+
+    /**
+     * \brief Move the triangle packets and the mesh buffers into page files
+     * if the \c pageBudget property is set
+     *
+     * When \c ranges is not empty, the packets were not created in memory:
+     * they are generated from the ranges and written to the page file one
+     * page at a time. The meshes are paged using \ref Mesh::page(), and the
+     * budget is split between both files in proportion to their sizes.
+     */
+    void pageLeaves(const std::vector<PacketRange> &ranges = std::vector<PacketRange>());
+
+    /// Write the triangle packets to the page file (see \ref pageLeaves())
+    template <int Width> void writePackets(const std::vector<PacketRange> &ranges);
+
+    /**
+     * \brief Return the triangle packets <tt>[start, end)</tt> of a leaf
+     *
+     * The result points to the packet with index \c start. When the leaf data
+     * is paged, the access is recorded by the page cache.
+     */
+    template <int Width> const TrianglePacket<Width> *leafPackets(uint32_t start, uint32_t end) const;
+
+    /// Write the triangle packets (which may be paged) to a snapshot
+    template <int Width> void serializePackets(Snapshot &snapshot) const;
+
+    /**
+     * \brief Copy the triangles <tt>m_indices[first, first + size)</tt> into
+     * a packet (at most \c Width of them, the remaining lanes are padded)
+     */
+    template <int Width> void fillPacket(TrianglePacket<Width> &packet, uint32_t first,
+                                         uint32_t size) const;
+
+    /**
+     * \brief Clip the triangle with vertices \c p against the plane
+     * <tt>p[axis] == pos</tt>
+     *
+     * The resulting bounds cover the part of the triangle on either side
+     * of the plane, clipped to \c bbox. A side that the triangle does not
+     * reach receives an invalid bounding box.
+     */
+    static void splitTriangle(const Point3f *p, const BoundingBox3f &bbox, int axis, float pos,
+                              BoundingBox3f &left, BoundingBox3f &right);
+
+    /// Return the triangle packets with the given width
+    template <int Width> std::vector<TrianglePacket<Width>> &trianglePackets();
+
+    /// Return the triangle packets with the given width (const version)
+    template <int Width> const std::vector<TrianglePacket<Width>> &trianglePackets() const;
+
+    /**
+     * \brief Select the binary nodes that become the children of a wide node
+     *
+     * Starting from the children of \c nodeIdx, the inner node with the
+     * largest surface area is repeatedly replaced by its two children until
+     * all \c Width slots are occupied. Returns the number of children.
+     */
+    template <int Width> uint32_t collapseChildren(uint32_t nodeIdx, uint32_t *children) const;
+
+    /// Collapse the binary hierarchy below the given node into a wide hierarchy
+    template <int Width> uint32_t collapse(uint32_t nodeIdx);
+
+    /**
+     * \brief Collapse the binary hierarchy below the given node into a
+     * compressed wide hierarchy
+     *
+     * The node is written to index \c targetIdx. The leaf ranges are
+     * appended to \c leaves in the order required by the compressed
+     * nodes, and \c leafCount tracks their total size.
+     */
+    template <int Width> void compress(uint32_t nodeIdx, uint32_t targetIdx,
+        std::vector<std::pair<uint32_t, uint32_t>> &leaves, uint32_t &leafCount);
+
+    /// Return the node array of a wide hierarchy with the given node type
+    template <typename Node> NodeVector<Node> &wideNodes();
+
+    /// Return the node array of a wide hierarchy with the given node type (const version)
+    template <typename Node> const NodeVector<Node> &wideNodes() const;
+
+
+    int m_width;                               ///< Branching factor of the hierarchy
+    int m_packetWidth;                         ///< Triangles per leaf packet (0: no packets)
+    bool m_compressed;                         ///< Use quantized wide nodes?
+    bool m_spatialSplits;                      ///< Build a spatial split BVH?
+    bool m_fastBuild;                          ///< Build a linear BVH instead of using the SAH?
+    bool m_lazyBuild;                          ///< Split the nodes when rays first enter them?
+    bool m_meshHierarchies;                    ///< Give every mesh its own bottom-level hierarchy?
+    bool m_bottomLevel = false;                ///< Bottom-level hierarchy (possibly built concurrently with others)?
+    ENodeLayout m_layout;                      ///< Arrangement of the binary BVH nodes in memory
+    float m_splitBudget;                       ///< Maximum fraction of duplicated triangle references
+    float m_rebuildThreshold;                  ///< Relative SAH cost increase that triggers a rebuild
+    float m_pageBudget;                        ///< Memory budget of the paged leaf data and meshes in MiB (0: not paged)
+    std::string m_pageDirectory;               ///< Directory of the page file
+    float m_sahCost = 0.0f;                    ///< SAH cost of the hierarchy after the last build
+    uint32_t m_stackDepth = 0;                 ///< Depth of the hierarchy (bounds the traversal stack)
+    std::vector<Mesh *> m_meshes;              ///< List of meshes registered with the BVH
+    std::vector<uint32_t> m_meshOffset;        ///< Index of the first triangle for each mesh
+    NodeVector<BVHNode> m_nodes;               ///< BVH nodes (the root is stored at index 0)
+    NodeVector<BVH4Node> m_nodes4;             ///< Collapsed BVH4 nodes (if \c m_width == 4)
+    NodeVector<BVH8Node> m_nodes8;             ///< Collapsed BVH8 nodes (if \c m_width == 8)
+    NodeVector<QBVH4Node> m_qnodes4;           ///< Compressed BVH4 nodes (if \c m_compressed)
+    NodeVector<QBVH8Node> m_qnodes8;           ///< Compressed BVH8 nodes (if \c m_compressed)
+    std::vector<uint32_t> m_indices;           ///< Triangle indices referenced by leaf nodes
+    std::vector<TrianglePacket<4>> m_packets4; ///< Leaf triangles (if \c m_packetWidth == 4)
+    std::vector<TrianglePacket<8>> m_packets8; ///< Leaf triangles (if \c m_packetWidth == 8)
+    std::unique_ptr<PageCache> m_pageCache;    ///< Paged leaf triangles (replacing the above)
+    std::shared_ptr<PageCache> m_meshPageCache; ///< Paged buffers of the meshes (see \ref Mesh::page())
+    BoundingBox3f m_bbox;                      ///< Bounding box of the entire scene
+    mutable OccluderCache m_occluderCache;     ///< Per-thread most recent shadow ray occluder
+
+    mutable LazyNodes m_lazyNodes;                ///< Nodes of a lazily built hierarchy (replacing \c m_nodes)
+    std::unique_ptr<std::mutex[]> m_expandMutex;  ///< Locks of the nodes that are being split (lazy construction)
+    mutable std::atomic<uint32_t> m_lazyDepth { 0 }; ///< Deepest level of \c m_lazyNodes so far
+
+    PropertyList m_propList;                          ///< Parameters of the bottom-level hierarchies
+    std::vector<Instance *> m_instances;              ///< Registered mesh instances
+    std::vector<const Accel *> m_instanceAccel;       ///< Bottom-level hierarchy of every top-level entry (instances, then meshes)
+    std::vector<std::unique_ptr<Accel>> m_meshAccels; ///< Bottom-level hierarchies (one per mesh)
+    std::map<const Mesh *, std::unique_ptr<Accel>> m_builtMeshAccels; ///< Built by \ref buildMesh() (not yet in use)
+    std::mutex m_builtMeshMutex;                      ///< Protects \c m_builtMeshAccels
+    NodeVector<BVHNode> m_instanceNodes;              ///< Top-level hierarchy over the instances
+    std::vector<uint32_t> m_instanceIndices;          ///< Instance indices referenced by top-level leaves
+    float m_instanceSahCost = 0.0f;                   ///< SAH cost of the top-level hierarchy after the last build
 };
 
 NORI_NAMESPACE_END
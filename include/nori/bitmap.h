@@ -20,6 +20,7 @@
 
 #include <nori/color.h>
 #include <nori/vector.h>
+#include <map>
 
 NORI_NAMESPACE_BEGIN
 
@@ -32,6 +33,9 @@ class Bitmap : public Eigen::Array<Color3f, Eigen::Dynamic, Eigen::Dynamic, Eige
 public:
     typedef Eigen::Array<Color3f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Base;
 
+    /// Single-channel image, e.g. an additional layer of an OpenEXR file
+    typedef Eigen::Array<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Channel;
+
     /**
      * \brief Allocate a new bitmap of the specified size
      *
@@ -44,8 +48,15 @@ public:
     /// Load an OpenEXR file with the specified filename
     Bitmap(const std::string &filename);
 
-    /// Save the bitmap as an EXR file with the specified filename
-    void saveEXR(const std::string &filename);
+    /**
+     * \brief Save the bitmap as an EXR file with the specified filename
+     *
+     * \c extra optionally maps the names of additional channels (e.g.
+     * <tt>"cost.nodes"</tt> for the channel \c nodes of the layer \c cost)
+     * to images of the same size, which are stored next to the RGB data.
+     */
+    void saveEXR(const std::string &filename,
+                 const std::map<std::string, Channel> &extra = std::map<std::string, Channel>());
 
     /// Save the bitmap as a PNG file (with sRGB tonemapping) with the specified filename
     void savePNG(const std::string &filename);
@@ -0,0 +1,425 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/accel.h>
+#include <atomic>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+/* Parameters of the SAH-based BVH construction */
+#define BVH_BIN_COUNT          32     /* Number of bins per axis */
+#define BVH_TRAVERSAL_COST     1.0f   /* Relative cost of a node traversal */
+#define BVH_INTERSECTION_COST  1.0f   /* Relative cost of a triangle (packet) test */
+#define BVH_MAX_LEAF_SIZE      8      /* Leaves are split beyond this size */
+#define BVH_MAX_DEPTH          60     /* Bounds the size of the traversal stack */
+#define BVH_SWEEP_SIZE         32     /* Nodes up to this size use an exact SAH sweep */
+#define BVH_PARALLEL_TASK_SIZE 4096   /* Subtrees below this size are built serially */
+#define BVH_PARALLEL_BIN_SIZE  65536  /* Nodes above this size are binned in parallel */
+#define BVH_LINEAR_LEAF_SIZE   4      /* Leaf size of linear BVHs */
+#define BVH_MORTON_SIZE        65536  /* Linear BVHs over more triangles use 63-bit Morton codes */
+#define BVH_RADIX_BLOCK_SIZE   16384  /* Elements per task of the parallel radix sort */
+#define BVH_LAZY_SEGMENT_BITS  12     /* Lazily built hierarchies allocate 2^12 nodes (128 KiB) at a time */
+
+/* Parameters of the spatial split BVH construction */
+#define SBVH_BIN_COUNT         16     /* Number of spatial bins per axis */
+#define SBVH_OVERLAP_THRESHOLD 1e-5f  /* Minimum child overlap (relative to the root area) for spatial splits */
+
+/// Interleave the lower 10 bits of \c x with zeros (i.e. bit i moves to position 3i)
+inline uint32_t expandBits(uint32_t x) {
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x <<  8)) & 0x0300F00F;
+    x = (x | (x <<  4)) & 0x030C30C3;
+    x = (x | (x <<  2)) & 0x09249249;
+    return x;
+}
+
+/// Interleave the lower 21 bits of \c x with zeros (i.e. bit i moves to position 3i)
+inline uint64_t expandBits64(uint64_t x) {
+    x &= 0x1FFFFF;
+    x = (x | (x << 32)) & 0x001F00000000FFFFull;
+    x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+    x = (x | (x <<  8)) & 0x100F00F00F00F00Full;
+    x = (x | (x <<  4)) & 0x10C30C30C30C30C3ull;
+    x = (x | (x <<  2)) & 0x1249249249249249ull;
+    return x;
+}
+
+/**
+ * \brief Parallel top-down BVH builder based on the binned surface area heuristic
+ *
+ * Triangle bounds and centroids are precomputed once, after which the
+ * builder recursively partitions \ref Accel::m_indices. The two subtrees
+ * of large nodes are constructed as separate TBB tasks, and the binning
+ * pass of the nodes close to the root is itself parallelized.
+ *
+ * A subtree over \c n triangles never needs more than <tt>2n-1</tt> nodes,
+ * hence every task can write into a disjoint, precomputed range of a
+ * temporary node array without any synchronization. Once all tasks have
+ * finished, the nodes are copied into the output array in the node layout
+ * selected by the \ref Accel (see \ref Accel::layoutNodes()).
+ *
+ * When leaves are stored as SIMD triangle packets, the SAH cost of a leaf
+ * is based on the number of packets rather than the number of triangles.
+ * The builder is also used for the top-level hierarchy over mesh instances,
+ * in which case the primitives are the world-space bounds of the instances.
+ *
+ * When build latency matters more than traversal performance, \ref
+ * buildLinear() constructs a linear BVH (LBVH) instead: the triangles are
+ * radix-sorted along a Morton curve through their centroids, and every
+ * node is split where the highest differing bit of the codes changes.
+ */
+class BVHBuilder {
+public:
+    /// Per-axis bins, which record the triangle count and bounds of each bin
+    struct Bins {
+        BoundingBox3f bbox[3][BVH_BIN_COUNT];
+        BoundingBox3f centroidBBox[3][BVH_BIN_COUNT];
+        uint32_t count[3][BVH_BIN_COUNT];
+
+        Bins() { memset(count, 0, sizeof(count)); }
+
+        void merge(const Bins &bins) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int i = 0; i < BVH_BIN_COUNT; ++i) {
+                    bbox[axis][i].expandBy(bins.bbox[axis][i]);
+                    centroidBBox[axis][i].expandBy(bins.centroidBBox[axis][i]);
+                    count[axis][i] += bins.count[axis][i];
+                }
+            }
+        }
+    };
+
+    /// Bounding boxes of a range of triangles and of their centroids
+    struct Bounds {
+        BoundingBox3f bbox, centroidBBox;
+
+        void merge(const Bounds &bounds) {
+            bbox.expandBy(bounds.bbox);
+            centroidBBox.expandBy(bounds.centroidBBox);
+        }
+    };
+
+    /// Candidate split of a node into two children
+    struct Split {
+        int axis = -1;
+        uint32_t mid = 0;
+        float cost = std::numeric_limits<float>::infinity();
+        Bounds left, right;
+    };
+
+    /**
+     * \brief Find the best SAH split among the boundaries of the given bins
+     *
+     * \c size is the number of binned triangles, and \c blockSize the number
+     * of triangles per packet. Returns a split whose \c axis is -1 if all
+     * centroids coincide. Otherwise, \c bestBin receives the last bin of the
+     * left child; the triangles themselves are not partitioned (\c mid is unset).
+     */
+    static Split findBinSplit(const Bins &bins, const Bounds &bounds, uint32_t size,
+                              uint32_t blockSize, int &bestBin);
+
+    /// Scale factors that map centroid coordinates to bin indices
+    static Vector3f binScale(const BoundingBox3f &centroidBBox) {
+        Vector3f extents = centroidBBox.getExtents();
+        Vector3f scale;
+        for (int axis = 0; axis < 3; ++axis)
+            scale[axis] = extents[axis] > 0 ? BVH_BIN_COUNT / extents[axis] : 0.0f;
+        return scale;
+    }
+
+    /// Bin of a centroid coordinate
+    static int binIndex(float value, float min, float scale) {
+        return std::min((int) ((value - min) * scale), BVH_BIN_COUNT - 1);
+    }
+
+    /// Prepare the construction of a hierarchy over the triangles of all meshes registered with \c accel
+    BVHBuilder(Accel &accel);
+
+    /**
+     * \brief Prepare the construction of a hierarchy over arbitrary
+     * primitives with the given bounding boxes
+     *
+     * \c indices must contain a permutation of the primitive indices,
+     * and the finished hierarchy is written to \c output using the given layout.
+     */
+    BVHBuilder(const std::vector<BoundingBox3f> &bboxes, std::vector<uint32_t> &indices,
+               NodeVector<Accel::BVHNode> &output, Accel::ENodeLayout layout);
+
+    /// Build the full hierarchy and store it in the output array
+    void build();
+
+    /// Build a linear BVH (see the class description) and store it in the output array
+    void buildLinear();
+
+protected:
+    /// Compute the bounds of the triangles referenced by <tt>m_indices[start, end)</tt>
+    Bounds computeBounds(uint32_t start, uint32_t end) const;
+
+    /// Sort the triangles of <tt>m_indices[start, end)</tt> into bins along all three axes
+    void computeBins(uint32_t start, uint32_t end, const BoundingBox3f &centroidBBox, Bins &bins) const;
+
+    /**
+     * \brief Find the best SAH split by binning the triangle centroids
+     *
+     * On success, <tt>m_indices[start, end)</tt> is partitioned accordingly.
+     */
+    Split binnedSAH(uint32_t start, uint32_t end, const Bounds &bounds);
+
+    /**
+     * \brief Find the best SAH split by sorting the triangles along each axis
+     *
+     * This is used for small nodes, where an exact sweep is cheaper than
+     * binning. <tt>m_indices[start, end)</tt> is left sorted along the
+     * chosen axis.
+     */
+    Split sweepSAH(uint32_t start, uint32_t end, const Bounds &bounds);
+
+    /// Sort <tt>m_indices[start, end)</tt> by centroid position (ties are broken by index)
+    void sortAlongAxis(uint32_t start, uint32_t end, int axis);
+
+    /**
+     * \brief Build the subtree covering <tt>m_indices[start, end)</tt>
+     *
+     * The subtree is written to the temporary node array starting at
+     * \c nodeIdx and occupies at most <tt>2*(end-start)-1</tt> entries.
+     */
+    void build(uint32_t nodeIdx, uint32_t start, uint32_t end, const Bounds &bounds, uint32_t depth);
+
+    /**
+     * \brief Sort \c m_indices along a Morton curve through the centroids
+     *
+     * Uses 30-bit codes, or 63-bit codes for more than \c BVH_MORTON_SIZE
+     * triangles. The sorted codes are stored in \c m_codes.
+     */
+    void sortMorton(const BoundingBox3f &centroidBBox);
+
+    /**
+     * \brief Build the linear subtree covering <tt>m_indices[start, end)</tt>
+     * and return its bounding box
+     *
+     * Uses the same temporary node layout as \ref build().
+     */
+    BoundingBox3f buildLinear(uint32_t nodeIdx, uint32_t start, uint32_t end, uint32_t depth);
+
+    /// Number of triangle packets needed to store the given number of triangles
+    uint32_t blocks(uint32_t count) const {
+        return (count + m_blockSize - 1) / m_blockSize;
+    }
+
+    void makeLeaf(Accel::BVHNode &node, uint32_t start, uint32_t size) {
+        node.leaf.flag = 1;
+        node.leaf.size = size;
+        node.leaf.start = start;
+        m_nodeCount++;
+    }
+
+private:
+    std::vector<uint32_t> &m_indices;
+    NodeVector<Accel::BVHNode> &m_output;
+    Accel::ENodeLayout m_layout;
+    std::vector<BoundingBox3f> m_bboxes;
+    std::vector<Point3f> m_centroids;
+    std::vector<Accel::BVHNode> m_nodes;
+    std::vector<uint64_t> m_codes; ///< Sorted Morton codes (only used by \ref buildLinear())
+    uint32_t m_blockSize;
+    std::atomic<uint32_t> m_nodeCount { 0 };
+};
+
+/**
+ * \brief Parallel top-down builder of a spatial split BVH (SBVH)
+ *
+ * Follows "Spatial Splits in Bounding Volume Hierarchies" by Stich et al.
+ * In addition to the binned object partitions of \ref BVHBuilder, the
+ * builder considers splitting a node with an axis-aligned plane. Triangles
+ * straddling the plane are then referenced by both children, each of which
+ * only stores the bounds of the clipped part of the triangle. This removes
+ * most of the overlap caused by long and thin triangles, at the cost of
+ * duplicating their indices in several leaves.
+ *
+ * Spatial splits are only evaluated when the children of the best object
+ * split overlap significantly, and the total number of duplicated
+ * references is bounded by a fraction of the triangle count (the
+ * \c splitBudget property of \ref Accel). Since the size of the subtrees is
+ * not known in advance, every node records its own references and the
+ * finished tree is flattened into \ref Accel::m_nodes and
+ * \ref Accel::m_indices in depth-first order.
+ */
+class SpatialBVHBuilder {
+public:
+    /// (Possibly clipped) reference to a triangle
+    struct Reference {
+        uint32_t idx;
+        BoundingBox3f bbox;
+    };
+
+    /// Node of the temporary hierarchy
+    struct Node {
+        BoundingBox3f bbox;
+        int axis = -1;                 ///< Split axis (-1 for leaves)
+        std::unique_ptr<Node> left;    ///< Left child (inner nodes)
+        std::unique_ptr<Node> right;   ///< Right child (inner nodes)
+        std::vector<uint32_t> indices; ///< Referenced triangles (leaves)
+    };
+
+    /// Per-axis spatial bins, which record the clipped bounds and the entering/exiting references
+    struct SpatialBins {
+        BoundingBox3f bbox[3][SBVH_BIN_COUNT];
+        uint32_t enter[3][SBVH_BIN_COUNT];
+        uint32_t exit[3][SBVH_BIN_COUNT];
+
+        SpatialBins() {
+            memset(enter, 0, sizeof(enter));
+            memset(exit, 0, sizeof(exit));
+        }
+
+        void merge(const SpatialBins &bins) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int i = 0; i < SBVH_BIN_COUNT; ++i) {
+                    bbox[axis][i].expandBy(bins.bbox[axis][i]);
+                    enter[axis][i] += bins.enter[axis][i];
+                    exit[axis][i] += bins.exit[axis][i];
+                }
+            }
+        }
+    };
+
+    /// Candidate split of a node into two children
+    struct Split {
+        int axis = -1;
+        bool spatial = false;
+        float pos = 0.0f;      ///< Split plane (spatial splits)
+        int bin = -1;          ///< Last bin of the left child (object splits)
+        float cost = std::numeric_limits<float>::infinity();
+        BoundingBox3f left, right;
+        uint32_t leftCount = 0, rightCount = 0;
+    };
+
+    /// Prepare the construction of a hierarchy over the triangles of all meshes registered with \c accel
+    SpatialBVHBuilder(Accel &accel)
+        : m_accel(accel), m_blockSize(std::max(accel.m_packetWidth, 1)),
+          m_maxDuplicates((uint32_t) std::min(accel.m_splitBudget * accel.getTriangleCount(), 1e9f)) { }
+
+    /// Build the full hierarchy and store it in depth-first order
+    void build();
+
+    /// Return the number of triangle references that were duplicated by spatial splits
+    uint32_t getDuplicateCount() const { return m_duplicates; }
+
+protected:
+    /// Surface area of a bounding box (zero if it is empty)
+    static float area(const BoundingBox3f &bbox) {
+        return bbox.isValid() ? bbox.getSurfaceArea() : 0.0f;
+    }
+
+    /**
+     * \brief Split a triangle reference with the plane <tt>p[axis] == pos</tt>
+     *
+     * The resulting bounds cover the part of the triangle on either side
+     * of the plane, clipped to the bounds of the original reference.
+     */
+    void splitReference(const Reference &ref, int axis, float pos,
+                        BoundingBox3f &left, BoundingBox3f &right) const {
+        Accel::splitTriangle(&m_vertices[3 * ref.idx], ref.bbox, axis, pos, left, right);
+    }
+
+    /// Find the best object split by binning the reference centroids
+    Split objectSplit(const std::vector<Reference> &refs, const BoundingBox3f &centroidBBox) const;
+
+    /// Find the best spatial split by chopping the references into bins along all three axes
+    Split spatialSplit(const std::vector<Reference> &refs, const BoundingBox3f &nodeBBox) const;
+
+    /**
+     * \brief Distribute the references among the two children of a spatial split
+     *
+     * A straddling reference is only split when this is cheaper (in terms
+     * of the SAH) than placing it entirely into one of the children
+     * ("reference unsplitting"). Returns the number of duplicated references.
+     */
+    uint32_t partitionSpatial(std::vector<Reference> &refs, Split &split,
+                              std::vector<Reference> &leftRefs, std::vector<Reference> &rightRefs) const;
+
+    /// Build the subtree over the given references (whose storage is released)
+    void build(Node &node, std::vector<Reference> &refs, const BoundingBox3f &bbox, uint32_t depth);
+
+    void makeLeaf(Node &node, std::vector<Reference> &refs) {
+        node.indices.reserve(refs.size());
+        for (const Reference &ref : refs)
+            node.indices.push_back(ref.idx);
+        std::vector<Reference>().swap(refs);
+    }
+
+    /// Append the subtree to \c nodes and to the index array of the \ref Accel in depth-first order
+    uint32_t flatten(const Node &node, std::vector<Accel::BVHNode> &nodes);
+
+    /// Number of triangle packets needed to store the given number of triangles
+    uint32_t blocks(uint32_t count) const {
+        return (count + m_blockSize - 1) / m_blockSize;
+    }
+
+    static int binIndex(float value, float min, float scale) {
+        return std::min((int) ((value - min) * scale), BVH_BIN_COUNT - 1);
+    }
+
+    static int spatialBinIndex(float value, float min, float invBinSize) {
+        return clamp((int) ((value - min) * invBinSize), 0, SBVH_BIN_COUNT - 1);
+    }
+
+private:
+    Accel &m_accel;
+    std::vector<Point3f> m_vertices; ///< Vertex positions of all triangles (used for clipping)
+    uint32_t m_blockSize;
+    uint32_t m_maxDuplicates;
+    float m_rootArea = 0.0f;
+    std::atomic<uint32_t> m_duplicates { 0 };
+    std::atomic<uint32_t> m_nodeCount { 0 };
+};
+
+/// Fixed-size block of the node storage of lazily built hierarchies (see \ref Accel::LazyNodes)
+struct Accel::LazyNodes::Segment {
+    BVHNode nodes[1u << BVH_LAZY_SEGMENT_BITS];
+    uint8_t depth[1u << BVH_LAZY_SEGMENT_BITS];
+};
+
+inline Accel::LazyNodes::Segment *Accel::LazyNodes::segment(uint32_t idx) const {
+    return m_segments[idx >> BVH_LAZY_SEGMENT_BITS].load(std::memory_order_acquire);
+}
+
+inline Accel::BVHNode &Accel::LazyNodes::operator[](uint32_t idx) const {
+    return segment(idx)->nodes[idx & ((1u << BVH_LAZY_SEGMENT_BITS) - 1)];
+}
+
+inline uint8_t &Accel::LazyNodes::depth(uint32_t idx) const {
+    return segment(idx)->depth[idx & ((1u << BVH_LAZY_SEGMENT_BITS) - 1)];
+}
+
+inline const Accel::BVHNode &Accel::LazyNodes::load(uint32_t idx, BVHNode &copy) const {
+    const BVHNode &node = operator[](idx);
+    copy.data = reinterpret_cast<const std::atomic<uint64_t> &>(node.data).load(std::memory_order_acquire);
+    copy.bbox = node.bbox; /* Never changes after the node was published */
+    return copy;
+}
+
+inline void Accel::LazyNodes::store(uint32_t idx, uint64_t data) const {
+    reinterpret_cast<std::atomic<uint64_t> &>(operator[](idx).data).store(data, std::memory_order_release);
+}
+
+NORI_NAMESPACE_END
@@ -117,12 +117,15 @@ typedef TRay<Point2f, Vector2f> Ray2f;
 typedef TRay<Point3f, Vector3f> Ray3f;
 
 /// Some more forward declarations
+class Accel;
 class BSDF;
 class Bitmap;
 class BlockGenerator;
 class Camera;
 class ImageBlock;
+class Instance;
 class Integrator;
+struct Intersection;
 class KDTree;
 class Emitter;
 struct EmitterQueryRecord;
@@ -134,6 +137,7 @@ class PhaseFunction;
 class ReconstructionFilter;
 class Sampler;
 class Scene;
+class Snapshot;
 
 /// Import cout, cerr, endl for debugging purposes
 using std::cout;
@@ -143,6 +147,10 @@ using std::endl;
 typedef Eigen::Matrix<float,    Eigen::Dynamic, Eigen::Dynamic> MatrixXf;
 typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu;
 
+/// Read-only views of matrices stored elsewhere (e.g. mesh buffers that were moved into a page file)
+typedef Eigen::Map<const MatrixXf> MatrixXfMap;
+typedef Eigen::Map<const MatrixXu> MatrixXuMap;
+
 /// Simple exception class, which stores a human-readable error description
 class NoriException : public std::runtime_error {
 public:
@@ -265,4 +273,15 @@ extern float fresnel(float cosThetaI, float extIOR, float intIOR);
  */
 extern filesystem::resolver *getFileResolver();
 
+/**
+ * \brief Map a file into memory for reading
+ *
+ * \return A pointer to the contents of the file, or \c nullptr if it
+ *    cannot be opened or is empty. The mapping is released by \ref unmapFile().
+ */
+extern const uint8_t *mapFile(const std::string &filename, size_t &size);
+
+/// Release a mapping created by \ref mapFile()
+extern void unmapFile(const uint8_t *data, size_t size);
+
 NORI_NAMESPACE_END
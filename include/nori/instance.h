@@ -0,0 +1,97 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Instance of a shared triangle mesh
+ *
+ * Places a mesh into the scene using its own \c toWorld transformation
+ * without duplicating the underlying geometry. To share a mesh between
+ * several instances, declare it with an \c id attribute inside the first
+ * instance and refer to it from the others, e.g.
+ *
+ * \code
+ * <instance>
+ *     <mesh type="obj" id="tree">
+ *         <string name="filename" value="tree.obj"/>
+ *     </mesh>
+ *     <transform name="toWorld"> ... </transform>
+ * </instance>
+ * <instance>
+ *     <ref id="tree"/>
+ *     <transform name="toWorld"> ... </transform>
+ * </instance>
+ * \endcode
+ *
+ * References (<tt>&lt;ref id="..."/&gt;</tt>) are only supported within
+ * instances and must refer to a mesh.
+ *
+ * The acceleration data structure builds a single bottom-level hierarchy
+ * per distinct mesh and transforms rays into object space to traverse it.
+ */
+class Instance : public NoriObject {
+public:
+    /// Create a new instance
+    Instance(const PropertyList &propList);
+
+    /// Return the instanced mesh
+    Mesh *getMesh() { return m_mesh; }
+
+    /// Return the instanced mesh (const version)
+    const Mesh *getMesh() const { return m_mesh; }
+
+    /// Return the transformation from object to world space
+    const Transform &getToWorld() const { return m_toWorld; }
+
+    /// Return the transformation from world to object space
+    const Transform &getToObject() const { return m_toObject; }
+
+    /**
+     * \brief Move the instance (e.g. between the frames of an animation)
+     *
+     * Call \ref Accel::refit() afterwards to update the acceleration data structure.
+     */
+    void setToWorld(const Transform &toWorld);
+
+    /// Return an axis-aligned box that bounds the instance in world space
+    BoundingBox3f getBoundingBox() const;
+
+    /// Register the instanced mesh
+    void addChild(NoriObject *child);
+
+    /// Check that a mesh was provided
+    void activate();
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+
+    EClassType getClassType() const { return EInstance; }
+
+private:
+    Mesh *m_mesh = nullptr;
+    Transform m_toWorld;
+    Transform m_toObject;
+};
+
+NORI_NAMESPACE_END
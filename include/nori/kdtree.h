@@ -0,0 +1,107 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/accel.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief SAH kd-tree over the triangles of all registered meshes
+ *
+ * An alternative to the BVH of \ref Accel, selected using
+ * <tt>&lt;accel type="kdtree"/&gt;</tt>. The tree is constructed top-down
+ * and in parallel using the surface area heuristic: small nodes evaluate
+ * every candidate plane exactly by sweeping over the sorted triangle
+ * bounds, while large nodes are binned. Triangles that straddle a split
+ * plane are clipped against it, so that the bounds of their references
+ * remain tight, and splits that cut off empty space receive a bonus.
+ *
+ * Rays visit the leaves in front-to-back order and terminate as soon as
+ * an intersection was found inside the current leaf. Leaves store their
+ * triangles in packets of 4 unless the \c packets property is \c false.
+ *
+ * Instanced meshes, packets of rays, and ray streams are handled by the
+ * BVH machinery of \ref Accel (the latter two trace every ray separately).
+ * Since split planes cannot be moved, \ref refit() always rebuilds the tree.
+ */
+class KDTree : public Accel {
+public:
+    /// Create an empty kd-tree
+    KDTree(const PropertyList &propList);
+
+    /// Rebuild the kd-tree after the meshes have changed (see \ref Accel::refit())
+    bool refit();
+
+    /// Return the number of nodes in the kd-tree
+    uint32_t getNodeCount() const { return (uint32_t) m_kdNodes.size(); }
+
+    /// Analyze the kd-tree (see \ref Accel::getStatistics())
+    Statistics getStatistics() const;
+
+    /// Return a string summary of the kd-tree
+    std::string toString() const;
+
+protected:
+    friend class KDTreeBuilder;
+
+    /**
+     * \brief kd-tree node in 8 bytes
+     *
+     * Inner nodes store their first (below) child directly after
+     * themselves, so only the index of the second (above) child needs to
+     * be recorded. Leaf nodes reference a contiguous range of \c m_indices
+     * or of triangle packets.
+     */
+    struct KDNode {
+        union {
+            float split;    ///< Position of the split plane (inner nodes)
+            uint32_t start; ///< Start of the triangle range (leaves)
+        };
+        uint32_t data;      ///< Split axis or 3 (leaves), followed by the above child or the leaf size
+
+        bool isLeaf() const { return (data & 3) == 3; }
+        int axis() const { return (int) (data & 3); }
+        uint32_t aboveChild() const { return data >> 2; }
+        uint32_t size() const { return data >> 2; }
+    };
+
+    void buildTriangles();
+    bool traverseTriangles(Ray3f &ray, Intersection &its, uint32_t &f, bool shadowRay) const;
+    bool occludedTriangles(const Ray3f &ray, uint32_t &triangle) const;
+    void serializeTriangles(Snapshot &snapshot) const;
+    void loadTriangles(Snapshot &snapshot);
+
+    /**
+     * \brief Clip the ray against the bounds of the kd-tree
+     *
+     * \return \c false if the ray misses the tree, otherwise the
+     *    parametric range <tt>[mint, maxt]</tt> that overlaps it
+     */
+    bool clipRay(const Ray3f &ray, float &mint, float &maxt) const;
+
+    /// Gather the statistics of the subtree below the given node, whose bounds are \c bbox
+    void nodeStatistics(uint32_t nodeIdx, const BoundingBox3f &bbox, uint32_t depth,
+                        Statistics &stats) const;
+
+    NodeVector<KDNode> m_kdNodes;  ///< kd-tree nodes (the root is stored at index 0)
+    BoundingBox3f m_kdBBox;        ///< Bounding box of the triangles of the registered meshes
+};
+
+NORI_NAMESPACE_END
@@ -21,6 +21,8 @@
 #include <nori/object.h>
 #include <nori/frame.h>
 #include <nori/bbox.h>
+#include <nori/pagecache.h>
+#include <mutex>
 
 NORI_NAMESPACE_BEGIN
 
@@ -31,23 +33,42 @@ NORI_NAMESPACE_BEGIN
  * This includes the position, traveled ray distance, uv coordinates, as well
  * as well as two local coordinate frames (one that corresponds to the true
  * geometry, and one that is used for shading computations).
+ *
+ * Ray intersection queries only fill in a cheap hit record (the distance,
+ * the intersected mesh and triangle, and the barycentric coordinates). The
+ * remaining information must be computed explicitly using \ref finalize()
+ * when it is needed, e.g. for shading. Queries that only need the distance
+ * or the mesh (ambient occlusion, emitter hit checks) can skip this step.
  */
 struct Intersection {
-    /// Position of the surface intersection
+    /// Position of the surface intersection (see \ref finalize())
     Point3f p;
     /// Unoccluded distance along the ray
     float t;
-    /// UV coordinates, if any
+    /// UV coordinates, if any (see \ref finalize())
     Point2f uv;
-    /// Shading frame (based on the shading normal)
+    /// Shading frame (based on the shading normal, see \ref finalize())
     Frame shFrame;
-    /// Geometric frame (based on the true geometry)
+    /// Geometric frame (based on the true geometry, see \ref finalize())
     Frame geoFrame;
     /// Pointer to the associated mesh
     const Mesh *mesh;
+    /// Index of the intersected triangle within the mesh
+    uint32_t f;
+    /// Barycentric coordinates of the intersection within the triangle
+    Point2f bary;
+    /// Pointer to the associated instance (\c nullptr if the mesh is not instanced)
+    const Instance *instance;
 
     /// Create an uninitialized intersection record
-    Intersection() : mesh(nullptr) { }
+    Intersection() : mesh(nullptr), instance(nullptr) { }
+
+    /**
+     * \brief Compute the remaining information about the intersection
+     * (position, texture coordinates, and coordinate frames) from the hit
+     * record filled in by a ray intersection query
+     */
+    void finalize();
 
     /// Transform a direction vector into the local shading frame
     Vector3f toLocal(const Vector3f &d) const {
@@ -80,10 +101,10 @@ public:
     virtual void activate();
 
     /// Return the total number of triangles in this shape
-    uint32_t getTriangleCount() const { return (uint32_t) m_F.cols(); }
+    uint32_t getTriangleCount() const { return (uint32_t) getIndexView().cols(); }
 
     /// Return the total number of vertices in this shape
-    uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
+    uint32_t getVertexCount() const { return (uint32_t) getVertexPositionView().cols(); }
 
     /// Return the surface area of the given triangle
     float surfaceArea(uint32_t index) const;
@@ -124,17 +145,77 @@ public:
      */
     bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
-    /// Return a pointer to the vertex positions
-    const MatrixXf &getVertexPositions() const { return m_V; }
+    /// Return a pointer to the vertex positions (see \ref getVertexPositionView() for paged meshes)
+    const MatrixXf &getVertexPositions() const { return resident(m_V, EPositions); }
+
+    /**
+     * \brief Replace the vertex positions (e.g. to deform the mesh between
+     * the frames of an animation)
+     *
+     * The number of vertices must not change. Call \ref Accel::refit()
+     * afterwards to update the acceleration data structure.
+     */
+    void setVertexPositions(const MatrixXf &V);
 
     /// Return a pointer to the vertex normals (or \c nullptr if there are none)
-    const MatrixXf &getVertexNormals() const { return m_N; }
+    const MatrixXf &getVertexNormals() const { return resident(m_N, ENormals); }
 
     /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-    const MatrixXf &getVertexTexCoords() const { return m_UV; }
+    const MatrixXf &getVertexTexCoords() const { return resident(m_UV, ETexCoords); }
 
     /// Return a pointer to the triangle vertex index list
-    const MatrixXu &getIndices() const { return m_F; }
+    const MatrixXu &getIndices() const { return resident(m_F, EFaces); }
+
+    /// Return a view of the vertex positions, which also works for paged meshes
+    MatrixXfMap getVertexPositionView() const { return buffer(m_V, EPositions); }
+
+    /// Return a view of the vertex normals, which also works for paged meshes
+    MatrixXfMap getVertexNormalView() const { return buffer(m_N, ENormals); }
+
+    /// Return a view of the texture coordinates, which also works for paged meshes
+    MatrixXfMap getVertexTexCoordView() const { return buffer(m_UV, ETexCoords); }
+
+    /// Return a view of the triangle vertex index list, which also works for paged meshes
+    MatrixXuMap getIndexView() const { return buffer(m_F, EFaces); }
+
+    /**
+     * \brief Move the vertex attributes and faces into a page file, of
+     * which only a limited number of pages are kept in memory
+     *
+     * The buffers are written to <tt>[offset, offset + getBufferSize())</tt>
+     * of the file and released from memory (or from the mapping, see
+     * \ref mapBuffer()). Afterwards, only the view
+     * accessors (e.g. \ref getVertexPositionView()) can be used, while the
+     * others throw an exception. Code that reads the buffers of a triangle
+     * reports the access using \ref touch() beforehand.
+     */
+    void page(const std::shared_ptr<PageCache> &pageCache, size_t offset);
+
+    /// Return the size of the vertex attributes and faces (in bytes)
+    size_t getBufferSize() const;
+
+    /// Were the buffers moved into a page file?
+    bool isPaged() const { return m_pageCache != nullptr; }
+
+    /**
+     * \brief Record an access to the buffers of the given triangles (only
+     * needed if \ref isPaged())
+     *
+     * All pages that are missing are loaded at once, so callers that process
+     * several triangles (e.g. the triangles of a leaf) should report them
+     * together. The per-triangle queries of this class (\ref rayIntersect(),
+     * \ref surfaceArea() etc.) report their own accesses.
+     */
+    void touch(const uint32_t *indices, size_t count) const {
+        if (m_pageCache)
+            touchPaged(indices, count);
+    }
+
+    /// Record an access to the buffers of the given triangle (only needed if \ref isPaged())
+    void touch(uint32_t index) const {
+        if (m_pageCache)
+            touchPaged(&index, 1);
+    }
 
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
@@ -167,6 +248,65 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /// Buffers of the mesh
+    enum EBuffer { EPositions = 0, ENormals, ETexCoords, EFaces, EBufferCount };
+
+    /// Location of a buffer in the page file
+    struct PagedBuffer {
+        size_t offset;      ///< Offset within the page file (in bytes)
+        Eigen::Index rows;  ///< Number of rows of the matrix
+        Eigen::Index cols;  ///< Number of columns of the matrix
+    };
+
+    /// Location of a buffer within \ref m_mapping
+    struct MappedBuffer {
+        const void *data = nullptr; ///< Start of the buffer (or \c nullptr if it is stored in its matrix)
+        Eigen::Index rows = 0;      ///< Number of rows of the matrix
+        Eigen::Index cols = 0;      ///< Number of columns of the matrix
+    };
+
+    /**
+     * \brief Let a buffer refer to memory owned by \ref m_mapping (e.g. a
+     * memory-mapped file) instead of its matrix
+     *
+     * The view accessors read the mapped memory directly. Since the other
+     * accessors return references to the matrices, they copy the buffer
+     * into its matrix when they are first called.
+     */
+    void mapBuffer(EBuffer index, const void *data, Eigen::Index rows, Eigen::Index cols);
+
+    /// Return a view of a buffer, which is stored in memory, in the mapping, or in the page file
+    template <typename Scalar> Eigen::Map<const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>>
+            buffer(const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> &matrix, EBuffer index) const {
+        typedef Eigen::Map<const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>> Map;
+        if (m_pageCache) {
+            const PagedBuffer &paged = m_paged[index];
+            return Map((const Scalar *) (m_pageCache->getData() + paged.offset), paged.rows, paged.cols);
+        }
+        const MappedBuffer &mapped = m_mapped[index];
+        if (mapped.data)
+            return Map((const Scalar *) mapped.data, mapped.rows, mapped.cols);
+        return Map(matrix.data(), matrix.rows(), matrix.cols());
+    }
+
+    /// Return a buffer that is stored in memory (throws if the mesh was paged)
+    template <typename Matrix> const Matrix &resident(const Matrix &matrix, EBuffer index) const {
+        if (m_pageCache)
+            throwPaged(index);
+        if (m_mapped[index].data)
+            copyMapped(index);
+        return matrix;
+    }
+
+    /// Report an access to a paged buffer through the accessors of resident meshes
+    [[noreturn]] void throwPaged(EBuffer index) const;
+
+    /// Copy a mapped buffer into its matrix (only once, even if called by several threads)
+    void copyMapped(EBuffer index) const;
+
+    /// Record an access to the paged buffers of the given triangles
+    void touchPaged(const uint32_t *indices, size_t count) const;
+
 protected:
     std::string m_name;                  ///< Identifying name
     MatrixXf      m_V;                   ///< Vertex positions
@@ -176,6 +316,11 @@ protected:
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
+    std::shared_ptr<PageCache> m_pageCache; ///< Page file holding the buffers (replacing the above, see \ref page())
+    PagedBuffer   m_paged[EBufferCount];    ///< Locations of the buffers in the page file
+    std::shared_ptr<const uint8_t> m_mapping; ///< Memory referenced by the mapped buffers (see \ref mapBuffer())
+    MappedBuffer  m_mapped[EBufferCount];   ///< Locations of the mapped buffers
+    mutable std::once_flag m_copied[EBufferCount]; ///< Tracks the copies made by \ref copyMapped()
 };
 
 NORI_NAMESPACE_END
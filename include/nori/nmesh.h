@@ -0,0 +1,41 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+
+/// Version of the binary mesh file format (bump when changing the layout)
+#define NORI_NMESH_VERSION 1
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Write a mesh to a binary mesh file, which can be loaded using
+ * the \c nmesh plugin
+ *
+ * The file stores the buffers of the mesh exactly as they are kept in
+ * memory, hence loading it requires no parsing.
+ *
+ * \param compress
+ *    Compress the buffers using zlib (the file is smaller, but it can
+ *    no longer be copied directly from the memory mapping)
+ */
+extern void saveNMesh(const Mesh *mesh, const std::string &filename, bool compress = false);
+
+NORI_NAMESPACE_END
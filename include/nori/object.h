@@ -42,6 +42,8 @@ public:
         ESampler,
         ETest,
         EReconstructionFilter,
+        EAccel,
+        EInstance,
         EClassTypeCount
     };
 
@@ -98,6 +100,8 @@ public:
             case EIntegrator: return "integrator";
             case ESampler:    return "sampler";
             case ETest:       return "test";
+            case EAccel:      return "accel";
+            case EInstance:   return "instance";
             default:          return "<unknown>";
         }
     }
@@ -0,0 +1,180 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Data stored in a memory-mapped temporary file, of which only a
+ * limited number of pages are kept in memory
+ *
+ * The operating system loads the pages of the file on demand, i.e. when
+ * they are first accessed through \ref getData(). Users report all accesses
+ * using \ref touch(). Once more pages were touched than the budget permits,
+ * the least recently used pages (as approximated by the CLOCK algorithm) are
+ * released from memory and will be loaded from the file again on their next
+ * access.
+ *
+ * Users should report their accesses at a coarse granularity (e.g. once for
+ * all triangles of a leaf), since all pages that are missing from a single
+ * report are loaded while holding one lock.
+ *
+ * Releasing a page that another thread is still reading is harmless, since
+ * the page is simply loaded again. The budget is hence not a strict limit.
+ * Released pages leave the address space of the process, but usually remain
+ * in the file system cache of the operating system (which reclaims them under
+ * memory pressure), so that loading them again rarely requires disk accesses.
+ */
+class PageCache {
+public:
+    /// Counters of the page accesses
+    struct Statistics {
+        uint64_t hits = 0;      ///< Accesses of resident pages
+        uint64_t misses = 0;    ///< Accesses that had to load a page from the file
+        uint64_t evictions = 0; ///< Number of pages released from memory
+        size_t resident = 0;    ///< Number of currently resident pages
+    };
+
+    /**
+     * \brief Create and map a temporary file
+     *
+     * \param size
+     *    Size of the file (in bytes)
+     *
+     * \param pageSize
+     *    Size of the pages (a power of two, and a multiple of the page
+     *    size of the operating system)
+     *
+     * \param budget
+     *    Maximum size of the resident pages (in bytes)
+     *
+     * \param directory
+     *    Directory of the temporary file (the system's temporary directory
+     *    if empty). The file is deleted when the page cache is destroyed.
+     */
+    PageCache(size_t size, size_t pageSize, size_t budget, const std::string &directory = "");
+
+    /// Unmap and delete the temporary file
+    ~PageCache();
+
+    /// Copy data into the file (without loading the affected pages into memory)
+    void write(size_t offset, const void *data, size_t size);
+
+    /// Return a pointer to the mapped contents of the file
+    uint8_t *getData() const { return m_data; }
+
+    /// Return the size of the file
+    size_t getSize() const { return m_size; }
+
+    /// Return the size of the pages
+    size_t getPageSize() const { return m_pageSize; }
+
+    /// Return the number of pages of the file
+    size_t getPageCount() const { return m_pageCount; }
+
+    /// Return the page containing the given byte of the file
+    size_t getPage(size_t offset) const { return offset >> m_pageShift; }
+
+    /// Record an access to the bytes <tt>[offset, offset + size)</tt> of the file
+    void touch(size_t offset, size_t size) const {
+        if (size == 0)
+            return;
+        size_t last = (offset + size - 1) >> m_pageShift;
+        for (size_t page = offset >> m_pageShift; page <= last; ++page) {
+            if (!mark(page)) {
+                /* Load this and the remaining pages of the range at once */
+                fault(page, last);
+                return;
+            }
+        }
+    }
+
+    /// Record an access to the given pages (sorted in increasing order and without duplicates)
+    void touch(const size_t *pages, size_t count) const;
+
+    /// Return the access counters (summed over all threads)
+    Statistics getStatistics() const;
+
+    /// Return a string summary of the page accesses
+    std::string toString() const;
+
+private:
+    /// Page state bits
+    enum EState : uint8_t {
+        EResident = 1,  ///< The page was loaded (as far as the budget is concerned)
+        EReferenced = 2 ///< The page was accessed since the last pass of the CLOCK hand
+    };
+
+    typedef tbb::enumerable_thread_specific<uint64_t,
+        tbb::cache_aligned_allocator<uint64_t>, tbb::ets_key_per_instance> Counter;
+
+    /// Mark a resident page as recently used (returns \c false if it must be loaded)
+    bool mark(size_t page) const {
+        uint8_t state = m_state[page].load(std::memory_order_relaxed);
+        if (state == (EResident | EReferenced) || (state == EResident &&
+                m_state[page].compare_exchange_strong(state, EResident | EReferenced))) {
+            ++m_hits.local();
+            return true;
+        }
+        return false;
+    }
+
+    /// Load the pages <tt>first, ..., last</tt> (if they are not resident), and release other pages if necessary
+    void fault(size_t first, size_t last) const;
+
+    /// Load the given pages (if they are not resident), and release other pages if necessary
+    void fault(const size_t *pages, size_t count) const;
+
+    /// Load a page (requires \c m_mutex)
+    void load(size_t page) const;
+
+    /// Release pages until the budget is met again (requires \c m_mutex)
+    void evict() const;
+
+    /// Release a page from memory
+    void release(size_t page) const;
+
+    uint8_t *m_data = nullptr;                        ///< Memory-mapped file contents
+    size_t m_size;                                    ///< Size of the file
+    size_t m_pageSize;                                ///< Size of the pages
+    size_t m_pageCount;                               ///< Number of pages
+    size_t m_maxResident;                             ///< Maximum number of resident pages
+    int m_pageShift;                                  ///< Base-2 logarithm of the page size
+    std::unique_ptr<std::atomic<uint8_t>[]> m_state;  ///< State bits of every page
+    mutable Counter m_hits;                           ///< Per-thread number of page hits
+    mutable std::mutex m_mutex;                       ///< Protects the following members
+    mutable size_t m_resident = 0;                    ///< Number of resident pages
+    mutable size_t m_clockHand = 0;                   ///< Next page examined by the CLOCK algorithm
+    mutable uint64_t m_misses = 0;                    ///< Number of page misses
+    mutable uint64_t m_evictions = 0;                 ///< Number of released pages
+#if defined(PLATFORM_WINDOWS)
+    void *m_file = nullptr;                           ///< Handle of the temporary file
+#else
+    int m_file = -1;                                  ///< Descriptor of the temporary file
+#endif
+};
+
+NORI_NAMESPACE_END
@@ -25,7 +25,14 @@ NORI_NAMESPACE_BEGIN
 /**
  * \brief Load a scene from the specified filename and
  * return its root object
+ *
+ * \param useSnapshot
+ *    When set to \c true, the loaded meshes and the acceleration data
+ *    structure are stored in a snapshot file next to the scene description
+ *    (<tt>scene.xml</tt> \f$\to\f$ <tt>scene.snapshot</tt>). Subsequent loads
+ *    of the unmodified scene map this file instead of parsing the meshes
+ *    and rebuilding the acceleration data structure (see \ref Snapshot).
  */
-extern NoriObject *loadFromXML(const std::string &filename);
+extern NoriObject *loadFromXML(const std::string &filename, bool useSnapshot = false);
 
 NORI_NAMESPACE_END
@@ -37,9 +37,12 @@ public:
     /// Release all memory
     virtual ~Scene();
 
-    /// Return a pointer to the scene's kd-tree
+    /// Return a pointer to the scene's acceleration data structure
     const Accel *getAccel() const { return m_accel; }
 
+    /// Return a pointer to the scene's acceleration data structure (e.g. to \ref Accel::refit() it)
+    Accel *getAccel() { return m_accel; }
+
     /// Return a pointer to the scene's integrator
     const Integrator *getIntegrator() const { return m_integrator; }
 
@@ -58,6 +61,9 @@ public:
     /// Return a reference to an array containing all meshes
     const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
 
+    /// Return a reference to an array containing all mesh instances
+    const std::vector<Instance *> &getInstances() const { return m_instances; }
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene
      * and return detailed intersection information
@@ -70,10 +76,19 @@ public:
      *    A detailed intersection record, which will be filled by the
      *    intersection query
      *
+     * \param finalize
+     *    When set to \c false, only the hit information (distance, mesh,
+     *    triangle, and barycentric coordinates) is computed. This is useful
+     *    for queries that need nothing else (e.g. distance queries);
+     *    \ref Intersection::finalize() computes the rest on demand.
+     *
      * \return \c true if an intersection was found
      */
-    bool rayIntersect(const Ray3f &ray, Intersection &its) const {
-        return m_accel->rayIntersect(ray, its, false);
+    bool rayIntersect(const Ray3f &ray, Intersection &its, bool finalize = true) const {
+        bool hit = m_accel->rayIntersect(ray, its, false);
+        if (hit && finalize)
+            its.finalize();
+        return hit;
     }
 
     /**
@@ -92,8 +107,52 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+        return m_accel->rayOccluded(ray);
+    }
+
+    /**
+     * \brief Intersect a large stream of rays (e.g. the secondary rays
+     * of many paths) against the scene
+     *
+     * \param rays
+     *    An array of \c count ray data structures
+     *
+     * \param count
+     *    The number of rays in the stream
+     *
+     * \param its
+     *    An array of \c count intersection records, which will be
+     *    filled by the intersection query
+     *
+     * \param hits
+     *    An array of \c count flags, which will be set to \c true for
+     *    the rays that intersect the scene
+     *
+     * \param finalize
+     *    Specifies whether the intersection records should be finalized
+     *    (see \ref rayIntersect(const Ray3f &, Intersection &, bool) const)
+     *
+     * \return The number of rays that intersect the scene
+     */
+    uint32_t intersectStream(const Ray3f *rays, uint32_t count, Intersection *its, bool *hits,
+                             bool finalize = true) const {
+        uint32_t hitCount = m_accel->intersectStream(rays, count, its, hits, false);
+        for (uint32_t i = 0; i < count && finalize; ++i) {
+            if (hits[i])
+                its[i].finalize();
+        }
+        return hitCount;
+    }
+
+    /**
+     * \brief Intersect a large stream of rays against the scene and
+     * \a only determine which of them hit something
+     *
+     * \return The number of rays that intersect the scene
+     */
+    uint32_t intersectStream(const Ray3f *rays, uint32_t count, bool *hits) const {
+        std::vector<Intersection> its(count); /* Unused */
+        return m_accel->intersectStream(rays, count, its.data(), hits, true);
     }
 
     /// \brief Return an axis-aligned box that bounds the scene
@@ -112,16 +171,28 @@ public:
     /// Add a child object to the scene (meshes, integrators etc.)
     void addChild(NoriObject *obj);
 
+    /**
+     * \brief Provide a snapshot (used by the XML parser)
+     *
+     * When the snapshot was loaded from disk, \ref activate() restores the
+     * acceleration data structure from it. Otherwise, the freshly built
+     * acceleration data structure is written to it. The snapshot is only
+     * accessed during \ref activate().
+     */
+    void setSnapshot(Snapshot *snapshot) { m_snapshot = snapshot; }
+
     /// Return a string summary of the scene (for debugging purposes)
     std::string toString() const;
 
     EClassType getClassType() const { return EScene; }
 private:
     std::vector<Mesh *> m_meshes;
+    std::vector<Instance *> m_instances;
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
+    Snapshot *m_snapshot = nullptr;
 };
 
 NORI_NAMESPACE_END
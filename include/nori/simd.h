@@ -0,0 +1,268 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define NORI_SIMD_SSE 1
+#  include <immintrin.h>
+#endif
+
+#if defined(__AVX__)
+#  define NORI_SIMD_AVX 1
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/* ===================================================================
+    This file contains a tiny fixed-width SIMD vector type, which is
+    used by the ray tracing kernels of the acceleration data structure
+    to process several bounding boxes or triangles at once.
+
+    Only the handful of operations needed by these kernels are provided.
+    Comparisons produce lane masks with all bits set, which can be
+    combined using the bitwise operators and converted into an integer
+    bit mask using \ref movemask(). Widths 4 and 8 are mapped onto SSE
+    and AVX registers when the compiler targets these instruction sets;
+    otherwise, a portable (auto-vectorizable) implementation is used.
+ * =================================================================== */
+
+/**
+ * \brief Portable fallback implementation of a SIMD float vector
+ */
+template <int Width> struct SimdFloat {
+    enum {
+        Size = Width
+    };
+
+    float v[Width];
+
+    /// Create an uninitialized vector
+    SimdFloat() { }
+
+    /// Broadcast a scalar to all lanes
+    SimdFloat(float f) { for (int i = 0; i < Width; ++i) v[i] = f; }
+
+    /// Load \c Width values from memory (no alignment requirements)
+    static SimdFloat load(const float *ptr) {
+        SimdFloat r;
+        for (int i = 0; i < Width; ++i) r.v[i] = ptr[i];
+        return r;
+    }
+
+    /// Load \c Width unsigned bytes from memory and convert them to floats
+    static SimdFloat loadBytes(const uint8_t *ptr) {
+        SimdFloat r;
+        for (int i = 0; i < Width; ++i) r.v[i] = (float) ptr[i];
+        return r;
+    }
+
+    /// Store all lanes to memory (no alignment requirements)
+    void store(float *ptr) const { for (int i = 0; i < Width; ++i) ptr[i] = v[i]; }
+
+    /// Return a lane mask with all bits set
+    static SimdFloat allTrue() { return fromBits(0xFFFFFFFFu); }
+
+    /// Return the value of the given lane
+    float operator[](int i) const { return v[i]; }
+
+    #define NORI_SIMD_ARITH(op) \
+        friend SimdFloat operator op(const SimdFloat &a, const SimdFloat &b) { \
+            SimdFloat r; \
+            for (int i = 0; i < Width; ++i) r.v[i] = a.v[i] op b.v[i]; \
+            return r; \
+        }
+    NORI_SIMD_ARITH(+)
+    NORI_SIMD_ARITH(-)
+    NORI_SIMD_ARITH(*)
+    NORI_SIMD_ARITH(/)
+    #undef NORI_SIMD_ARITH
+
+    #define NORI_SIMD_CMP(op) \
+        friend SimdFloat operator op(const SimdFloat &a, const SimdFloat &b) { \
+            SimdFloat r; \
+            for (int i = 0; i < Width; ++i) r.v[i] = toFloat(a.v[i] op b.v[i] ? 0xFFFFFFFFu : 0u); \
+            return r; \
+        }
+    NORI_SIMD_CMP(<)
+    NORI_SIMD_CMP(<=)
+    NORI_SIMD_CMP(>)
+    NORI_SIMD_CMP(>=)
+    #undef NORI_SIMD_CMP
+
+    #define NORI_SIMD_BITOP(op) \
+        friend SimdFloat operator op(const SimdFloat &a, const SimdFloat &b) { \
+            SimdFloat r; \
+            for (int i = 0; i < Width; ++i) r.v[i] = toFloat(toBits(a.v[i]) op toBits(b.v[i])); \
+            return r; \
+        }
+    NORI_SIMD_BITOP(&)
+    NORI_SIMD_BITOP(|)
+    NORI_SIMD_BITOP(^)
+    #undef NORI_SIMD_BITOP
+
+    /// Component-wise minimum
+    static SimdFloat min(const SimdFloat &a, const SimdFloat &b) {
+        SimdFloat r;
+        for (int i = 0; i < Width; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+
+    /// Component-wise maximum
+    static SimdFloat max(const SimdFloat &a, const SimdFloat &b) {
+        SimdFloat r;
+        for (int i = 0; i < Width; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+
+    /// Return \c a in lanes where \c mask is set and \c b elsewhere
+    static SimdFloat select(const SimdFloat &mask, const SimdFloat &a, const SimdFloat &b) {
+        SimdFloat r;
+        for (int i = 0; i < Width; ++i) r.v[i] = toBits(mask.v[i]) ? a.v[i] : b.v[i];
+        return r;
+    }
+
+    /// Return an integer whose i-th bit is set when lane \c i of the mask is set
+    int movemask() const {
+        int r = 0;
+        for (int i = 0; i < Width; ++i) r |= (toBits(v[i]) >> 31) << i;
+        return r;
+    }
+
+private:
+    static uint32_t toBits(float f) { uint32_t u; memcpy(&u, &f, sizeof(float)); return u; }
+    static float toFloat(uint32_t u) { float f; memcpy(&f, &u, sizeof(float)); return f; }
+    static SimdFloat fromBits(uint32_t u) { return SimdFloat(toFloat(u)); }
+};
+
+#if defined(NORI_SIMD_SSE)
+/**
+ * \brief 4-wide SIMD float vector based on SSE
+ */
+template <> struct SimdFloat<4> {
+    enum {
+        Size = 4
+    };
+
+    __m128 v;
+
+    SimdFloat() { }
+    SimdFloat(__m128 v) : v(v) { }
+    SimdFloat(float f) : v(_mm_set1_ps(f)) { }
+
+    static SimdFloat load(const float *ptr) { return _mm_loadu_ps(ptr); }
+    static SimdFloat loadBytes(const uint8_t *ptr) {
+        int32_t bytes;
+        memcpy(&bytes, ptr, sizeof(int32_t));
+        __m128i v = _mm_cvtsi32_si128(bytes), zero = _mm_setzero_si128();
+        v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero);
+        return _mm_cvtepi32_ps(v);
+    }
+    void store(float *ptr) const { _mm_storeu_ps(ptr, v); }
+    static SimdFloat allTrue() { return _mm_castsi128_ps(_mm_set1_epi32(-1)); }
+
+    float operator[](int i) const {
+        alignas(16) float tmp[4];
+        _mm_store_ps(tmp, v);
+        return tmp[i];
+    }
+
+    friend SimdFloat operator+(const SimdFloat &a, const SimdFloat &b) { return _mm_add_ps(a.v, b.v); }
+    friend SimdFloat operator-(const SimdFloat &a, const SimdFloat &b) { return _mm_sub_ps(a.v, b.v); }
+    friend SimdFloat operator*(const SimdFloat &a, const SimdFloat &b) { return _mm_mul_ps(a.v, b.v); }
+    friend SimdFloat operator/(const SimdFloat &a, const SimdFloat &b) { return _mm_div_ps(a.v, b.v); }
+    friend SimdFloat operator<(const SimdFloat &a, const SimdFloat &b) { return _mm_cmplt_ps(a.v, b.v); }
+    friend SimdFloat operator<=(const SimdFloat &a, const SimdFloat &b) { return _mm_cmple_ps(a.v, b.v); }
+    friend SimdFloat operator>(const SimdFloat &a, const SimdFloat &b) { return _mm_cmpgt_ps(a.v, b.v); }
+    friend SimdFloat operator>=(const SimdFloat &a, const SimdFloat &b) { return _mm_cmpge_ps(a.v, b.v); }
+    friend SimdFloat operator&(const SimdFloat &a, const SimdFloat &b) { return _mm_and_ps(a.v, b.v); }
+    friend SimdFloat operator|(const SimdFloat &a, const SimdFloat &b) { return _mm_or_ps(a.v, b.v); }
+    friend SimdFloat operator^(const SimdFloat &a, const SimdFloat &b) { return _mm_xor_ps(a.v, b.v); }
+
+    static SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return _mm_min_ps(a.v, b.v); }
+    static SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return _mm_max_ps(a.v, b.v); }
+
+    static SimdFloat select(const SimdFloat &mask, const SimdFloat &a, const SimdFloat &b) {
+        return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+    }
+
+    int movemask() const { return _mm_movemask_ps(v); }
+};
+#endif
+
+#if defined(NORI_SIMD_AVX)
+/**
+ * \brief 8-wide SIMD float vector based on AVX
+ */
+template <> struct SimdFloat<8> {
+    enum {
+        Size = 8
+    };
+
+    __m256 v;
+
+    SimdFloat() { }
+    SimdFloat(__m256 v) : v(v) { }
+    SimdFloat(float f) : v(_mm256_set1_ps(f)) { }
+
+    static SimdFloat load(const float *ptr) { return _mm256_loadu_ps(ptr); }
+    static SimdFloat loadBytes(const uint8_t *ptr) {
+#if defined(__AVX2__)
+        return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *) ptr)));
+#else
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(
+            SimdFloat<4>::loadBytes(ptr).v), SimdFloat<4>::loadBytes(ptr + 4).v, 1);
+#endif
+    }
+    void store(float *ptr) const { _mm256_storeu_ps(ptr, v); }
+    static SimdFloat allTrue() { return _mm256_castsi256_ps(_mm256_set1_epi32(-1)); }
+
+    float operator[](int i) const {
+        alignas(32) float tmp[8];
+        _mm256_store_ps(tmp, v);
+        return tmp[i];
+    }
+
+    friend SimdFloat operator+(const SimdFloat &a, const SimdFloat &b) { return _mm256_add_ps(a.v, b.v); }
+    friend SimdFloat operator-(const SimdFloat &a, const SimdFloat &b) { return _mm256_sub_ps(a.v, b.v); }
+    friend SimdFloat operator*(const SimdFloat &a, const SimdFloat &b) { return _mm256_mul_ps(a.v, b.v); }
+    friend SimdFloat operator/(const SimdFloat &a, const SimdFloat &b) { return _mm256_div_ps(a.v, b.v); }
+    friend SimdFloat operator<(const SimdFloat &a, const SimdFloat &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    friend SimdFloat operator<=(const SimdFloat &a, const SimdFloat &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+    friend SimdFloat operator>(const SimdFloat &a, const SimdFloat &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+    friend SimdFloat operator>=(const SimdFloat &a, const SimdFloat &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+    friend SimdFloat operator&(const SimdFloat &a, const SimdFloat &b) { return _mm256_and_ps(a.v, b.v); }
+    friend SimdFloat operator|(const SimdFloat &a, const SimdFloat &b) { return _mm256_or_ps(a.v, b.v); }
+    friend SimdFloat operator^(const SimdFloat &a, const SimdFloat &b) { return _mm256_xor_ps(a.v, b.v); }
+
+    static SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return _mm256_min_ps(a.v, b.v); }
+    static SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return _mm256_max_ps(a.v, b.v); }
+
+    static SimdFloat select(const SimdFloat &mask, const SimdFloat &a, const SimdFloat &b) {
+        return _mm256_blendv_ps(b.v, a.v, mask.v);
+    }
+
+    int movemask() const { return _mm256_movemask_ps(v); }
+};
+#endif
+
+NORI_NAMESPACE_END
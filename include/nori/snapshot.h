@@ -0,0 +1,183 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+/// Version of the snapshot file format (bump when changing any serialized data structure)
+#define NORI_SNAPSHOT_VERSION 6
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Persistent snapshot of the loaded meshes and the acceleration
+ * data structure of a scene
+ *
+ * Loading a large scene is dominated by parsing the OBJ files and
+ * building the BVH. A snapshot stores the resulting mesh buffers and
+ * hierarchy in a flat binary file, which is memory-mapped when the same
+ * scene is loaded again. The file is keyed by a hash of the scene
+ * description and of the size and modification time of all files
+ * referenced by it (see \ref computeKey()), so any change causes the
+ * snapshot to be rebuilt.
+ *
+ * The file consists of a header followed by a sequence of blocks, each
+ * of which is aligned to 64 bytes. Blocks contain plain data (values,
+ * arrays of POD structures, and matrices) and are read in exactly the same
+ * order in which they were written: first all meshes (in the order in
+ * which the XML parser created them), then the acceleration data structure.
+ */
+class Snapshot {
+public:
+    /**
+     * \brief Open the snapshot with the given filename
+     *
+     * When the file exists and matches \c key, it is memory-mapped and
+     * \ref isLoaded() returns \c true. Otherwise, the snapshot collects
+     * meshes via \ref addMesh() so that they can be written by \ref save().
+     */
+    Snapshot(const std::string &filename, uint64_t key);
+
+    /// Release the memory mapping
+    ~Snapshot();
+
+    /**
+     * \brief Compute the key of a scene from its XML description and
+     * the files referenced by it
+     */
+    static uint64_t computeKey(const std::string &xmlFilename,
+                               const std::vector<std::string> &files);
+
+    /// Was an existing snapshot with a matching key found?
+    bool isLoaded() const { return m_data != nullptr; }
+
+    /// Return the filename of the snapshot
+    const std::string &getFilename() const { return m_filename; }
+
+    // =======================================================================
+    //! @{ \name Reading
+    // =======================================================================
+
+    /// Create the next mesh stored in the snapshot
+    Mesh *loadMesh();
+
+    /// Read a block containing a single value
+    template <typename T> void read(T &value) {
+        const void *data = readBlock(sizeof(T));
+        memcpy((void *) &value, data, sizeof(T));
+    }
+
+    /// Read a block containing an array
+    template <typename T, typename Alloc> void read(std::vector<T, Alloc> &vector) {
+        size_t size;
+        const void *data = readBlock(size, sizeof(T));
+        vector.resize(size / sizeof(T));
+        memcpy((void *) vector.data(), data, size);
+    }
+
+    /// Read a block containing a matrix (e.g. mesh vertex positions)
+    template <typename Scalar> void read(Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> &matrix) {
+        uint64_t rows;
+        read(rows);
+        size_t size;
+        const void *data = readBlock(size, sizeof(Scalar));
+        uint64_t count = size / sizeof(Scalar);
+        matrix.resize((Eigen::Index) rows, (Eigen::Index) (rows > 0 ? count / rows : 0));
+        memcpy(matrix.data(), data, size);
+    }
+
+    /// Read a block containing a string
+    void read(std::string &string);
+
+    //! @}
+    // =======================================================================
+
+    // =======================================================================
+    //! @{ \name Writing
+    // =======================================================================
+
+    /// Register a mesh that was created by the XML parser (only if \ref isLoaded() is \c false)
+    void addMesh(const Mesh *mesh);
+
+    /**
+     * \brief Write the snapshot file containing all registered meshes and
+     * the given acceleration data structure
+     *
+     * The file is first written to a temporary location and then renamed,
+     * so that an interrupted run never leaves a partial snapshot behind.
+     */
+    void save(const Accel *accel);
+
+    /// Write a block containing a single value
+    template <typename T> void write(const T &value) {
+        writeBlock(&value, sizeof(T));
+    }
+
+    /// Write a block containing an array
+    template <typename T, typename Alloc> void write(const std::vector<T, Alloc> &vector) {
+        write(vector.data(), vector.size());
+    }
+
+    /// Write a block containing an array of \c count elements
+    template <typename T> void write(const T *data, size_t count) {
+        writeBlock(data, sizeof(T) * count);
+    }
+
+    /// Write a block containing a matrix (e.g. mesh vertex positions)
+    template <typename Scalar> void write(const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> &matrix) {
+        write((uint64_t) matrix.rows());
+        writeBlock(matrix.data(), sizeof(Scalar) * matrix.size());
+    }
+
+    /// Write a block containing a view of a matrix (e.g. mesh vertex positions)
+    template <typename Scalar> void write(const Eigen::Map<const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>> &matrix) {
+        write((uint64_t) matrix.rows());
+        writeBlock(matrix.data(), sizeof(Scalar) * matrix.size());
+    }
+
+    /// Write a block containing a string
+    void write(const std::string &string);
+
+    //! @}
+    // =======================================================================
+
+protected:
+    /// Return the next block (and check that its size is a multiple of \c unit)
+    const void *readBlock(size_t &size, size_t unit);
+
+    /// Return the next block (and check that it has the expected size)
+    const void *readBlock(size_t size);
+
+    /// Append a block to the snapshot file
+    void writeBlock(const void *data, size_t size);
+
+protected:
+    std::string m_filename;                 ///< Filename of the snapshot
+    uint64_t m_key;                         ///< Hash of the scene
+    const uint8_t *m_data = nullptr;        ///< Memory-mapped file contents
+    size_t m_size = 0;                      ///< Size of the file
+    size_t m_offset = 0;                    ///< Read/write position within the file
+    std::vector<const Mesh *> m_meshes;     ///< Meshes to be written by \ref save()
+    std::unique_ptr<std::ofstream> m_file;  ///< Output stream used by \ref save()
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,84 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+
+/**
+ * Evaluate the argument only when Nori is compiled with traversal
+ * statistics (CMake option \c NORI_TRAVERSAL_STATS). Otherwise, the
+ * statement disappears entirely and the statistics cost nothing.
+ */
+#if defined(NORI_TRAVERSAL_STATS)
+#  define NORI_STATS(...) __VA_ARGS__
+#else
+#  define NORI_STATS(...)
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Counters of the work done by ray traversal
+ *
+ * The traversal kernels of \ref Accel count the visited nodes and the
+ * triangle (packet) tests of the query that is currently traced by the
+ * calling thread. Every finished query is then added to the statistics
+ * of its thread, which consist of totals and of histograms over the
+ * cost of the individual rays. Packets and streams of rays visit nodes
+ * together; their cost is divided evenly among the rays.
+ *
+ * All counting happens inside \ref NORI_STATS(), i.e. only when the
+ * statistics are enabled at compile time.
+ */
+class TraversalStats {
+public:
+    /// Number of bins of the histograms (bin \c i holds costs in <tt>[2^(i-1), 2^i)</tt>)
+    static const int BinCount = 16;
+
+    /// Work done by one or more rays
+    struct Counters {
+        uint64_t rays = 0;      ///< Number of rays
+        uint64_t hits = 0;      ///< Number of rays that hit something
+        uint64_t nodes = 0;     ///< Number of visited nodes
+        uint64_t triangles = 0; ///< Number of triangle (packet) tests
+    };
+
+    /// Counters of the query traced by the calling thread (incremented by the traversal kernels)
+    static thread_local Counters query;
+
+    /// Start counting a new query on the calling thread
+    static void beginQuery() { query = Counters(); }
+
+    /// Add the current query, which traced \c rays rays, to the statistics of the calling thread
+    static void endQuery(uint32_t rays, uint32_t hits);
+
+    /// Return the sum over all queries finished by the calling thread
+    static Counters getThreadTotal();
+
+    /// Return the sum over all queries finished by all threads
+    static Counters getTotal();
+
+    /// Return a summary of all queries finished so far (totals and histograms)
+    static std::string summary();
+
+    /// Discard the statistics of all threads
+    static void reset();
+};
+
+NORI_NAMESPACE_END
@@ -17,98 +17,2050 @@
 */
 
 #include <nori/accel.h>
+#include <nori/bvhbuilder.h>
+#include <nori/instance.h>
+#include <nori/snapshot.h>
+#include <nori/stats.h>
+#include <nori/timer.h>
+#include <nori/simd.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
 #include <Eigen/Geometry>
+#include <atomic>
+#include <memory>
+#include <map>
+#include <sstream>
 
 NORI_NAMESPACE_BEGIN
 
+/* Parameters of the refitting, node layout and paging of the BVH */
+#define BVH_REFIT_TASK_DEPTH   8      /* Subtrees below this (binary) depth are refitted serially */
+#define BVH_TREELET_SIZE       128    /* Maximum number of nodes per treelet (4 KiB) */
+#define BVH_PAGE_SIZE          65536  /* Size of the pages of paged leaf data (in bytes) */
+#define BVH_MIN_PAGE_SIZE      4096   /* Smaller budgets reduce the page size down to this size .. */
+#define BVH_MIN_PAGES          64     /* .. so that they still hold this many pages */
+
+/// Rearrange leaf data so that the given <tt>(start, size)</tt> ranges become consecutive
+template <typename T> static void reorderLeaves(std::vector<T> &data,
+        const std::vector<std::pair<uint32_t, uint32_t>> &leaves, uint32_t leafCount) {
+    std::vector<T> result;
+    result.reserve(leafCount);
+    for (const auto &leaf : leaves)
+        result.insert(result.end(), data.begin() + leaf.first,
+                      data.begin() + leaf.first + leaf.second);
+    data.swap(result);
+}
+
+Accel::Accel(const PropertyList &propList) : m_propList(propList) {
+    m_meshOffset.push_back(0u);
+
+    /* Branching factor of the hierarchy: 2 (binary), 4 (BVH4) or 8 (BVH8). The
+       binary hierarchy is collapsed into a wide one, whose nodes store the
+       bounding boxes of all their children in SoA form, so that a single ray
+       can be tested against all of them using one vectorized slab test */
+    m_width = propList.getInteger("width", 2);
+    if (m_width != 2 && m_width != 4 && m_width != 8)
+        throw NoriException("Accel: the BVH width must be 2, 4, or 8 (got %i)!", m_width);
+
+    /* Copy the triangles of every leaf into SoA packets of 4 (or 8, for BVH8)
+       triangles, which are intersected all at once using a vectorized version
+       of the watertight ray-triangle test by Woop et al. This avoids the
+       indirection through the mesh index buffers during traversal */
+    bool packets = propList.getBoolean("packets", true);
+    m_packetWidth = packets ? (m_width == 8 ? 8 : 4) : 0;
+
+    /* Quantize the child bounding boxes of the wide nodes to 8-bit coordinates
+       on a grid spanning the parent node, which reduces the memory footprint
+       of the nodes by a factor of about 3 (for very large scenes) */
+    m_compressed = propList.getBoolean("compressed", false);
+    if (m_compressed && m_width == 2)
+        throw NoriException("Accel: compressed nodes require a BVH width of 4 or 8!");
+
+    /* Build a spatial split BVH (SBVH) for scenes with long and thin triangles
+       (e.g. architectural models): triangles may then be clipped against split
+       planes and referenced by several leaves, which reduces the overlap
+       between sibling nodes. The split budget bounds the number of duplicated
+       references relative to the triangle count */
+    m_spatialSplits = propList.getBoolean("spatialSplits", false);
+    m_splitBudget = propList.getFloat("splitBudget", 0.3f);
+    if (m_splitBudget < 0)
+        throw NoriException("Accel: the spatial split budget must be non-negative!");
+
+    /* Trade traversal performance for build speed: "fast" replaces the SAH
+       builder by a linear BVH (LBVH) builder for interactive previews, which
+       radix-sorts the triangles along a Morton curve and splits the nodes at
+       the bits of their Morton codes. This is an order of magnitude faster,
+       at the cost of a somewhat lower traversal performance */
+    std::string quality = propList.getString("buildQuality", "high");
+    if (quality != "high" && quality != "fast")
+        throw NoriException("Accel: the build quality must be \"high\" or \"fast\" (got \"%s\")!", quality);
+    m_fastBuild = quality == "fast";
+    if (m_fastBuild && m_spatialSplits)
+        throw NoriException("Accel: spatial splits require a build quality of \"high\"!");
+
+    /* Split every node only when a ray first enters it, for huge scenes of
+       which only a small part is visible (e.g. in close-ups): build() merely
+       creates the root, which covers all triangles, and every node is split
+       using binned SAH the first time a ray enters it (see expandNode()).
+       Other threads keep traversing the hierarchy in the meantime, and the
+       nodes are allocated in segments as the hierarchy grows (see LazyNodes) */
+    m_lazyBuild = propList.getBoolean("lazyBuild", false);
+    if (m_lazyBuild && (m_width != 2 || m_spatialSplits || m_fastBuild))
+        throw NoriException("Accel: lazy construction requires a binary SAH BVH (width 2, "
+                            "no spatial splits, build quality \"high\")!");
+    if (m_lazyBuild)
+        m_packetWidth = 0; /* Leaves are created during traversal and refer to m_indices */
+
+    /* Build a separate bottom-level hierarchy for every mesh (like an instance,
+       but without transformation), for scenes consisting of many separately
+       loaded meshes. The hierarchy of a mesh can then be built as soon as the
+       mesh is loaded, while other meshes are still being loaded (see
+       buildMesh()), and build() only has to construct the top-level BVH.
+       Rays traverse somewhat more nodes when the bounds of the meshes overlap */
+    m_meshHierarchies = propList.getBoolean("meshHierarchies", false);
+
+    /* Order in which the binary BVH nodes are stored in memory (the two children
+       of a node always share a cache line):
+       - "depthfirst": the subtree of every node is stored contiguously.
+       - "hotchild": like "depthfirst", but the child with the larger surface
+         area (which rays are more likely to visit) comes first, and its
+         subtree directly follows the pair of children.
+       - "treelet": the tree is cut into treelets of up to 128 nodes (4 KiB) by
+         repeatedly expanding the node with the largest surface area, and every
+         treelet is stored contiguously, so that rays that descend the tree
+         touch fewer pages and cache lines.
+       The bvhstat tool compares their throughput. So far, none measurably
+       outperformed "depthfirst" on scenes that fit into memory */
+    std::string layout = propList.getString("nodeLayout", "depthfirst");
+    if (layout == "depthfirst")
+        m_layout = EDepthFirst;
+    else if (layout == "hotchild")
+        m_layout = EHotChild;
+    else if (layout == "treelet")
+        m_layout = ETreelet;
+    else
+        throw NoriException("Accel: the node layout must be \"depthfirst\", \"hotchild\" or \"treelet\" (got \"%s\")!", layout);
+
+    /* Rebuild instead of refitting (see refit()) when the SAH cost increases
+       by more than this factor relative to a freshly built hierarchy */
+    m_rebuildThreshold = propList.getFloat("rebuildThreshold", 1.5f);
+    if (m_rebuildThreshold < 1)
+        throw NoriException("Accel: the rebuild threshold must be at least 1!");
+
+    /* Keep at most this many MiB of the leaf data in memory and page in the rest
+       on demand: the triangle packets are generated straight into a memory-mapped
+       file in the page directory (default: the system's temporary directory),
+       which is loaded in pages of 64 KiB (or less, for small budgets), and the
+       least recently used pages are released once the budget is exceeded (see
+       PageCache). Since the packets of a leaf are stored next to those of nearby
+       leaves, rays mostly access pages that were recently loaded. The vertex
+       attributes and faces of the meshes are paged as well (see Mesh::page()),
+       and only the nodes and the triangle indices remain in memory. Note that
+       the meshes are loaded and the hierarchy is built in memory before any of
+       this happens: paging bounds the resident set after the build, but not
+       the peak memory usage of loading and building the scene */
+    m_pageBudget = propList.getFloat("pageBudget", 0.0f);
+    m_pageDirectory = propList.getString("pageDirectory", "");
+    if (m_pageBudget < 0)
+        throw NoriException("Accel: the page budget must be non-negative!");
+    if (m_pageBudget > 0 && m_packetWidth == 0)
+        throw NoriException("Accel: paging the leaf data requires triangle packets (and no lazy construction)!");
+    if (m_pageBudget > 0 && m_meshHierarchies)
+        throw NoriException("Accel: paging the leaf data is not supported by separate mesh hierarchies!");
+}
+
 void Accel::addMesh(Mesh *mesh) {
-    if (m_mesh)
-        throw NoriException("Accel: only a single mesh is supported!");
-    m_mesh = mesh;
-    m_bbox = m_mesh->getBoundingBox();
+    if (!m_indices.empty() || !m_instanceNodes.empty())
+        throw NoriException("Accel::addMesh(): the hierarchy was already built!");
+    m_meshes.push_back(mesh);
+    m_meshOffset.push_back(m_meshOffset.back() + mesh->getTriangleCount());
+    m_bbox.expandBy(mesh->getBoundingBox());
+}
+
+void Accel::addInstance(Instance *instance) {
+    if (!m_instanceNodes.empty())
+        throw NoriException("Accel::addInstance(): the hierarchy was already built!");
+    m_instances.push_back(instance);
+    m_bbox.expandBy(instance->getBoundingBox());
 }
 
 void Accel::build() {
-    /* Nothing to do here for now */
+    if (!m_instances.empty() || m_meshHierarchies)
+        buildInstances();
+    if (!m_meshHierarchies)
+        buildTriangles();
 }
 
-bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
-    bool foundIntersection = false;  // Was an intersection found so far?
-    uint32_t f = (uint32_t) -1;      // Triangle index of the closest intersection
+void Accel::buildMesh(Mesh *mesh) {
+    if (!m_instanceNodes.empty())
+        throw NoriException("Accel::buildMesh(): the hierarchy was already built!");
 
-    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+    std::unique_ptr<Accel> accel = createMeshAccel(mesh);
+    accel->build();
+
+    std::lock_guard<std::mutex> lock(m_builtMeshMutex);
+    m_builtMeshAccels[mesh] = std::move(accel);
+}
+
+void Accel::buildTriangles() {
+    uint32_t size = getTriangleCount();
+    if (size == 0)
+        return;
+
+    /* Bottom-level hierarchies may be built concurrently (see \ref buildMesh()),
+       hence they print their report in one piece once they are done */
+    std::ostringstream buffer;
+    std::ostream &os = m_bottomLevel ? buffer : cout;
+
+    os << "Constructing " << (m_spatialSplits ? "an SBVH" : (m_fastBuild ? "a linear BVH" :
+                              (m_lazyBuild ? "a lazy SAH BVH" : "a SAH BVH")))
+       << " (" << m_meshes.size() << " meshes, " << size << " triangles) .. ";
+    os.flush();
+    Timer timer;
+
+    uint32_t duplicates = 0;
+    if (m_spatialSplits) {
+        SpatialBVHBuilder builder(*this);
+        builder.build();
+        duplicates = builder.getDuplicateCount();
+    } else {
+        m_indices.resize(size);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, size, 65536u),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    m_indices[i] = i;
+            }
+        );
+
+        if (m_lazyBuild) {
+            if (size >= (1u << 30))
+                throw NoriException("Accel: lazy construction supports at most 2^30 triangles!");
+
+            /* The root covers all triangles and is split by the first ray
+               that enters it. It is followed by an empty leaf for padding */
+            m_nodes.resize(2);
+            for (const Mesh *mesh : m_meshes)
+                m_nodes[0].bbox.expandBy(mesh->getBoundingBox());
+            m_nodes[0].leaf.flag = m_nodes[1].leaf.flag = 1;
+            m_nodes[0].leaf.unbuilt = size > 1 ? 1u : 0u;
+            m_nodes[0].leaf.size = size;
+            prepareExpansion();
+        } else if (m_fastBuild) {
+            BVHBuilder(*this).buildLinear();
+        } else {
+            BVHBuilder(*this).build();
+        }
+    }
+
+    std::vector<PacketRange> packetRanges;
+    if (m_packetWidth == 4)
+        buildPackets<4>(packetRanges);
+    else if (m_packetWidth == 8)
+        buildPackets<8>(packetRanges);
+
+    /* Lazily built hierarchies are split up to the maximum depth at most,
+       and their depth is only known as the traversal expands them */
+    if (!m_lazyBuild) {
+        m_stackDepth = stackDepth(m_nodes);
+        if (m_stackDepth > BVH_MAX_DEPTH)
+            throw NoriException("Accel: the BVH is too deep for the traversal stack (%i > %i levels)!",
+                                m_stackDepth, BVH_MAX_DEPTH);
+    }
+
+    size_t nodeMemory = m_lazyBuild ? m_lazyNodes.memoryUsage() : sizeof(BVHNode) * m_nodes.size();
+    if (m_compressed) {
+        /* Compressed nodes expect the leaves of every node to be
+           stored consecutively, hence the leaf data is reordered */
+        std::vector<std::pair<uint32_t, uint32_t>> leaves;
+        uint32_t leafCount = 0;
+        if (m_width == 4) {
+            m_qnodes4.resize(1);
+            compress<4>(0, 0, leaves, leafCount);
+            nodeMemory = sizeof(QBVH4Node) * m_qnodes4.size();
+        } else {
+            m_qnodes8.resize(1);
+            compress<8>(0, 0, leaves, leafCount);
+            nodeMemory = sizeof(QBVH8Node) * m_qnodes8.size();
+        }
+        if (!packetRanges.empty())
+            reorderLeaves(packetRanges, leaves, leafCount);
+        else if (m_packetWidth == 4)
+            reorderLeaves(m_packets4, leaves, leafCount);
+        else if (m_packetWidth == 8)
+            reorderLeaves(m_packets8, leaves, leafCount);
+        else
+            reorderLeaves(m_indices, leaves, leafCount);
+    } else if (m_width == 4) {
+        collapse<4>(0);
+        nodeMemory = sizeof(BVH4Node) * m_nodes4.size();
+    } else if (m_width == 8) {
+        collapse<8>(0);
+        nodeMemory = sizeof(BVH8Node) * m_nodes8.size();
+    }
+    if (m_width != 2) {
+        /* The binary nodes are not needed anymore */
+        NodeVector<BVHNode>().swap(m_nodes);
+    }
+
+    os << "done. (" << getNodeCount() << " nodes, stack depth ";
+    if (m_lazyBuild)
+        os << "n/a (lazy), ";
+    else
+        os << m_stackDepth << "/" << BVH_MAX_DEPTH << ", ";
+    if (m_spatialSplits)
+        os << duplicates << " duplicated references, ";
+    os << "took " << timer.elapsedString() << " and " << memString(nodeMemory)
+       << " + " << memString(leafMemory()) << " of leaf data)" << endl;
+    if (m_bottomLevel) {
+        cout << buffer.str();
+        cout.flush();
+    }
+
+    pageLeaves(packetRanges);
+
+    /* Reference for the quality of refitted hierarchies (lazy ones are always rebuilt) */
+    if (!m_lazyBuild)
+        m_sahCost = updateBounds(false);
+}
+
+/// Return the size of the pages of a page cache with the given budget
+static size_t pageSize(size_t budget) {
+    size_t size = BVH_PAGE_SIZE;
+    while (size > BVH_MIN_PAGE_SIZE && budget < BVH_MIN_PAGES * size)
+        size /= 2;
+    return size;
+}
+
+void Accel::pageLeaves(const std::vector<PacketRange> &ranges) {
+    size_t packetCount = ranges.empty() ? std::max(m_packets4.size(), m_packets8.size()) : ranges.size();
+    if (m_pageBudget <= 0 || packetCount == 0)
+        return;
+
+    /* The budget is split in proportion to the size of the packets and
+       of all meshes (including those that were paged by an earlier build) */
+    size_t packetSize = (m_packetWidth == 4 ? sizeof(TrianglePacket<4>) : sizeof(TrianglePacket<8>)) * packetCount;
+    size_t meshSize = 0, pagedMeshSize = 0;
+    for (const Mesh *mesh : m_meshes) {
+        meshSize += mesh->getBufferSize();
+        if (mesh->isPaged())
+            pagedMeshSize += mesh->getBufferSize();
+    }
+    size_t budget = (size_t) ((double) m_pageBudget * 1024 * 1024);
+    size_t packetBudget = (size_t) ((double) budget * packetSize / (packetSize + meshSize));
+    size_t meshBudget = (size_t) ((double) budget * (meshSize - pagedMeshSize) / (packetSize + meshSize));
+
+    cout << "Paging the leaf data (" << memString(packetSize) << " + " << memString(meshSize - pagedMeshSize)
+         << " of meshes, budget " << memString(budget) << ") .. ";
+    cout.flush();
+    Timer timer;
+
+    m_pageCache.reset(new PageCache(packetSize, pageSize(packetBudget), packetBudget, m_pageDirectory));
+    if (m_packetWidth == 4)
+        writePackets<4>(ranges);
+    else
+        writePackets<8>(ranges);
+
+    /* The packets were generated from the meshes, which can be paged now */
+    if (meshSize > pagedMeshSize) {
+        m_meshPageCache = std::make_shared<PageCache>(
+            meshSize - pagedMeshSize, pageSize(meshBudget), meshBudget, m_pageDirectory);
+        size_t offset = 0;
+        for (Mesh *mesh : m_meshes) {
+            if (mesh->isPaged())
+                continue;
+            size_t size = mesh->getBufferSize();
+            mesh->page(m_meshPageCache, offset);
+            offset += size;
+        }
+    }
+
+    cout << "done. (" << m_pageCache->getPageCount() << " + "
+         << (m_meshPageCache ? m_meshPageCache->getPageCount() : 0) << " pages, took "
+         << timer.elapsedString() << ")" << endl;
+}
+
+std::unique_ptr<Accel> Accel::createMeshAccel(Mesh *mesh) const {
+    std::unique_ptr<Accel> accel(new Accel(m_propList));
+    accel->m_pageBudget = 0; /* Meshes with their own hierarchy are stored once and remain in memory */
+    accel->m_meshHierarchies = false;
+    accel->m_bottomLevel = true;
+    accel->addMesh(mesh);
+    return accel;
+}
+
+void Accel::createInstanceAccels() {
+    /* Create a bottom-level hierarchy for every distinct mesh (in a
+       deterministic order, which snapshots rely on) */
+    std::map<const Mesh *, const Accel *> meshAccel;
+    auto getAccel = [&](Mesh *mesh) {
+        auto it = meshAccel.find(mesh);
+        if (it == meshAccel.end()) {
+            auto built = m_builtMeshAccels.find(mesh);
+            std::unique_ptr<Accel> accel = built != m_builtMeshAccels.end()
+                ? std::move(built->second) : createMeshAccel(mesh);
+            it = meshAccel.insert(std::make_pair(mesh, accel.get())).first;
+            m_meshAccels.push_back(std::move(accel));
+        }
+        return it->second;
+    };
+
+    /* The instances are followed by the meshes in the top-level hierarchy */
+    m_instanceAccel.reserve(m_instances.size() + (m_meshHierarchies ? m_meshes.size() : 0));
+    for (Instance *instance : m_instances)
+        m_instanceAccel.push_back(getAccel(instance->getMesh()));
+    if (m_meshHierarchies) {
+        for (Mesh *mesh : m_meshes)
+            m_instanceAccel.push_back(getAccel(mesh));
+    }
+    m_builtMeshAccels.clear();
+}
+
+BoundingBox3f Accel::getEntryBoundingBox(uint32_t idx) const {
+    if (idx < m_instances.size())
+        return m_instances[idx]->getBoundingBox();
+    return m_meshes[idx - m_instances.size()]->getBoundingBox();
+}
+
+void Accel::buildInstances() {
+    createInstanceAccels();
+    if (m_instanceAccel.empty())
+        return;
+
+    /* Hierarchies built by buildMesh() are ready already */
+    for (const std::unique_ptr<Accel> &accel : m_meshAccels) {
+        if (accel->m_indices.empty())
+            accel->build();
+    }
+    buildTopLevel();
+}
+
+void Accel::buildTopLevel() {
+    if (m_meshHierarchies)
+        cout << "Constructing the top-level BVH (" << m_instances.size() << " instances, "
+             << m_meshes.size() << " meshes, " << m_meshAccels.size() << " bottom-level hierarchies) .. ";
+    else
+        cout << "Constructing the top-level BVH (" << m_instances.size() << " instances of "
+             << m_meshAccels.size() << " meshes) .. ";
+    cout.flush();
+    Timer timer;
+
+    uint32_t size = (uint32_t) m_instanceAccel.size();
+    std::vector<BoundingBox3f> bboxes(size);
+    m_instanceIndices.resize(size);
+    for (uint32_t i = 0; i < size; ++i) {
+        bboxes[i] = getEntryBoundingBox(i);
+        m_instanceIndices[i] = i;
+    }
+
+    BVHBuilder(bboxes, m_instanceIndices, m_instanceNodes, m_layout).build();
+    m_instanceSahCost = updateInstanceBounds(false);
+
+    uint32_t depth = stackDepth(m_instanceNodes);
+    if (depth > BVH_MAX_DEPTH)
+        throw NoriException("Accel: the top-level BVH is too deep for the traversal stack (%i > %i levels)!",
+                            depth, BVH_MAX_DEPTH);
+
+    cout << "done. (" << m_instanceNodes.size() << " nodes, stack depth " << depth << "/" << BVH_MAX_DEPTH
+         << ", took " << timer.elapsedString()
+         << " and " << memString(sizeof(BVHNode) * m_instanceNodes.size() +
+                                 (sizeof(uint32_t) + sizeof(Instance *) + sizeof(Accel *)) * size)
+         << ")" << endl;
+}
+
+void Accel::layoutNodes(const BVHNode *nodes, NodeVector<BVHNode> &output, ENodeLayout layout) {
+    output.clear();
+    output.push_back(nodes[0]);
+    if (nodes[0].isLeaf())
+        return;
+
+    /* An empty leaf after the root ensures that all pairs of children start
+       at even indices, i.e. at the beginning of a 64-byte cache line */
+    BVHNode padding;
+    padding.leaf.flag = 1;
+    padding.leaf.unbuilt = 0;
+    padding.leaf.size = 0;
+    padding.leaf.start = 0;
+    output.push_back(padding);
+
+    /* Append the children of the source node 'src', which was already stored
+       at index 'dst' of the output. Returns the source indices of the children
+       in the order in which they were stored, along with the index of the first one */
+    auto storeChildren = [&](uint32_t src, uint32_t dst, uint32_t *children) {
+        children[0] = src + 1;
+        children[1] = nodes[src].inner.children;
+        bool reversed = layout != EDepthFirst &&
+            nodes[children[1]].bbox.getSurfaceArea() > nodes[children[0]].bbox.getSurfaceArea();
+        if (reversed)
+            std::swap(children[0], children[1]);
+
+        uint32_t first = (uint32_t) output.size();
+        output[dst].inner.children = first;
+        output[dst].inner.reversed = reversed ? 1u : 0u;
+        output[dst].inner.unused = 0;
+        output.push_back(nodes[children[0]]);
+        output.push_back(nodes[children[1]]);
+        return first;
+    };
+
+    /* Inner node whose children still need to be stored */
+    struct Entry {
+        float area;
+        uint32_t src, dst;
+        bool operator<(const Entry &e) const { return area < e.area; }
+    };
+
+    std::vector<Entry> stack { Entry { nodes[0].bbox.getSurfaceArea(), 0, 0 } };
+    uint32_t children[2];
+
+    if (layout != ETreelet) {
+        /* Depth-first order over the pairs of children */
+        while (!stack.empty()) {
+            Entry entry = stack.back();
+            stack.pop_back();
+            uint32_t first = storeChildren(entry.src, entry.dst, children);
+            for (int i = 1; i >= 0; --i) {
+                if (nodes[children[i]].isInner())
+                    stack.push_back(Entry { 0.0f, children[i], first + i });
+            }
+        }
+        return;
+    }
+
+    /* Grow every treelet from its root by repeatedly expanding the node with
+       the largest surface area. Nodes that no longer fit become the roots of
+       further treelets, which are stored after it (largest first). */
+    std::vector<Entry> heap;
+    while (!stack.empty()) {
+        heap.clear();
+        heap.push_back(stack.back());
+        stack.pop_back();
+
+        for (uint32_t size = 0; !heap.empty() && size + 2 <= BVH_TREELET_SIZE; size += 2) {
+            std::pop_heap(heap.begin(), heap.end());
+            Entry entry = heap.back();
+            heap.pop_back();
+
+            uint32_t first = storeChildren(entry.src, entry.dst, children);
+            for (int i = 0; i < 2; ++i) {
+                const BVHNode &child = nodes[children[i]];
+                if (child.isInner()) {
+                    heap.push_back(Entry { child.bbox.getSurfaceArea(), children[i], first + i });
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+        }
+
+        std::sort(heap.begin(), heap.end());
+        stack.insert(stack.end(), heap.begin(), heap.end());
+    }
+}
+
+uint32_t Accel::stackDepth(const NodeVector<BVHNode> &nodes) {
+    /* Parents are stored before their children in every node layout */
+    std::vector<uint32_t> depth(nodes.size(), 0);
+    uint32_t maxDepth = 0;
+    for (uint32_t i = 0; i < nodes.size(); ++i) {
+        const BVHNode &node = nodes[i];
+        if (node.isLeaf())
+            maxDepth = std::max(maxDepth, depth[i]);
+        else
+            depth[node.inner.children] = depth[node.inner.children + 1] = depth[i] + 1;
+    }
+    return maxDepth;
+}
+
+void Accel::serialize(Snapshot &snapshot) const {
+    /* Configuration (checked when the hierarchy is loaded) */
+    snapshot.write(m_width);
+    snapshot.write(m_packetWidth);
+    snapshot.write(m_compressed);
+    snapshot.write(m_lazyBuild);
+    snapshot.write(m_meshHierarchies);
+    snapshot.write(getTriangleCount());
+
+    serializeTriangles(snapshot);
+
+    /* Two-level hierarchy */
+    snapshot.write((uint32_t) m_meshAccels.size());
+    for (const std::unique_ptr<Accel> &accel : m_meshAccels)
+        accel->serialize(snapshot);
+    snapshot.write(m_instanceNodes);
+    snapshot.write(m_instanceIndices);
+    snapshot.write(m_instanceSahCost);
+}
+
+void Accel::unserialize(Snapshot &snapshot) {
+    cout << "Loading the BVH from the snapshot (" << m_meshes.size() << " meshes, "
+         << getTriangleCount() << " triangles, " << m_instances.size() << " instances) .. ";
+    cout.flush();
+    Timer timer;
+
+    load(snapshot);
+
+    cout << "done. (" << getNodeCount() << " nodes, took " << timer.elapsedString() << ")" << endl;
+
+    pageLeaves();
+}
+
+void Accel::load(Snapshot &snapshot) {
+    if (!m_indices.empty() || !m_instanceNodes.empty())
+        throw NoriException("Accel::unserialize(): the hierarchy was already built!");
+
+    int width, packetWidth;
+    bool compressed, lazyBuild, meshHierarchies;
+    uint32_t triangleCount;
+    snapshot.read(width);
+    snapshot.read(packetWidth);
+    snapshot.read(compressed);
+    snapshot.read(lazyBuild);
+    snapshot.read(meshHierarchies);
+    snapshot.read(triangleCount);
+    if (width != m_width || packetWidth != m_packetWidth || compressed != m_compressed ||
+        lazyBuild != m_lazyBuild || meshHierarchies != m_meshHierarchies ||
+        triangleCount != getTriangleCount())
+        throw NoriException("Accel::unserialize(): the BVH stored in the snapshot \"%s\" does "
+                            "not match the scene!", snapshot.getFilename());
+
+    loadTriangles(snapshot);
+
+    /* Two-level hierarchy */
+    uint32_t meshAccelCount;
+    snapshot.read(meshAccelCount);
+    createInstanceAccels();
+    if (meshAccelCount != m_meshAccels.size())
+        throw NoriException("Accel::unserialize(): the BVH stored in the snapshot \"%s\" does "
+                            "not match the scene!", snapshot.getFilename());
+    for (const std::unique_ptr<Accel> &accel : m_meshAccels)
+        accel->load(snapshot);
+    snapshot.read(m_instanceNodes);
+    snapshot.read(m_instanceIndices);
+    snapshot.read(m_instanceSahCost);
+}
+
+void Accel::serializeTriangles(Snapshot &snapshot) const {
+    /* Lazily built hierarchies are stored as far as they were split */
+    if (m_lazyBuild) {
+        NodeVector<BVHNode> nodes(m_lazyNodes.size());
+        for (uint32_t i = 0; i < nodes.size(); ++i)
+            nodes[i] = m_lazyNodes[i];
+        snapshot.write(nodes);
+    } else {
+        snapshot.write(m_nodes);
+    }
+    snapshot.write(m_nodes4);
+    snapshot.write(m_nodes8);
+    snapshot.write(m_qnodes4);
+    snapshot.write(m_qnodes8);
+    snapshot.write(m_indices);
+    serializePackets<4>(snapshot);
+    serializePackets<8>(snapshot);
+    snapshot.write(m_sahCost);
+    snapshot.write(m_stackDepth);
+}
+
+void Accel::loadTriangles(Snapshot &snapshot) {
+    snapshot.read(m_nodes);
+    snapshot.read(m_nodes4);
+    snapshot.read(m_nodes8);
+    snapshot.read(m_qnodes4);
+    snapshot.read(m_qnodes8);
+    snapshot.read(m_indices);
+    snapshot.read(m_packets4);
+    snapshot.read(m_packets8);
+    snapshot.read(m_sahCost);
+    snapshot.read(m_stackDepth);
+    if (m_lazyBuild && !m_nodes.empty())
+        prepareExpansion();
+}
+
+template <> std::vector<Accel::TrianglePacket<4>> &Accel::trianglePackets<4>() { return m_packets4; }
+template <> std::vector<Accel::TrianglePacket<8>> &Accel::trianglePackets<8>() { return m_packets8; }
+template <> const std::vector<Accel::TrianglePacket<4>> &Accel::trianglePackets<4>() const { return m_packets4; }
+template <> const std::vector<Accel::TrianglePacket<8>> &Accel::trianglePackets<8>() const { return m_packets8; }
+
+template <int Width> void Accel::buildPackets(std::vector<PacketRange> &ranges) {
+    /* Determine where the packets of each leaf will be stored */
+    ranges.clear();
+    for (uint32_t i = 0; i < m_nodes.size(); ++i) {
+        BVHNode &node = m_nodes[i];
+        if (node.isInner())
+            continue;
+        uint32_t first = node.leaf.start, size = node.leaf.size;
+        node.leaf.start = (uint32_t) ranges.size();
+        node.leaf.size = (size + Width - 1) / Width;
+        for (uint32_t j = 0; j < size; j += Width)
+            ranges.emplace_back(first + j, std::min(size - j, (uint32_t) Width));
+    }
+
+    /* Paged packets are generated straight into the page file (see pageLeaves()) */
+    if (m_pageBudget <= 0) {
+        fillPackets<Width>(ranges);
+        std::vector<PacketRange>().swap(ranges);
+    }
+}
+
+template <int Width> void Accel::fillPackets(const std::vector<PacketRange> &ranges) {
+    std::vector<TrianglePacket<Width>> &packets = trianglePackets<Width>();
+    packets.resize(ranges.size());
+
+    /* Gather the triangles of all packets in parallel */
+    tbb::parallel_for(tbb::blocked_range<size_t>(0u, ranges.size(), 1024u),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t i = range.begin(); i != range.end(); ++i)
+                fillPacket(packets[i], ranges[i].first, ranges[i].second);
+        }
+    );
+}
+
+template <int Width> void Accel::writePackets(const std::vector<PacketRange> &ranges) {
+    std::vector<TrianglePacket<Width>> &packets = trianglePackets<Width>();
+    if (ranges.empty()) {
+        /* The packets were loaded from a snapshot */
+        m_pageCache->write(0, packets.data(), sizeof(TrianglePacket<Width>) * packets.size());
+        std::vector<TrianglePacket<Width>>().swap(packets);
+        return;
+    }
+
+    /* Generate the packets in chunks of at most one page, so that they are never all in memory */
+    size_t chunkSize = std::max(m_pageCache->getPageSize() / sizeof(TrianglePacket<Width>), (size_t) 1);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0u, ranges.size(), chunkSize),
+        [&](const tbb::blocked_range<size_t> &range) {
+            std::vector<TrianglePacket<Width>> chunk(range.size());
+            for (size_t i = range.begin(); i != range.end(); ++i)
+                fillPacket(chunk[i - range.begin()], ranges[i].first, ranges[i].second);
+            m_pageCache->write(sizeof(TrianglePacket<Width>) * range.begin(), chunk.data(),
+                               sizeof(TrianglePacket<Width>) * chunk.size());
+        }
+    );
+}
+
+void Accel::touchTriangles(const uint32_t *indices, uint32_t count) const {
+    if (!m_meshPageCache)
+        return;
+
+    /* Report consecutive triangles of the same mesh together */
+    const uint32_t batchSize = 64;
+    uint32_t local[batchSize], size = 0, meshIdx = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t idx = indices[i], mesh = findMesh(idx);
+        if (size > 0 && (mesh != meshIdx || size == batchSize)) {
+            m_meshes[meshIdx]->touch(local, size);
+            size = 0;
+        }
+        meshIdx = mesh;
+        local[size++] = idx;
+    }
+    if (size > 0)
+        m_meshes[meshIdx]->touch(local, size);
+}
+
+template <int Width> void Accel::fillPacket(TrianglePacket<Width> &packet, uint32_t first,
+                                            uint32_t size) const {
+    touchTriangles(m_indices.data() + first, size);
+    for (uint32_t k = 0; k < (uint32_t) Width; ++k) {
+        if (k >= size) {
+            /* Pad with NaN vertices, which fail all tests */
+            for (int v = 0; v < 3; ++v)
+                for (int axis = 0; axis < 3; ++axis)
+                    packet.p[v][axis][k] = std::numeric_limits<float>::quiet_NaN();
+            packet.index[k] = 0;
+            continue;
+        }
+
+        uint32_t index = m_indices[first + k], idx = index;
+        const Mesh *mesh = m_meshes[findMesh(idx)];
+        MatrixXfMap V = mesh->getVertexPositionView();
+        MatrixXuMap F = mesh->getIndexView();
+        for (int v = 0; v < 3; ++v)
+            for (int axis = 0; axis < 3; ++axis)
+                packet.p[v][axis][k] = V(axis, F(v, idx));
+        packet.index[k] = index;
+    }
+}
+
+/* Also used by the leaves of the kd-tree (see kdtree.cpp) */
+template void Accel::fillPackets<4>(const std::vector<PacketRange> &);
+
+template <int Width> const Accel::TrianglePacket<Width> *Accel::leafPackets(uint32_t start, uint32_t end) const {
+    if (!m_pageCache)
+        return trianglePackets<Width>().data() + start;
+    m_pageCache->touch(sizeof(TrianglePacket<Width>) * start, sizeof(TrianglePacket<Width>) * (end - start));
+    return (const TrianglePacket<Width> *) m_pageCache->getData() + start;
+}
+
+/* Also used by the packet and stream traversal (see raypacket.cpp) */
+template const Accel::TrianglePacket<4> *Accel::leafPackets<4>(uint32_t, uint32_t) const;
+template const Accel::TrianglePacket<8> *Accel::leafPackets<8>(uint32_t, uint32_t) const;
+
+template <int Width> void Accel::serializePackets(Snapshot &snapshot) const {
+    if (m_pageCache && m_packetWidth == Width)
+        snapshot.write((const TrianglePacket<Width> *) m_pageCache->getData(),
+                       m_pageCache->getSize() / sizeof(TrianglePacket<Width>));
+    else
+        snapshot.write(trianglePackets<Width>());
+}
+
+/* Also used by the kd-tree */
+template void Accel::serializePackets<4>(Snapshot &) const;
+
+void Accel::splitTriangle(const Point3f *p, const BoundingBox3f &bbox, int axis, float pos,
+                          BoundingBox3f &left, BoundingBox3f &right) {
+    left.reset();
+    right.reset();
+    for (int i = 0; i < 3; ++i) {
+        const Point3f &p0 = p[i], &p1 = p[(i + 1) % 3];
+        float v0 = p0[axis], v1 = p1[axis];
+        if (v0 <= pos)
+            left.expandBy(p0);
+        if (v0 >= pos)
+            right.expandBy(p0);
+        if ((v0 < pos && v1 > pos) || (v0 > pos && v1 < pos)) {
+            /* The edge crosses the plane */
+            Point3f p = p0 + (p1 - p0) * clamp((pos - v0) / (v1 - v0), 0.0f, 1.0f);
+            p[axis] = pos;
+            left.expandBy(p);
+            right.expandBy(p);
+        }
+    }
+    left.max[axis] = std::min(left.max[axis], pos);
+    right.min[axis] = std::max(right.min[axis], pos);
+    left.clip(bbox);
+    right.clip(bbox);
+}
+
+template <> NodeVector<Accel::BVH4Node> &Accel::wideNodes() { return m_nodes4; }
+template <> NodeVector<Accel::BVH8Node> &Accel::wideNodes() { return m_nodes8; }
+template <> NodeVector<Accel::QBVH4Node> &Accel::wideNodes() { return m_qnodes4; }
+template <> NodeVector<Accel::QBVH8Node> &Accel::wideNodes() { return m_qnodes8; }
+template <> const NodeVector<Accel::BVH4Node> &Accel::wideNodes() const { return m_nodes4; }
+template <> const NodeVector<Accel::BVH8Node> &Accel::wideNodes() const { return m_nodes8; }
+template <> const NodeVector<Accel::QBVH4Node> &Accel::wideNodes() const { return m_qnodes4; }
+template <> const NodeVector<Accel::QBVH8Node> &Accel::wideNodes() const { return m_qnodes8; }
+
+template <int Width> uint32_t Accel::collapseChildren(uint32_t nodeIdx, uint32_t *children) const {
+    uint32_t childCount = 0;
+    if (m_nodes[nodeIdx].isLeaf()) {
+        children[childCount++] = nodeIdx;
+    } else {
+        children[childCount++] = m_nodes[nodeIdx].inner.children;
+        children[childCount++] = m_nodes[nodeIdx].inner.children + 1;
+    }
+
+    while (childCount < Width) {
+        int best = -1;
+        float bestArea = -1;
+        for (uint32_t i = 0; i < childCount; ++i) {
+            const BVHNode &child = m_nodes[children[i]];
+            if (child.isInner() && child.bbox.getSurfaceArea() > bestArea) {
+                best = (int) i;
+                bestArea = child.bbox.getSurfaceArea();
+            }
+        }
+        if (best == -1)
+            break;
+        uint32_t inner = children[best];
+        children[best] = m_nodes[inner].inner.children;
+        children[childCount++] = m_nodes[inner].inner.children + 1;
+    }
+
+    return childCount;
+}
+
+template <int Width> uint32_t Accel::collapse(uint32_t nodeIdx) {
+    NodeVector<WideBVHNode<Width>> &nodes = wideNodes<WideBVHNode<Width>>();
+
+    uint32_t children[Width];
+    uint32_t childCount = collapseChildren<Width>(nodeIdx, children);
+
+    uint32_t wideIdx = (uint32_t) nodes.size();
+    nodes.emplace_back();
+    for (int i = 0; i < Width; ++i) {
+        WideBVHNode<Width> &node = nodes[wideIdx];
+        BoundingBox3f bbox;
+        node.child[i] = (uint32_t) -1;
+        node.size[i] = 0;
+
+        if ((uint32_t) i < childCount) {
+            const BVHNode &child = m_nodes[children[i]];
+            bbox = child.bbox;
+            if (child.isLeaf()) {
+                node.child[i] = child.start();
+                node.size[i] = child.leaf.size;
+            }
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            node.bounds[2 * axis][i] = bbox.min[axis];
+            node.bounds[2 * axis + 1][i] = bbox.max[axis];
+        }
+    }
+
+    /* Recurse into the inner children (this may reallocate 'nodes') */
+    for (uint32_t i = 0; i < childCount; ++i) {
+        if (m_nodes[children[i]].isInner()) {
+            uint32_t childIdx = collapse<Width>(children[i]);
+            nodes[wideIdx].child[i] = childIdx;
+        }
+    }
+
+    return wideIdx;
+}
+
+template <int Width> void Accel::QuantizedBVHNode<Width>::setBounds(const BoundingBox3f &bbox,
+                                                                  const BoundingBox3f *childBBoxes) {
+    /* Choose the smallest power-of-two grid spacing along each axis
+       such that 255 grid cells cover the bounding box of the node */
+    float scale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = bbox.max[axis] - bbox.min[axis];
+        int exponent = -126;
+        if (extent > 0) {
+            std::frexp(extent / 255.0f, &exponent);
+            exponent = std::max(exponent, -126);
+        }
+        while (bbox.min[axis] + 255.0f * std::ldexp(1.0f, exponent) < bbox.max[axis])
+            ++exponent;
+        origin[axis] = bbox.min[axis];
+        this->exponent[axis] = (int8_t) exponent;
+        scale[axis] = std::ldexp(1.0f, exponent);
+    }
+
+    for (int i = 0; i < Width; ++i) {
+        const BoundingBox3f &child = childBBoxes[i];
+        if (!child.isValid()) {
+            /* Unused slot: an inverted box never intersects a ray */
+            for (int axis = 0; axis < 3; ++axis) {
+                bounds[2 * axis][i] = 255;
+                bounds[2 * axis + 1][i] = 0;
+            }
+            continue;
+        }
+
+        /* Round the bounds outwards so that the quantized box is conservative */
+        for (int axis = 0; axis < 3; ++axis) {
+            int lo = (int) std::floor((child.min[axis] - origin[axis]) / scale[axis]);
+            int hi = (int) std::ceil((child.max[axis] - origin[axis]) / scale[axis]);
+            lo = std::max(0, std::min(lo, 255));
+            hi = std::max(0, std::min(hi, 255));
+            while (lo > 0 && origin[axis] + lo * scale[axis] > child.min[axis])
+                --lo;
+            while (hi < 255 && origin[axis] + hi * scale[axis] < child.max[axis])
+                ++hi;
+            bounds[2 * axis][i] = (uint8_t) lo;
+            bounds[2 * axis + 1][i] = (uint8_t) hi;
+        }
+    }
+}
+
+template <int Width> void Accel::compress(uint32_t nodeIdx, uint32_t targetIdx,
+        std::vector<std::pair<uint32_t, uint32_t>> &leaves, uint32_t &leafCount) {
+    NodeVector<QuantizedBVHNode<Width>> &nodes = wideNodes<QuantizedBVHNode<Width>>();
+
+    uint32_t children[Width];
+    uint32_t childCount = collapseChildren<Width>(nodeIdx, children);
+
+    QuantizedBVHNode<Width> node;
+    BoundingBox3f childBBoxes[Width];
+
+    /* Allocate the inner children consecutively, and record the
+       leaf ranges in slot order (this may reallocate 'nodes') */
+    node.innerMask = 0;
+    node.childBase = (uint32_t) nodes.size();
+    node.leafBase = leafCount;
+
+    for (uint32_t i = 0; i < Width; ++i) {
+        node.size[i] = 0;
+        if (i >= childCount)
+            continue;
+
+        const BVHNode &child = m_nodes[children[i]];
+        childBBoxes[i] = child.bbox;
+        if (child.isInner()) {
+            node.innerMask |= (uint8_t) (1 << i);
+        } else {
+            if (child.leaf.size > 255)
+                throw NoriException("Accel: a leaf with %i entries cannot be "
+                                    "stored in a compressed node!", child.leaf.size);
+            node.size[i] = (uint8_t) child.leaf.size;
+            leaves.push_back(std::make_pair(child.start(), (uint32_t) child.leaf.size));
+            leafCount += child.leaf.size;
+        }
+    }
+    node.setBounds(m_nodes[nodeIdx].bbox, childBBoxes);
+
+    uint32_t innerCount = 0;
+    for (uint32_t i = 0; i < childCount; ++i)
+        innerCount += m_nodes[children[i]].isInner() ? 1 : 0;
+    nodes.resize(nodes.size() + innerCount);
+    nodes[targetIdx] = node;
+
+    /* Recurse into the inner children */
+    uint32_t childIdx = node.childBase;
+    for (uint32_t i = 0; i < childCount; ++i) {
+        if (m_nodes[children[i]].isInner())
+            compress<Width>(children[i], childIdx++, leaves, leafCount);
+    }
+}
+
+bool Accel::refit() {
+    if (m_indices.empty() && m_instanceNodes.empty())
+        return false;
+
+    /* Bottom-level hierarchies first, since they determine the instance bounds */
+    bool rebuilt = false;
+    for (const std::unique_ptr<Accel> &accel : m_meshAccels)
+        rebuilt |= accel->refit();
+
+    cout << "Refitting the BVH (" << m_meshes.size() << " meshes, " << getTriangleCount()
+         << " triangles, " << m_instances.size() << " instances) .. ";
+    cout.flush();
+    Timer timer;
+
+    m_bbox.reset();
+    for (const Mesh *mesh : m_meshes)
+        m_bbox.expandBy(mesh->getBoundingBox());
+    for (const Instance *instance : m_instances)
+        m_bbox.expandBy(instance->getBoundingBox());
+
+    /* Lazily built hierarchies are cheaper to discard than to refit */
+    bool refitTriangles = !m_indices.empty() && !m_lazyBuild;
+    float cost = 0.0f, instanceCost = 0.0f;
+    if (refitTriangles) {
+        if (m_packetWidth == 4)
+            refitPackets<4>();
+        else if (m_packetWidth == 8)
+            refitPackets<8>();
+        cost = updateBounds(true);
+    }
+    if (!m_instanceNodes.empty())
+        instanceCost = updateInstanceBounds(true);
+
+    bool rebuildTriangles = !m_indices.empty() && (m_lazyBuild || cost > m_rebuildThreshold * m_sahCost);
+    bool rebuildInstances = !m_instanceNodes.empty() &&
+        instanceCost > m_rebuildThreshold * m_instanceSahCost;
+
+    cout << "done. (";
+    if (refitTriangles || !m_instanceNodes.empty()) {
+        cout << "SAH cost ";
+        if (refitTriangles)
+            cout << cost << " vs. " << m_sahCost;
+        if (refitTriangles && !m_instanceNodes.empty())
+            cout << ", top-level ";
+        if (!m_instanceNodes.empty())
+            cout << instanceCost << " vs. " << m_instanceSahCost;
+        cout << " after the last build, ";
+    }
+    cout << "took " << timer.elapsedString() << ")" << endl;
+
+    if (rebuildTriangles) {
+        /* The refitted hierarchy degraded too much -- start over */
+        m_nodes.clear();
+        m_nodes4.clear();
+        m_nodes8.clear();
+        m_qnodes4.clear();
+        m_qnodes8.clear();
+        m_indices.clear();
+        m_packets4.clear();
+        m_packets8.clear();
+        m_pageCache.reset();
+        buildTriangles();
+    }
+
+    if (rebuildInstances) {
+        m_instanceNodes.clear();
+        m_instanceIndices.clear();
+        buildTopLevel();
+    }
+
+    return rebuilt || rebuildTriangles || rebuildInstances;
+}
+
+float Accel::updateBounds(bool store) {
+    SubtreeBounds result;
+    if (m_compressed) {
+        result = m_width == 4 ? refitCompressed<4>(0, store, 0)
+                              : refitCompressed<8>(0, store, 0);
+    } else if (m_width == 4) {
+        result = refitWide<4>(0, store, 0);
+    } else if (m_width == 8) {
+        result = refitWide<8>(0, store, 0);
+    } else {
+        result = refitBinary(m_nodes, 0,
+            [&](uint32_t start, uint32_t size) { return leafBounds(start, size); },
+            store, 0);
+    }
+    return result.cost / result.bbox.getSurfaceArea();
+}
+
+float Accel::updateInstanceBounds(bool store) {
+    SubtreeBounds result = refitBinary(m_instanceNodes, 0,
+        [&](uint32_t start, uint32_t size) {
+            BoundingBox3f bbox;
+            for (uint32_t i = start; i < start + size; ++i)
+                bbox.expandBy(getEntryBoundingBox(m_instanceIndices[i]));
+            return bbox;
+        }, store, 0);
+    return result.cost / result.bbox.getSurfaceArea();
+}
+
+BoundingBox3f Accel::leafBounds(uint32_t start, uint32_t size) const {
+    BoundingBox3f bbox;
+    if (m_packetWidth == 0) {
+        for (uint32_t i = start; i < start + size; ++i) {
+            uint32_t idx = m_indices[i];
+            const Mesh *mesh = m_meshes[findMesh(idx)];
+            bbox.expandBy(mesh->getBoundingBox(idx));
+        }
+        return bbox;
+    }
+
+    const TrianglePacket<4> *packets4 = m_packetWidth == 4 ? leafPackets<4>(start, start + size) : nullptr;
+    const TrianglePacket<8> *packets8 = m_packetWidth == 8 ? leafPackets<8>(start, start + size) : nullptr;
+    for (uint32_t i = 0; i < size; ++i) {
+        for (int k = 0; k < m_packetWidth; ++k) {
+            for (int v = 0; v < 3; ++v) {
+                Point3f p;
+                for (int axis = 0; axis < 3; ++axis)
+                    p[axis] = packets4 ? packets4[i].p[v][axis][k] : packets8[i].p[v][axis][k];
+                if (!std::isnan(p.x())) /* Skip padding lanes */
+                    bbox.expandBy(p);
+            }
+        }
+    }
+    return bbox;
+}
+
+template <typename LeafBounds> Accel::SubtreeBounds Accel::refitBinary(NodeVector<BVHNode> &nodes,
+        uint32_t nodeIdx, const LeafBounds &leafBounds, bool store, uint32_t depth) {
+    const BVHNode &node = nodes[nodeIdx];
+    SubtreeBounds result;
+
+    if (node.isLeaf()) {
+        result.bbox = leafBounds(node.start(), node.leaf.size);
+        result.cost = (BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * node.leaf.size) *
+            result.bbox.getSurfaceArea();
+    } else {
+        SubtreeBounds left, right;
+        uint32_t leftChild = node.inner.children, rightChild = node.inner.children + 1;
+        if (depth >= BVH_REFIT_TASK_DEPTH) {
+            left = refitBinary(nodes, leftChild, leafBounds, store, depth + 1);
+            right = refitBinary(nodes, rightChild, leafBounds, store, depth + 1);
+        } else {
+            tbb::parallel_invoke(
+                [&] { left = refitBinary(nodes, leftChild, leafBounds, store, depth + 1); },
+                [&] { right = refitBinary(nodes, rightChild, leafBounds, store, depth + 1); }
+            );
+        }
+        result.bbox = BoundingBox3f::merge(left.bbox, right.bbox);
+        result.cost = BVH_TRAVERSAL_COST * result.bbox.getSurfaceArea() + left.cost + right.cost;
+    }
+
+    if (store)
+        nodes[nodeIdx].bbox = result.bbox;
+    return result;
+}
+
+template <int Width> Accel::SubtreeBounds Accel::refitWide(uint32_t nodeIdx, bool store,
+                                                           uint32_t depth) {
+    NodeVector<WideBVHNode<Width>> &nodes = wideNodes<WideBVHNode<Width>>();
+    uint32_t childDepth = depth + (Width == 4 ? 2 : 3);
+    SubtreeBounds children[Width];
+
+    auto refitChild = [&](int i) {
+        uint32_t child, size;
+        nodes[nodeIdx].getChild(i, child, size);
+        if (child == (uint32_t) -1) {
+            /* Unused slot */
+        } else if (size == 0) {
+            children[i] = refitWide<Width>(child, store, childDepth);
+        } else {
+            children[i].bbox = leafBounds(child, size);
+            children[i].cost = BVH_INTERSECTION_COST * size * children[i].bbox.getSurfaceArea();
+        }
+    };
+
+    if (depth >= BVH_REFIT_TASK_DEPTH) {
+        for (int i = 0; i < Width; ++i)
+            refitChild(i);
+    } else {
+        tbb::parallel_for(0, Width, refitChild);
+    }
+
+    SubtreeBounds result;
+    WideBVHNode<Width> &node = nodes[nodeIdx];
+    for (int i = 0; i < Width; ++i) {
+        if (!children[i].bbox.isValid())
+            continue;
+        result.bbox.expandBy(children[i].bbox);
+        result.cost += children[i].cost;
+        if (store) {
+            for (int axis = 0; axis < 3; ++axis) {
+                node.bounds[2 * axis][i] = children[i].bbox.min[axis];
+                node.bounds[2 * axis + 1][i] = children[i].bbox.max[axis];
+            }
+        }
+    }
+    result.cost += BVH_TRAVERSAL_COST * result.bbox.getSurfaceArea();
+    return result;
+}
+
+template <int Width> Accel::SubtreeBounds Accel::refitCompressed(uint32_t nodeIdx, bool store,
+                                                                 uint32_t depth) {
+    NodeVector<QuantizedBVHNode<Width>> &nodes = wideNodes<QuantizedBVHNode<Width>>();
+    uint32_t childDepth = depth + (Width == 4 ? 2 : 3);
+    SubtreeBounds children[Width];
+
+    auto refitChild = [&](int i) {
+        const QuantizedBVHNode<Width> &node = nodes[nodeIdx];
+        uint32_t child, size;
+        node.getChild(i, child, size);
+        if (node.innerMask & (1 << i)) {
+            children[i] = refitCompressed<Width>(child, store, childDepth);
+        } else if (size > 0) {
+            children[i].bbox = leafBounds(child, size);
+            children[i].cost = BVH_INTERSECTION_COST * size * children[i].bbox.getSurfaceArea();
+        }
+    };
+
+    if (depth >= BVH_REFIT_TASK_DEPTH) {
+        for (int i = 0; i < Width; ++i)
+            refitChild(i);
+    } else {
+        tbb::parallel_for(0, Width, refitChild);
+    }
+
+    SubtreeBounds result;
+    BoundingBox3f childBBoxes[Width];
+    for (int i = 0; i < Width; ++i) {
+        childBBoxes[i] = children[i].bbox;
+        result.bbox.expandBy(children[i].bbox);
+        result.cost += children[i].cost;
+    }
+    result.cost += BVH_TRAVERSAL_COST * result.bbox.getSurfaceArea();
+
+    /* The quantization grid spans the node, hence all children are requantized */
+    if (store)
+        nodes[nodeIdx].setBounds(result.bbox, childBBoxes);
+    return result;
+}
+
+template <int Width> void Accel::refitPackets() {
+    auto refit = [&](TrianglePacket<Width> &packet) {
+        /* Padding lanes come last */
+        uint32_t size = 0;
+        while (size < (uint32_t) Width && !std::isnan(packet.p[0][0][size]))
+            ++size;
+        touchTriangles(packet.index, size);
+
+        for (uint32_t k = 0; k < size; ++k) {
+            uint32_t idx = packet.index[k];
+            const Mesh *mesh = m_meshes[findMesh(idx)];
+            MatrixXfMap V = mesh->getVertexPositionView();
+            MatrixXuMap F = mesh->getIndexView();
+            for (int v = 0; v < 3; ++v)
+                for (int axis = 0; axis < 3; ++axis)
+                    packet.p[v][axis][k] = V(axis, F(v, idx));
+        }
+    };
+
+    if (!m_pageCache) {
+        std::vector<TrianglePacket<Width>> &packets = trianglePackets<Width>();
+        tbb::parallel_for(tbb::blocked_range<size_t>(0u, packets.size(), 1024u),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    refit(packets[i]);
+            }
+        );
+        return;
+    }
+
+    /* Paged packets are refitted one page at a time: every chunk is read
+       through the page cache (which keeps the resident pages within the
+       budget), updated in a copy and written back to the file */
+    size_t count = m_pageCache->getSize() / sizeof(TrianglePacket<Width>);
+    size_t chunkSize = std::max(m_pageCache->getPageSize() / sizeof(TrianglePacket<Width>), (size_t) 1);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0u, count, chunkSize),
+        [&](const tbb::blocked_range<size_t> &range) {
+            const TrianglePacket<Width> *paged = leafPackets<Width>((uint32_t) range.begin(), (uint32_t) range.end());
+            std::vector<TrianglePacket<Width>> chunk(paged, paged + range.size());
+            for (TrianglePacket<Width> &packet : chunk)
+                refit(packet);
+            m_pageCache->write(sizeof(TrianglePacket<Width>) * range.begin(), chunk.data(),
+                               sizeof(TrianglePacket<Width>) * chunk.size());
+        }
+    );
+}
+
+uint32_t Accel::getNodeCount() const {
+    if (m_compressed)
+        return (uint32_t) (m_width == 4 ? m_qnodes4.size() : m_qnodes8.size());
+
+    switch (m_width) {
+        case 4:  return (uint32_t) m_nodes4.size();
+        case 8:  return (uint32_t) m_nodes8.size();
+        default: return m_lazyBuild ? m_lazyNodes.size() : (uint32_t) m_nodes.size();
+    }
+}
+
+/// Return the surface area of the intersection of two bounding boxes
+static float overlapArea(BoundingBox3f a, const BoundingBox3f &b) {
+    a.clip(b);
+    return a.isValid() ? a.getSurfaceArea() : 0.0f;
+}
+
+Accel::Statistics Accel::getStatistics() const {
+    Statistics stats;
+    if (m_indices.empty())
+        return stats;
+
+    BoundingBox3f bbox;
+    if (m_compressed) {
+        if (m_width == 4) {
+            bbox = wideStatistics<4, QBVH4Node>(0, 0, stats);
+            stats.nodeMemory = sizeof(QBVH4Node) * m_qnodes4.size();
+        } else {
+            bbox = wideStatistics<8, QBVH8Node>(0, 0, stats);
+            stats.nodeMemory = sizeof(QBVH8Node) * m_qnodes8.size();
+        }
+    } else if (m_width == 4) {
+        bbox = wideStatistics<4, BVH4Node>(0, 0, stats);
+        stats.nodeMemory = sizeof(BVH4Node) * m_nodes4.size();
+    } else if (m_width == 8) {
+        bbox = wideStatistics<8, BVH8Node>(0, 0, stats);
+        stats.nodeMemory = sizeof(BVH8Node) * m_nodes8.size();
+    } else {
+        bbox = m_lazyBuild ? m_lazyNodes[0].bbox : m_nodes[0].bbox;
+        binaryStatistics(0, 0, stats);
+        stats.nodeMemory = m_lazyBuild ? m_lazyNodes.memoryUsage() : sizeof(BVHNode) * m_nodes.size();
+    }
+
+    float area = bbox.getSurfaceArea();
+    stats.sahCost /= area;
+    stats.overlap /= area;
+    stats.leafMemory = leafMemory();
+    return stats;
+}
+
+void Accel::binaryStatistics(uint32_t nodeIdx, uint32_t depth, Statistics &stats) const {
+    auto getNode = [&](uint32_t idx) -> const BVHNode & { return m_lazyBuild ? m_lazyNodes[idx] : m_nodes[idx]; };
+    const BVHNode &node = getNode(nodeIdx);
+    float area = node.bbox.getSurfaceArea();
+
+    if (node.isLeaf()) {
+        stats.sahCost += (BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * node.leaf.size) * area;
+        stats.addLeaf(depth, leafTriangleCount(node.start(), node.leaf.size));
+        return;
+    }
+
+    uint32_t children = node.inner.children;
+    ++stats.innerNodes;
+    stats.sahCost += BVH_TRAVERSAL_COST * area;
+    stats.overlap += overlapArea(getNode(children).bbox, getNode(children + 1).bbox);
+    binaryStatistics(children, depth + 1, stats);
+    binaryStatistics(children + 1, depth + 1, stats);
+}
+
+template <int Width, typename Node> BoundingBox3f Accel::wideStatistics(uint32_t nodeIdx,
+        uint32_t depth, Statistics &stats) const {
+    /* The child bounds are recomputed, since compressed nodes only store conservative ones */
+    const Node &node = wideNodes<Node>()[nodeIdx];
+    BoundingBox3f bbox, childBBoxes[Width];
+    ++stats.innerNodes;
+
+    for (int i = 0; i < Width; ++i) {
+        if (node.isUnused(i))
+            continue;
+        uint32_t child, size;
+        node.getChild(i, child, size);
+        if (size == 0) {
+            childBBoxes[i] = wideStatistics<Width, Node>(child, depth + 1, stats);
+        } else {
+            childBBoxes[i] = leafBounds(child, size);
+            stats.sahCost += BVH_INTERSECTION_COST * size * childBBoxes[i].getSurfaceArea();
+            stats.addLeaf(depth + 1, leafTriangleCount(child, size));
+        }
+        bbox.expandBy(childBBoxes[i]);
+    }
+
+    for (int i = 0; i < Width; ++i)
+        for (int j = i + 1; j < Width; ++j)
+            stats.overlap += overlapArea(childBBoxes[i], childBBoxes[j]);
+    stats.sahCost += BVH_TRAVERSAL_COST * bbox.getSurfaceArea();
+    return bbox;
+}
+
+uint32_t Accel::leafTriangleCount(uint32_t start, uint32_t size) const {
+    if (m_packetWidth == 0)
+        return size;
+
+    const TrianglePacket<4> *packets4 = m_packetWidth == 4 ? leafPackets<4>(start, start + size) : nullptr;
+    const TrianglePacket<8> *packets8 = m_packetWidth == 8 ? leafPackets<8>(start, start + size) : nullptr;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+        for (int k = 0; k < m_packetWidth; ++k) {
+            float x = packets4 ? packets4[i].p[0][0][k] : packets8[i].p[0][0][k];
+            if (!std::isnan(x)) /* Skip padding lanes */
+                ++count;
+        }
+    }
+    return count;
+}
+
+size_t Accel::leafMemory() const {
+    return sizeof(uint32_t) * m_indices.size() +
+           sizeof(TrianglePacket<4>) * m_packets4.size() +
+           sizeof(TrianglePacket<8>) * m_packets8.size() +
+           (m_pageCache ? m_pageCache->getSize() : 0);
+}
+
+template <int Width>
+int Accel::TrianglePacket<Width>::intersect(const PacketRay &ray, float mint, float maxt, float *t,
+                                            float *u, float *v) const {
+    typedef SimdFloat<Width> FloatN;
+
+    const FloatN ox(ray.ox), oy(ray.oy), oz(ray.oz);
+    const FloatN Sx(ray.Sx), Sy(ray.Sy), Sz(ray.Sz);
+    const FloatN zero(0.0f), signMask(-0.0f);
+    const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+
+    /* Translate the vertices relative to the ray origin, then shear them */
+    const FloatN Az = FloatN::load(p[0][kz]) - oz;
+    const FloatN Bz = FloatN::load(p[1][kz]) - oz;
+    const FloatN Cz = FloatN::load(p[2][kz]) - oz;
+    const FloatN Ax = FloatN::load(p[0][kx]) - ox - Sx * Az;
+    const FloatN Ay = FloatN::load(p[0][ky]) - oy - Sy * Az;
+    const FloatN Bx = FloatN::load(p[1][kx]) - ox - Sx * Bz;
+    const FloatN By = FloatN::load(p[1][ky]) - oy - Sy * Bz;
+    const FloatN Cx = FloatN::load(p[2][kx]) - ox - Sx * Cz;
+    const FloatN Cy = FloatN::load(p[2][ky]) - oy - Sy * Cz;
+
+    /* Scaled barycentric coordinates (edge function values) */
+    const FloatN U = Cx * By - Cy * Bx;
+    const FloatN V = Ax * Cy - Ay * Cx;
+    const FloatN W = Bx * Ay - By * Ax;
+
+    FloatN mask = ((U >= zero) & (V >= zero) & (W >= zero)) |
+                  ((U <= zero) & (V <= zero) & (W <= zero));
+
+    /* Reject degenerate triangles (this includes unused lanes) */
+    const FloatN det = U + V + W;
+    mask = mask & ((det < zero) | (det > zero));
+
+    /* Compare the scaled hit distance against the ray segment */
+    const FloatN T = U * (Sz * Az) + V * (Sz * Bz) + W * (Sz * Cz);
+    const FloatN detSign = det & signMask;
+    const FloatN absDet = det ^ detSign, signedT = T ^ detSign;
+    mask = mask & (signedT >= FloatN(mint) * absDet)
+                & (signedT <= FloatN(maxt) * absDet);
+
+    int bits = mask.movemask();
+    if (bits != 0 && t) {
+        (T / det).store(t);
+        (V / det).store(u);
+        (W / det).store(v);
+    }
+
+    return bits;
+}
+
+template <int Width> bool Accel::intersectPackets(uint32_t start, uint32_t end, const PacketRay &pray,
+                                                  Ray3f &ray, Intersection &its, uint32_t &f,
+                                                  bool shadowRay) const {
+    const TrianglePacket<Width> *packets = leafPackets<Width>(start, end);
+    bool foundIntersection = false;
+
+    for (uint32_t i = 0; i < end - start; ++i) {
+        const TrianglePacket<Width> &packet = packets[i];
+        NORI_STATS(++TraversalStats::query.triangles);
+
+        float tValues[Width], uValues[Width], vValues[Width];
+        int bits = packet.intersect(pray, ray.mint, ray.maxt,
+                                    shadowRay ? nullptr : tValues, uValues, vValues);
+        if (bits == 0)
+            continue;
+
+        /* An intersection was found! Can terminate
+           immediately if this is a shadow ray query */
+        if (shadowRay)
+            return true;
+
+        /* Find the closest intersected triangle within the packet */
+        int best = -1;
+        for (int k = 0; k < Width; ++k) {
+            if ((bits & (1 << k)) && tValues[k] <= ray.maxt) {
+                ray.maxt = tValues[k];
+                best = k;
+            }
+        }
+        if (best == -1)
+            continue;
+
+        uint32_t idx = packet.index[best];
+        its.t = tValues[best];
+        its.bary = Point2f(uValues[best], vValues[best]);
+        its.mesh = m_meshes[findMesh(idx)];
+        f = idx;
+        foundIntersection = true;
+    }
+
+    return foundIntersection;
+}
+
+bool Accel::intersectLeaf(uint32_t start, uint32_t end, const PacketRay &pray, Ray3f &ray,
+                          Intersection &its, uint32_t &f, bool shadowRay) const {
+    if (m_packetWidth == 4)
+        return intersectPackets<4>(start, end, pray, ray, its, f, shadowRay);
+    else if (m_packetWidth == 8)
+        return intersectPackets<8>(start, end, pray, ray, its, f, shadowRay);
+
+    bool foundIntersection = false;
+
+    for (uint32_t i = start; i < end; ++i) {
+        uint32_t idx = m_indices[i];
+        const Mesh *mesh = m_meshes[findMesh(idx)];
+        NORI_STATS(++TraversalStats::query.triangles);
 
-    /* Brute force search through all triangles */
-    for (uint32_t idx = 0; idx < m_mesh->getTriangleCount(); ++idx) {
         float u, v, t;
-        if (m_mesh->rayIntersect(idx, ray, u, v, t)) {
+        if (mesh->rayIntersect(idx, ray, u, v, t)) {
             /* An intersection was found! Can terminate
                immediately if this is a shadow ray query */
             if (shadowRay)
                 return true;
             ray.maxt = its.t = t;
-            its.uv = Point2f(u, v);
-            its.mesh = m_mesh;
+            its.bary = Point2f(u, v);
+            its.mesh = mesh;
             f = idx;
             foundIntersection = true;
         }
     }
 
-    if (foundIntersection) {
-        /* At this point, we now know that there is an intersection,
-           and we know the triangle index of the closest such intersection.
-
-           The following computes a number of additional properties which
-           characterize the intersection (normals, texture coordinates, etc..)
-        */
-
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
+    return foundIntersection;
+}
+
+bool Accel::traverseBinary(const PacketRay &pray, Ray3f &ray, Intersection &its, uint32_t &f,
+                           bool shadowRay) const {
+    bool foundIntersection = false;
+
+    /* Closest-hit rays visit the child on their side of the split plane first:
+       a hit found there shortens the ray, which often lets it skip the other
+       child. Shadow rays keep the stored order (larger child first). */
+    const bool dirIsNeg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+
+    /* Traverse the BVH using a small stack of nodes that still need to be visited */
+    uint32_t stack[BVH_MAX_DEPTH + 1];
+    uint32_t stackIdx = 0, nodeIdx = 0;
+
+    BVHNode lazyNode; /* Copy of the current node (lazy construction) */
+    while (true) {
+        /* Nodes of lazily built hierarchies are copied using an atomic load,
+           since other threads may turn unbuilt leaves into inner nodes */
+        const BVHNode &node = m_lazyBuild ? m_lazyNodes.load(nodeIdx, lazyNode) : m_nodes[nodeIdx];
+        NORI_STATS(++TraversalStats::query.nodes);
+
+        if (node.bbox.rayIntersect(ray)) {
+            if (node.isInner()) {
+                uint32_t nearChild = node.inner.children, farChild = node.inner.children + 1;
+                if (!shadowRay && dirIsNeg[node.inner.axis] != (bool) node.inner.reversed)
+                    std::swap(nearChild, farChild);
+                stack[stackIdx++] = farChild;
+                nodeIdx = nearChild;
+                continue;
+            }
+
+            if (m_lazyBuild && node.leaf.unbuilt) {
+                /* Split the node (or wait for another thread to do so) and visit it again */
+                expandNode(nodeIdx);
+                continue;
+            }
+
+            if (intersectLeaf(node.start(), node.end(), pray, ray, its, f, shadowRay)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+        }
+
+        if (stackIdx == 0)
+            break;
+        nodeIdx = stack[--stackIdx];
+    }
+
+    return foundIntersection;
+}
+
+/**
+ * \brief Per-ray constants of the vectorized slab test
+ *
+ * Near and far planes of every axis are selected based on the sign of the
+ * ray direction. Tiny direction components are clamped, so that the
+ * reciprocals are finite (infinities could produce NaNs in the slab test).
+ */
+template <int Width> struct Accel::SlabRay {
+    typedef SimdFloat<Width> FloatN;
+
+    float o[3], rcp[3];
+    FloatN oN[3], rcpN[3];
+    int nearIdx[3], farIdx[3];
+    float mint;
+
+    SlabRay(const Ray3f &ray) : mint(ray.mint) {
+        for (int axis = 0; axis < 3; ++axis) {
+            float d = ray.d[axis];
+            if (std::abs(d) < 1e-20f)
+                d = std::copysign(1e-20f, d);
+            o[axis] = ray.o[axis];
+            rcp[axis] = 1.0f / d;
+            oN[axis] = FloatN(o[axis]);
+            rcpN[axis] = FloatN(rcp[axis]);
+            nearIdx[axis] = 2 * axis + (rcp[axis] < 0 ? 1 : 0);
+            farIdx[axis] = 2 * axis + (rcp[axis] < 0 ? 0 : 1);
+        }
+    }
+};
+
+template <int Width> int Accel::WideBVHNode<Width>::intersect(const SlabRay<Width> &ray,
+                                                             float maxt, float *tNear) const {
+    typedef SimdFloat<Width> FloatN;
+
+    FloatN tn(ray.mint), tf(maxt);
+    for (int axis = 0; axis < 3; ++axis) {
+        tn = FloatN::max(tn, (FloatN::load(bounds[ray.nearIdx[axis]]) - ray.oN[axis]) * ray.rcpN[axis]);
+        tf = FloatN::min(tf, (FloatN::load(bounds[ray.farIdx[axis]]) - ray.oN[axis]) * ray.rcpN[axis]);
+    }
+    tn.store(tNear);
+
+    return (tn <= tf).movemask();
+}
+
+template <int Width> int Accel::QuantizedBVHNode<Width>::intersect(const SlabRay<Width> &ray,
+                                                                  float maxt, float *tNear) const {
+    typedef SimdFloat<Width> FloatN;
+
+    /* The plane at grid coordinate q is intersected at
+       t = q * (scale * rcp) + (origin - o) * rcp */
+    FloatN tn(ray.mint), tf(maxt);
+    for (int axis = 0; axis < 3; ++axis) {
+        uint32_t scaleBits = (uint32_t) (exponent[axis] + 127) << 23;
+        float scale;
+        memcpy(&scale, &scaleBits, sizeof(float));
+        FloatN a(scale * ray.rcp[axis]), b((origin[axis] - ray.o[axis]) * ray.rcp[axis]);
+        tn = FloatN::max(tn, FloatN::loadBytes(bounds[ray.nearIdx[axis]]) * a + b);
+        tf = FloatN::min(tf, FloatN::loadBytes(bounds[ray.farIdx[axis]]) * a + b);
+    }
+    tn.store(tNear);
+
+    return (tn <= tf).movemask();
+}
+
+template <int Width, typename Node>
+bool Accel::traverseWide(const PacketRay &pray, Ray3f &ray, Intersection &its, uint32_t &f,
+                         bool shadowRay) const {
+    const NodeVector<Node> &nodes = wideNodes<Node>();
+    const SlabRay<Width> sray(ray);
+
+    bool foundIntersection = false;
+
+    /* Every stack entry refers to a child slot of a wide node,
+       which is either another wide node or a range of triangles */
+    struct StackEntry {
+        uint32_t child, size;
+        float t;
+    };
+    StackEntry stack[(Width - 1) * BVH_MAX_DEPTH + 1];
+    uint32_t stackIdx = 0;
+    stack[stackIdx++] = StackEntry { 0u, 0u, ray.mint };
+
+    while (stackIdx > 0) {
+        const StackEntry entry = stack[--stackIdx];
+        if (entry.t > ray.maxt)
+            continue;
+
+        if (entry.size > 0) {
+            if (intersectLeaf(entry.child, entry.child + entry.size, pray, ray, its, f, shadowRay)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+            continue;
+        }
+
+        /* Test the ray against the bounding boxes of all children at once */
+        const Node &node = nodes[entry.child];
+        NORI_STATS(++TraversalStats::query.nodes);
+        float tNearValues[Width];
+        int mask = node.intersect(sray, ray.maxt, tNearValues);
+        if (mask == 0)
+            continue;
+
+        /* Push the intersected children so that the closest one is visited first */
+        uint32_t first = stackIdx;
+        for (int i = 0; i < Width; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            StackEntry child;
+            node.getChild(i, child.child, child.size);
+            child.t = tNearValues[i];
+            uint32_t j = stackIdx++;
+            while (j > first && stack[j - 1].t < child.t) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = child;
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool Accel::traverseInstances(Ray3f &ray, Intersection &its, uint32_t &f,
+                              const Instance *&instance, bool shadowRay) const {
+    bool foundIntersection = false;
+
+    /* Front-to-back order for closest-hit rays (see \ref traverseBinary()) */
+    const bool dirIsNeg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+
+    uint32_t stack[BVH_MAX_DEPTH + 1];
+    uint32_t stackIdx = 0, nodeIdx = 0;
+
+    while (true) {
+        const BVHNode &node = m_instanceNodes[nodeIdx];
+        NORI_STATS(++TraversalStats::query.nodes);
+
+        if (node.bbox.rayIntersect(ray)) {
+            if (node.isInner()) {
+                uint32_t nearChild = node.inner.children, farChild = node.inner.children + 1;
+                if (!shadowRay && dirIsNeg[node.inner.axis] != (bool) node.inner.reversed)
+                    std::swap(nearChild, farChild);
+                stack[stackIdx++] = farChild;
+                nodeIdx = nearChild;
+                continue;
+            }
+
+            for (uint32_t i = node.start(); i < node.end(); ++i) {
+                uint32_t idx = m_instanceIndices[i];
+                const Instance *entry = idx < m_instances.size() ? m_instances[idx] : nullptr;
+
+                /* Transform the ray into object space (unless the entry is a
+                   mesh). Its direction is not normalized, hence distances
+                   along the ray remain valid */
+                Ray3f localRay = entry ? entry->getToObject() * ray : ray;
+
+                if (m_instanceAccel[idx]->traverseTriangles(localRay, its, f, shadowRay)) {
+                    if (shadowRay)
+                        return true;
+                    ray.maxt = localRay.maxt;
+                    instance = entry;
+                    foundIntersection = true;
+                }
+            }
+        }
+
+        if (stackIdx == 0)
+            break;
+        nodeIdx = stack[--stackIdx];
+    }
+
+    return foundIntersection;
+}
+
+bool Accel::traverseTriangles(Ray3f &ray, Intersection &its, uint32_t &f, bool shadowRay) const {
+    bool foundIntersection = false;
+    PacketRay pray(ray);
+
+    if (m_compressed) {
+        if (m_width == 4)
+            foundIntersection = traverseWide<4, QBVH4Node>(pray, ray, its, f, shadowRay);
+        else
+            foundIntersection = traverseWide<8, QBVH8Node>(pray, ray, its, f, shadowRay);
+    } else {
+        switch (m_width) {
+            case 4:  foundIntersection = traverseWide<4, BVH4Node>(pray, ray, its, f, shadowRay); break;
+            case 8:  foundIntersection = traverseWide<8, BVH8Node>(pray, ray, its, f, shadowRay); break;
+            default: foundIntersection = traverseBinary(pray, ray, its, f, shadowRay); break;
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool Accel::occludedLeaf(uint32_t start, uint32_t end, const PacketRay &pray, const Ray3f &ray,
+                         uint32_t &triangle) const {
+    if (m_packetWidth == 4 || m_packetWidth == 8) {
+        const TrianglePacket<4> *packets4 = m_packetWidth == 4 ? leafPackets<4>(start, end) : nullptr;
+        const TrianglePacket<8> *packets8 = m_packetWidth == 8 ? leafPackets<8>(start, end) : nullptr;
+        for (uint32_t i = 0; i < end - start; ++i) {
+            NORI_STATS(++TraversalStats::query.triangles);
+            int bits = packets4 ? packets4[i].intersect(pray, ray.mint, ray.maxt)
+                                : packets8[i].intersect(pray, ray.mint, ray.maxt);
+            if (bits != 0) {
+                int k = 0;
+                while (!(bits & (1 << k)))
+                    ++k;
+                triangle = packets4 ? packets4[i].index[k] : packets8[i].index[k];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    for (uint32_t i = start; i < end; ++i) {
+        if (occludedBy(ray, m_indices[i])) {
+            triangle = m_indices[i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Accel::occludedBy(const Ray3f &ray, uint32_t triangle) const {
+    uint32_t idx = triangle;
+    const Mesh *mesh = m_meshes[findMesh(idx)];
+    NORI_STATS(++TraversalStats::query.triangles);
+
+    if (m_packetWidth == 0) {
+        float u, v, t;
+        return mesh->rayIntersect(idx, ray, u, v, t);
+    }
+
+    /* Use the watertight test of the triangle packets, since the result must
+       not depend on which triangle the current thread happened to cache */
+    mesh->touch(idx);
+    MatrixXfMap V = mesh->getVertexPositionView();
+    MatrixXuMap F = mesh->getIndexView();
+    TrianglePacket<4> packet;
+    for (int k = 0; k < 4; ++k) {
+        for (int v = 0; v < 3; ++v)
+            for (int axis = 0; axis < 3; ++axis)
+                packet.p[v][axis][k] = k == 0 ? V(axis, F(v, idx))
+                                              : std::numeric_limits<float>::quiet_NaN();
+        packet.index[k] = triangle;
+    }
+    return packet.intersect(PacketRay(ray), ray.mint, ray.maxt) != 0;
+}
+
+bool Accel::occludedBinary(const PacketRay &pray, const Ray3f &ray, uint32_t &triangle) const {
+    uint32_t stack[BVH_MAX_DEPTH + 1];
+    uint32_t stackIdx = 0, nodeIdx = 0;
+
+    BVHNode lazyNode; /* Copy of the current node (lazy construction) */
+    while (true) {
+        const BVHNode &node = m_lazyBuild ? m_lazyNodes.load(nodeIdx, lazyNode) : m_nodes[nodeIdx];
+        NORI_STATS(++TraversalStats::query.nodes);
+
+        if (node.bbox.rayIntersect(ray)) {
+            if (node.isInner()) {
+                stack[stackIdx++] = node.inner.children + 1;
+                nodeIdx = node.inner.children;
+                continue;
+            }
+
+            if (m_lazyBuild && node.leaf.unbuilt) {
+                expandNode(nodeIdx);
+                continue;
+            }
+
+            if (occludedLeaf(node.start(), node.end(), pray, ray, triangle))
+                return true;
+        }
+
+        if (stackIdx == 0)
+            break;
+        nodeIdx = stack[--stackIdx];
+    }
+
+    return false;
+}
+
+template <int Width, typename Node>
+bool Accel::occludedWide(const PacketRay &pray, const Ray3f &ray, uint32_t &triangle) const {
+    const NodeVector<Node> &nodes = wideNodes<Node>();
+    const SlabRay<Width> sray(ray);
+
+    /* Same as traverseWide(), but the children are visited in
+       storage order -- any intersection terminates the traversal */
+    struct StackEntry {
+        uint32_t child, size;
+    };
+    StackEntry stack[(Width - 1) * BVH_MAX_DEPTH + 1];
+    uint32_t stackIdx = 0;
+    stack[stackIdx++] = StackEntry { 0u, 0u };
+
+    while (stackIdx > 0) {
+        const StackEntry entry = stack[--stackIdx];
+
+        if (entry.size > 0) {
+            if (occludedLeaf(entry.child, entry.child + entry.size, pray, ray, triangle))
+                return true;
+            continue;
+        }
+
+        NORI_STATS(++TraversalStats::query.nodes);
+        float tNearValues[Width];
+        int mask = nodes[entry.child].intersect(sray, ray.maxt, tNearValues);
+
+        for (int i = Width - 1; i >= 0; --i) {
+            if (!(mask & (1 << i)))
+                continue;
+            StackEntry &child = stack[stackIdx++];
+            nodes[entry.child].getChild(i, child.child, child.size);
+        }
+    }
+
+    return false;
+}
+
+bool Accel::occludedTriangles(const Ray3f &ray, uint32_t &triangle) const {
+    PacketRay pray(ray);
+
+    if (m_compressed)
+        return m_width == 4 ? occludedWide<4, QBVH4Node>(pray, ray, triangle)
+                            : occludedWide<8, QBVH8Node>(pray, ray, triangle);
+
+    switch (m_width) {
+        case 4:  return occludedWide<4, BVH4Node>(pray, ray, triangle);
+        case 8:  return occludedWide<8, BVH8Node>(pray, ray, triangle);
+        default: return occludedBinary(pray, ray, triangle);
+    }
+}
+
+bool Accel::occludedInstances(const Ray3f &ray, Occluder &occluder) const {
+    uint32_t stack[BVH_MAX_DEPTH + 1];
+    uint32_t stackIdx = 0, nodeIdx = 0;
+
+    while (true) {
+        const BVHNode &node = m_instanceNodes[nodeIdx];
+        NORI_STATS(++TraversalStats::query.nodes);
+
+        if (node.bbox.rayIntersect(ray)) {
+            if (node.isInner()) {
+                stack[stackIdx++] = node.inner.children + 1;
+                nodeIdx = node.inner.children;
+                continue;
+            }
+
+            for (uint32_t i = node.start(); i < node.end(); ++i) {
+                uint32_t idx = m_instanceIndices[i];
+                Ray3f localRay = idx < m_instances.size() ? m_instances[idx]->getToObject() * ray : ray;
+
+                if (m_instanceAccel[idx]->occludedTriangles(localRay, occluder.triangle)) {
+                    occluder.instance = idx;
+                    return true;
+                }
+            }
+        }
+
+        if (stackIdx == 0)
+            break;
+        nodeIdx = stack[--stackIdx];
+    }
+
+    return false;
+}
+
+bool Accel::rayOccluded(const Ray3f &ray) const {
+    if (m_indices.empty() && m_instanceAccel.empty())
+        return false;
+
+    NORI_STATS(TraversalStats::beginQuery());
+
+    /* Shadow rays traced by the same thread tend to be blocked by the
+       same triangle (e.g. when they connect nearby points to a light
+       source). Test the most recent occluder before traversing. */
+    Occluder &occluder = m_occluderCache.local();
+    bool occluded = false;
+    if (occluder.triangle != (uint32_t) -1) {
+        if (occluder.instance == (uint32_t) -1) {
+            occluded = occludedBy(ray, occluder.triangle);
         } else {
-            its.shFrame = its.geoFrame;
+            uint32_t idx = occluder.instance;
+            Ray3f localRay = idx < m_instances.size() ? m_instances[idx]->getToObject() * ray : ray;
+            occluded = m_instanceAccel[idx]->occludedBy(localRay, occluder.triangle);
         }
     }
 
+    if (!occluded && !m_indices.empty() && occludedTriangles(ray, occluder.triangle)) {
+        occluder.instance = (uint32_t) -1;
+        occluded = true;
+    }
+
+    if (!occluded && !m_instanceAccel.empty() && occludedInstances(ray, occluder))
+        occluded = true;
+
+    NORI_STATS(TraversalStats::endQuery(1, occluded ? 1 : 0));
+    return occluded;
+}
+
+bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
+    bool foundIntersection = false;     // Was an intersection found so far?
+    uint32_t f = (uint32_t) -1;         // Triangle index of the closest intersection
+    const Instance *instance = nullptr; // Instance of the closest intersection (if any)
+
+    if (shadowRay)
+        return rayOccluded(ray_);
+
+    if (m_indices.empty() && m_instanceAccel.empty())
+        return false;
+
+    NORI_STATS(TraversalStats::beginQuery());
+
+    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+
+    if (!m_indices.empty())
+        foundIntersection = traverseTriangles(ray, its, f, shadowRay);
+
+    if (!m_instanceAccel.empty() && !(shadowRay && foundIntersection)) {
+        if (traverseInstances(ray, its, f, instance, shadowRay))
+            foundIntersection = true;
+    }
+
+    NORI_STATS(TraversalStats::endQuery(1, foundIntersection ? 1 : 0));
+
+    if (shadowRay)
+        return foundIntersection;
+
+    if (foundIntersection) {
+        /* Record the hit -- the remaining information is
+           computed on demand by Intersection::finalize() */
+        its.f = f;
+        its.instance = instance;
+    }
+
     return foundIntersection;
 }
 
+std::string Accel::toString() const {
+    return tfm::format(
+        "Accel[\n"
+        "  type = \"bvh\",\n"
+        "  width = %i,\n"
+        "  packets = %s,\n"
+        "  compressed = %s,\n"
+        "  spatialSplits = %s,\n"
+        "  splitBudget = %f,\n"
+        "  buildQuality = \"%s\",\n"
+        "  lazyBuild = %s,\n"
+        "  meshHierarchies = %s,\n"
+        "  nodeLayout = \"%s\",\n"
+        "  pageBudget = %f,\n"
+        "  instances = %i\n"
+        "]",
+        m_width,
+        m_packetWidth > 0 ? "true" : "false",
+        m_compressed ? "true" : "false",
+        m_spatialSplits ? "true" : "false",
+        m_splitBudget,
+        m_fastBuild ? "fast" : "high",
+        m_lazyBuild ? "true" : "false",
+        m_meshHierarchies ? "true" : "false",
+        m_layout == EDepthFirst ? "depthfirst" : (m_layout == EHotChild ? "hotchild" : "treelet"),
+        m_pageBudget,
+        m_instances.size()
+    );
+}
+
+NORI_REGISTER_CLASS(Accel, "bvh");
 NORI_NAMESPACE_END
 
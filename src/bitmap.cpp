@@ -78,7 +78,7 @@ Bitmap::Bitmap(const std::string &filename) {
     file.readPixels(dw.min.y, dw.max.y);
 }
 
-void Bitmap::saveEXR(const std::string &filename) {
+void Bitmap::saveEXR(const std::string &filename, const std::map<std::string, Channel> &extra) {
     cout << "Writing a " << cols() << "x" << rows()
          << " OpenEXR file to \"" << filename << "\"" << endl;
 
@@ -102,6 +102,15 @@ void Bitmap::saveEXR(const std::string &filename) {
     frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
     frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
 
+    for (const auto &channel : extra) {
+        if (channel.second.rows() != rows() || channel.second.cols() != cols())
+            throw NoriException("Bitmap::saveEXR(): the size of the channel \"%s\" does not match the bitmap!",
+                                channel.first);
+        channels.insert(channel.first.c_str(), Imf::Channel(Imf::FLOAT));
+        frameBuffer.insert(channel.first.c_str(),
+            Imf::Slice(Imf::FLOAT, (char *) channel.second.data(), compStride, compStride * cols()));
+    }
+
     Imf::OutputFile file(path.c_str(), header);
     file.setFrameBuffer(frameBuffer);
     file.writePixels((int) rows());
@@ -0,0 +1,811 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvhbuilder.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Primitive index along with the Morton code of its centroid
+struct MortonPrimitive {
+    uint64_t code;
+    uint32_t index;
+};
+
+/**
+ * \brief Sort primitives by the lowest \c bits bits of their Morton codes
+ *
+ * Parallel LSD radix sort with 8-bit digits: every pass counts the digits
+ * of fixed-size blocks in parallel, computes the output offset of each
+ * block and digit, and then scatters the blocks in parallel. The sort is
+ * stable, so primitives with equal codes keep their order.
+ */
+static void radixSort(std::vector<MortonPrimitive> &data, int bits) {
+    uint32_t size = (uint32_t) data.size();
+    uint32_t blockCount = (size + BVH_RADIX_BLOCK_SIZE - 1) / BVH_RADIX_BLOCK_SIZE;
+    std::vector<MortonPrimitive> temp(size);
+    std::vector<uint32_t> offsets(256 * (size_t) blockCount);
+
+    for (int shift = 0; shift < bits; shift += 8) {
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, blockCount),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t block = range.begin(); block != range.end(); ++block) {
+                    uint32_t *count = &offsets[256 * (size_t) block];
+                    uint32_t end = std::min(size, (block + 1) * BVH_RADIX_BLOCK_SIZE);
+                    memset(count, 0, 256 * sizeof(uint32_t));
+                    for (uint32_t i = block * BVH_RADIX_BLOCK_SIZE; i < end; ++i)
+                        count[(data[i].code >> shift) & 0xFF]++;
+                }
+            }
+        );
+
+        uint32_t sum = 0;
+        for (uint32_t digit = 0; digit < 256; ++digit) {
+            for (uint32_t block = 0; block < blockCount; ++block) {
+                uint32_t &offset = offsets[256 * (size_t) block + digit];
+                uint32_t count = offset;
+                offset = sum;
+                sum += count;
+            }
+        }
+
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, blockCount),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t block = range.begin(); block != range.end(); ++block) {
+                    uint32_t *offset = &offsets[256 * (size_t) block];
+                    uint32_t end = std::min(size, (block + 1) * BVH_RADIX_BLOCK_SIZE);
+                    for (uint32_t i = block * BVH_RADIX_BLOCK_SIZE; i < end; ++i)
+                        temp[offset[(data[i].code >> shift) & 0xFF]++] = data[i];
+                }
+            }
+        );
+        data.swap(temp);
+    }
+}
+
+BVHBuilder::Split BVHBuilder::findBinSplit(const Bins &bins, const Bounds &bounds, uint32_t size,
+                                           uint32_t blockSize, int &bestBin) {
+    auto blocks = [blockSize](uint32_t count) { return (count + blockSize - 1) / blockSize; };
+
+    Split split;
+    bestBin = -1;
+    float invArea = 1.0f / bounds.bbox.getSurfaceArea();
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (!(bounds.centroidBBox.max[axis] > bounds.centroidBBox.min[axis]))
+            continue;
+
+        /* Sweep from the right to compute the costs of the right halves */
+        float rightCost[BVH_BIN_COUNT];
+        BoundingBox3f accum;
+        uint32_t count = 0;
+        for (int i = BVH_BIN_COUNT - 1; i > 0; --i) {
+            accum.expandBy(bins.bbox[axis][i]);
+            count += bins.count[axis][i];
+            rightCost[i] = count > 0 ? blocks(count) * accum.getSurfaceArea() : 0.0f;
+        }
+
+        /* Sweep from the left and combine */
+        accum.reset();
+        count = 0;
+        for (int i = 0; i < BVH_BIN_COUNT - 1; ++i) {
+            accum.expandBy(bins.bbox[axis][i]);
+            count += bins.count[axis][i];
+            if (count == 0 || count == size)
+                continue;
+            float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * invArea *
+                (blocks(count) * accum.getSurfaceArea() + rightCost[i + 1]);
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                bestBin = i;
+            }
+        }
+    }
+
+    if (split.axis == -1)
+        return split;
+
+    for (int i = 0; i < BVH_BIN_COUNT; ++i) {
+        Bounds &target = i <= bestBin ? split.left : split.right;
+        target.bbox.expandBy(bins.bbox[split.axis][i]);
+        target.centroidBBox.expandBy(bins.centroidBBox[split.axis][i]);
+    }
+
+    return split;
+}
+
+BVHBuilder::BVHBuilder(Accel &accel) : m_indices(accel.m_indices), m_output(accel.m_nodes),
+                                       m_layout(accel.m_layout), m_blockSize(std::max(accel.m_packetWidth, 1)) {
+    uint32_t size = accel.getTriangleCount();
+    m_bboxes.resize(size);
+    m_centroids.resize(size);
+    m_nodes.resize(2 * size - 1);
+
+    for (uint32_t meshIdx = 0; meshIdx < accel.m_meshes.size(); ++meshIdx) {
+        const Mesh *mesh = accel.m_meshes[meshIdx];
+        uint32_t offset = accel.m_meshOffset[meshIdx];
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, mesh->getTriangleCount(), 1024u),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    m_bboxes[offset + i] = mesh->getBoundingBox(i);
+                    m_centroids[offset + i] = mesh->getCentroid(i);
+                }
+            }
+        );
+    }
+}
+
+BVHBuilder::BVHBuilder(const std::vector<BoundingBox3f> &bboxes, std::vector<uint32_t> &indices,
+                       NodeVector<Accel::BVHNode> &output, Accel::ENodeLayout layout)
+    : m_indices(indices), m_output(output), m_layout(layout), m_bboxes(bboxes), m_blockSize(1) {
+    m_centroids.resize(bboxes.size());
+    m_nodes.resize(2 * bboxes.size() - 1);
+    for (size_t i = 0; i < bboxes.size(); ++i)
+        m_centroids[i] = bboxes[i].getCenter();
+}
+
+void BVHBuilder::build() {
+    uint32_t size = (uint32_t) m_indices.size();
+    build(0, 0, size, computeBounds(0, size), 0);
+
+    m_output.reserve(m_nodeCount + 1);
+    Accel::layoutNodes(m_nodes.data(), m_output, m_layout);
+}
+
+void BVHBuilder::buildLinear() {
+    uint32_t size = (uint32_t) m_indices.size();
+    sortMorton(computeBounds(0, size).centroidBBox);
+    buildLinear(0, 0, size, 0);
+    std::vector<uint64_t>().swap(m_codes);
+
+    m_output.reserve(m_nodeCount + 1);
+    Accel::layoutNodes(m_nodes.data(), m_output, m_layout);
+}
+
+BVHBuilder::Bounds BVHBuilder::computeBounds(uint32_t start, uint32_t end) const {
+    const uint32_t *indices = m_indices.data();
+
+    auto boundRange = [&](uint32_t start, uint32_t end, Bounds &bounds) {
+        for (uint32_t i = start; i != end; ++i) {
+            bounds.bbox.expandBy(m_bboxes[indices[i]]);
+            bounds.centroidBBox.expandBy(m_centroids[indices[i]]);
+        }
+    };
+
+    Bounds bounds;
+    if (end - start < BVH_PARALLEL_BIN_SIZE) {
+        boundRange(start, end, bounds);
+    } else {
+        bounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(start, end, BVH_PARALLEL_BIN_SIZE / 4), Bounds(),
+            [&](const tbb::blocked_range<uint32_t> &range, Bounds bounds) {
+                boundRange(range.begin(), range.end(), bounds);
+                return bounds;
+            },
+            [](Bounds a, const Bounds &b) { a.merge(b); return a; }
+        );
+    }
+    return bounds;
+}
+
+void BVHBuilder::computeBins(uint32_t start, uint32_t end, const BoundingBox3f &centroidBBox, Bins &bins) const {
+    const uint32_t *indices = m_indices.data();
+    Vector3f scale = binScale(centroidBBox);
+
+    auto binRange = [&](uint32_t start, uint32_t end, Bins &bins) {
+        for (uint32_t i = start; i != end; ++i) {
+            uint32_t idx = indices[i];
+            const Point3f &c = m_centroids[idx];
+            for (int axis = 0; axis < 3; ++axis) {
+                int bin = binIndex(c[axis], centroidBBox.min[axis], scale[axis]);
+                bins.bbox[axis][bin].expandBy(m_bboxes[idx]);
+                bins.centroidBBox[axis][bin].expandBy(c);
+                bins.count[axis][bin]++;
+            }
+        }
+    };
+
+    if (end - start < BVH_PARALLEL_BIN_SIZE) {
+        binRange(start, end, bins);
+    } else {
+        bins = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(start, end, BVH_PARALLEL_BIN_SIZE / 4), Bins(),
+            [&](const tbb::blocked_range<uint32_t> &range, Bins bins) {
+                binRange(range.begin(), range.end(), bins);
+                return bins;
+            },
+            [](Bins a, const Bins &b) { a.merge(b); return a; }
+        );
+    }
+}
+
+BVHBuilder::Split BVHBuilder::binnedSAH(uint32_t start, uint32_t end, const Bounds &bounds) {
+    uint32_t *indices = m_indices.data();
+
+    std::unique_ptr<Bins> bins(new Bins());
+    computeBins(start, end, bounds.centroidBBox, *bins);
+
+    int bestBin;
+    Split split = findBinSplit(*bins, bounds, end - start, m_blockSize, bestBin);
+    if (split.axis == -1)
+        return split;
+
+    int axis = split.axis;
+    float min = bounds.centroidBBox.min[axis];
+    float scale = binScale(bounds.centroidBBox)[axis];
+    split.mid = (uint32_t) (std::partition(indices + start, indices + end,
+        [&](uint32_t idx) {
+            return binIndex(m_centroids[idx][axis], min, scale) <= bestBin;
+        }) - indices);
+
+    return split;
+}
+
+BVHBuilder::Split BVHBuilder::sweepSAH(uint32_t start, uint32_t end, const Bounds &bounds) {
+    uint32_t *indices = m_indices.data();
+    uint32_t size = end - start;
+
+    Split split;
+    uint32_t bestPos = 0;
+    float invArea = 1.0f / bounds.bbox.getSurfaceArea();
+    float rightArea[BVH_SWEEP_SIZE];
+    int sortedAxis = -1;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (!(bounds.centroidBBox.max[axis] > bounds.centroidBBox.min[axis]))
+            continue;
+        sortAlongAxis(start, end, axis);
+        sortedAxis = axis;
+
+        BoundingBox3f accum;
+        for (uint32_t i = size - 1; i > 0; --i) {
+            accum.expandBy(m_bboxes[indices[start + i]]);
+            rightArea[i] = accum.getSurfaceArea();
+        }
+
+        accum.reset();
+        for (uint32_t i = 1; i < size; ++i) {
+            accum.expandBy(m_bboxes[indices[start + i - 1]]);
+            float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * invArea *
+                (blocks(i) * accum.getSurfaceArea() + blocks(size - i) * rightArea[i]);
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                bestPos = i;
+            }
+        }
+    }
+
+    if (split.axis == -1)
+        return split;
+
+    if (split.axis != sortedAxis)
+        sortAlongAxis(start, end, split.axis);
+
+    split.mid = start + bestPos;
+    split.left = computeBounds(start, split.mid);
+    split.right = computeBounds(split.mid, end);
+    return split;
+}
+
+void BVHBuilder::sortAlongAxis(uint32_t start, uint32_t end, int axis) {
+    uint32_t *indices = m_indices.data();
+    std::sort(indices + start, indices + end,
+        [&](uint32_t a, uint32_t b) {
+            float ca = m_centroids[a][axis], cb = m_centroids[b][axis];
+            return ca < cb || (ca == cb && a < b);
+        }
+    );
+}
+
+void BVHBuilder::build(uint32_t nodeIdx, uint32_t start, uint32_t end, const Bounds &bounds, uint32_t depth) {
+    uint32_t size = end - start;
+
+    Accel::BVHNode &node = m_nodes[nodeIdx];
+    node.bbox = bounds.bbox;
+
+    if (size == 1 || depth >= BVH_MAX_DEPTH)
+        return makeLeaf(node, start, size);
+
+    Split split = size <= BVH_SWEEP_SIZE ? sweepSAH(start, end, bounds)
+                                         : binnedSAH(start, end, bounds);
+
+    if (split.axis == -1) {
+        /* All centroids coincide -- there is nothing to be gained from SAH */
+        if (size <= BVH_MAX_LEAF_SIZE)
+            return makeLeaf(node, start, size);
+        split.mid = start + size / 2;
+        split.left = computeBounds(start, split.mid);
+        split.right = computeBounds(split.mid, end);
+    } else if (split.cost >= blocks(size) * BVH_INTERSECTION_COST && size <= BVH_MAX_LEAF_SIZE) {
+        return makeLeaf(node, start, size);
+    }
+
+    uint32_t mid = split.mid;
+    const Bounds &left = split.left, &right = split.right;
+
+    uint32_t leftChild = nodeIdx + 1, rightChild = nodeIdx + 2 * (mid - start);
+    node.inner.flag = 0;
+    node.inner.axis = (uint32_t) std::max(split.axis, 0);
+    node.inner.children = rightChild;
+    m_nodeCount++;
+
+    if (size < BVH_PARALLEL_TASK_SIZE) {
+        build(leftChild, start, mid, left, depth + 1);
+        build(rightChild, mid, end, right, depth + 1);
+    } else {
+        tbb::parallel_invoke(
+            [&] { build(leftChild, start, mid, left, depth + 1); },
+            [&] { build(rightChild, mid, end, right, depth + 1); }
+        );
+    }
+}
+
+void BVHBuilder::sortMorton(const BoundingBox3f &centroidBBox) {
+    uint32_t size = (uint32_t) m_indices.size();
+    int bits = size > BVH_MORTON_SIZE ? 21 : 10;
+    float scale = (float) ((1 << bits) - 1);
+    Vector3f invExtents = centroidBBox.getExtents().cwiseMax(
+        Vector3f::Constant(Epsilon)).cwiseInverse() * scale;
+
+    std::vector<MortonPrimitive> prims(size);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, size, 65536u),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                uint32_t idx = m_indices[i];
+                Vector3f p = (m_centroids[idx] - centroidBBox.min).cwiseProduct(invExtents)
+                    .cwiseMax(Vector3f::Zero()).cwiseMin(Vector3f::Constant(scale));
+                prims[i].code = (expandBits64((uint64_t) p.x()) << 2) |
+                                (expandBits64((uint64_t) p.y()) << 1) |
+                                 expandBits64((uint64_t) p.z());
+                prims[i].index = idx;
+            }
+        }
+    );
+
+    radixSort(prims, 3 * bits);
+
+    m_codes.resize(size);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, size, 65536u),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                m_indices[i] = prims[i].index;
+                m_codes[i] = prims[i].code;
+            }
+        }
+    );
+}
+
+BoundingBox3f BVHBuilder::buildLinear(uint32_t nodeIdx, uint32_t start, uint32_t end, uint32_t depth) {
+    uint32_t size = end - start;
+    Accel::BVHNode &node = m_nodes[nodeIdx];
+
+    if (size <= BVH_LINEAR_LEAF_SIZE || depth >= BVH_MAX_DEPTH) {
+        node.bbox.reset();
+        for (uint32_t i = start; i < end; ++i)
+            node.bbox.expandBy(m_bboxes[m_indices[i]]);
+        makeLeaf(node, start, size);
+        return node.bbox;
+    }
+
+    /* The codes of the range share a common prefix: split where the
+       next bit changes, or in the middle if all codes are equal */
+    uint64_t diff = m_codes[start] ^ m_codes[end - 1];
+    uint32_t mid = start + size / 2;
+    int axis = 0;
+    if (diff != 0) {
+        int bit = 63;
+        while (!((diff >> bit) & 1))
+            --bit;
+        mid = (uint32_t) (std::partition_point(m_codes.begin() + start, m_codes.begin() + end,
+            [bit](uint64_t code) { return ((code >> bit) & 1) == 0; }) - m_codes.begin());
+        axis = 2 - bit % 3;
+    }
+
+    uint32_t leftChild = nodeIdx + 1, rightChild = nodeIdx + 2 * (mid - start);
+    node.inner.flag = 0;
+    node.inner.axis = (uint32_t) axis;
+    node.inner.children = rightChild;
+    m_nodeCount++;
+
+    BoundingBox3f left, right;
+    if (size < BVH_PARALLEL_TASK_SIZE) {
+        left = buildLinear(leftChild, start, mid, depth + 1);
+        right = buildLinear(rightChild, mid, end, depth + 1);
+    } else {
+        tbb::parallel_invoke(
+            [&] { left = buildLinear(leftChild, start, mid, depth + 1); },
+            [&] { right = buildLinear(rightChild, mid, end, depth + 1); }
+        );
+    }
+
+    node.bbox = left;
+    node.bbox.expandBy(right);
+    return node.bbox;
+}
+
+void SpatialBVHBuilder::build() {
+    uint32_t size = m_accel.getTriangleCount();
+    std::vector<Reference> refs(size);
+    m_vertices.resize(3 * (size_t) size);
+
+    for (uint32_t meshIdx = 0; meshIdx < m_accel.m_meshes.size(); ++meshIdx) {
+        const Mesh *mesh = m_accel.m_meshes[meshIdx];
+        uint32_t offset = m_accel.m_meshOffset[meshIdx];
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, mesh->getTriangleCount(), 1024u),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                MatrixXfMap V = mesh->getVertexPositionView();
+                MatrixXuMap F = mesh->getIndexView();
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    refs[offset + i].idx = offset + i;
+                    refs[offset + i].bbox = mesh->getBoundingBox(i);
+                    for (int v = 0; v < 3; ++v)
+                        m_vertices[3 * (offset + i) + v] = V.col(F(v, i));
+                }
+            }
+        );
+    }
+
+    BoundingBox3f bbox;
+    for (const Reference &ref : refs)
+        bbox.expandBy(ref.bbox);
+    m_rootArea = bbox.getSurfaceArea();
+
+    Node root;
+    build(root, refs, bbox, 0);
+
+    std::vector<Accel::BVHNode> nodes;
+    nodes.reserve(m_nodeCount);
+    m_accel.m_indices.clear();
+    m_accel.m_indices.reserve(size + m_duplicates);
+    flatten(root, nodes);
+
+    m_accel.m_nodes.reserve(m_nodeCount + 1);
+    Accel::layoutNodes(nodes.data(), m_accel.m_nodes, m_accel.m_layout);
+}
+
+SpatialBVHBuilder::Split SpatialBVHBuilder::objectSplit(const std::vector<Reference> &refs,
+                                                        const BoundingBox3f &centroidBBox) const {
+    BoundingBox3f bbox[3][BVH_BIN_COUNT];
+    uint32_t count[3][BVH_BIN_COUNT];
+    memset(count, 0, sizeof(count));
+
+    Vector3f scale;
+    for (int axis = 0; axis < 3; ++axis) {
+        float extents = centroidBBox.max[axis] - centroidBBox.min[axis];
+        scale[axis] = extents > 0 ? BVH_BIN_COUNT / extents : 0.0f;
+    }
+
+    for (const Reference &ref : refs) {
+        Point3f c = ref.bbox.getCenter();
+        for (int axis = 0; axis < 3; ++axis) {
+            int bin = binIndex(c[axis], centroidBBox.min[axis], scale[axis]);
+            bbox[axis][bin].expandBy(ref.bbox);
+            count[axis][bin]++;
+        }
+    }
+
+    Split split;
+    uint32_t size = (uint32_t) refs.size();
+    for (int axis = 0; axis < 3; ++axis) {
+        if (scale[axis] == 0)
+            continue;
+
+        BoundingBox3f rightBBox[BVH_BIN_COUNT];
+        BoundingBox3f accum;
+        for (int i = BVH_BIN_COUNT - 1; i > 0; --i) {
+            accum.expandBy(bbox[axis][i]);
+            rightBBox[i] = accum;
+        }
+
+        accum.reset();
+        uint32_t n = 0;
+        for (int i = 0; i < BVH_BIN_COUNT - 1; ++i) {
+            accum.expandBy(bbox[axis][i]);
+            n += count[axis][i];
+            if (n == 0 || n == size)
+                continue;
+            float cost = blocks(n) * area(accum) + blocks(size - n) * area(rightBBox[i + 1]);
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.bin = i;
+                split.left = accum;
+                split.right = rightBBox[i + 1];
+                split.leftCount = n;
+                split.rightCount = size - n;
+            }
+        }
+    }
+    return split;
+}
+
+SpatialBVHBuilder::Split SpatialBVHBuilder::spatialSplit(const std::vector<Reference> &refs,
+                                                         const BoundingBox3f &nodeBBox) const {
+    Vector3f extents = nodeBBox.getExtents(), binSize = extents / (float) SBVH_BIN_COUNT,
+             invBinSize;
+    for (int axis = 0; axis < 3; ++axis)
+        invBinSize[axis] = extents[axis] > 0 ? 1.0f / binSize[axis] : 0.0f;
+
+    auto binRange = [&](size_t start, size_t end, SpatialBins &bins) {
+        for (size_t i = start; i != end; ++i) {
+            const Reference &ref = refs[i];
+            for (int axis = 0; axis < 3; ++axis) {
+                if (invBinSize[axis] == 0)
+                    continue;
+                float min = nodeBBox.min[axis];
+                int first = spatialBinIndex(ref.bbox.min[axis], min, invBinSize[axis]);
+                int last = spatialBinIndex(ref.bbox.max[axis], min, invBinSize[axis]);
+                first = std::min(first, last);
+
+                /* Chop the reference into pieces covering one bin each */
+                Reference piece = ref;
+                for (int bin = first; bin < last; ++bin) {
+                    BoundingBox3f left, right;
+                    splitReference(piece, axis, min + binSize[axis] * (bin + 1), left, right);
+                    bins.bbox[axis][bin].expandBy(left);
+                    piece.bbox = right;
+                }
+                bins.bbox[axis][last].expandBy(piece.bbox);
+                bins.enter[axis][first]++;
+                bins.exit[axis][last]++;
+            }
+        }
+    };
+
+    std::unique_ptr<SpatialBins> bins(new SpatialBins());
+    if (refs.size() < BVH_PARALLEL_BIN_SIZE) {
+        binRange(0, refs.size(), *bins);
+    } else {
+        *bins = tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, refs.size(), BVH_PARALLEL_BIN_SIZE / 4), SpatialBins(),
+            [&](const tbb::blocked_range<size_t> &range, SpatialBins bins) {
+                binRange(range.begin(), range.end(), bins);
+                return bins;
+            },
+            [](SpatialBins a, const SpatialBins &b) { a.merge(b); return a; }
+        );
+    }
+
+    Split split;
+    split.spatial = true;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (invBinSize[axis] == 0)
+            continue;
+
+        BoundingBox3f rightBBox[SBVH_BIN_COUNT];
+        uint32_t rightCount[SBVH_BIN_COUNT];
+        BoundingBox3f accum;
+        uint32_t n = 0;
+        for (int i = SBVH_BIN_COUNT - 1; i > 0; --i) {
+            accum.expandBy(bins->bbox[axis][i]);
+            n += bins->exit[axis][i];
+            rightBBox[i] = accum;
+            rightCount[i] = n;
+        }
+
+        accum.reset();
+        n = 0;
+        for (int i = 0; i < SBVH_BIN_COUNT - 1; ++i) {
+            accum.expandBy(bins->bbox[axis][i]);
+            n += bins->enter[axis][i];
+            if (n == 0 || rightCount[i + 1] == 0)
+                continue;
+            float cost = blocks(n) * area(accum) + blocks(rightCount[i + 1]) * area(rightBBox[i + 1]);
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.pos = nodeBBox.min[axis] + binSize[axis] * (i + 1);
+                split.left = accum;
+                split.right = rightBBox[i + 1];
+                split.leftCount = n;
+                split.rightCount = rightCount[i + 1];
+            }
+        }
+    }
+    return split;
+}
+
+uint32_t SpatialBVHBuilder::partitionSpatial(std::vector<Reference> &refs, Split &split,
+                                             std::vector<Reference> &leftRefs,
+                                             std::vector<Reference> &rightRefs) const {
+    int axis = split.axis;
+    float pos = split.pos;
+
+    /* Clear the bounds (and counts), which are accumulated again below */
+    BoundingBox3f leftBBox = split.left, rightBBox = split.right;
+    uint32_t leftCount = split.leftCount, rightCount = split.rightCount;
+    split.left.reset();
+    split.right.reset();
+
+    std::vector<const Reference *> straddling;
+    for (const Reference &ref : refs) {
+        if (ref.bbox.max[axis] <= pos) {
+            leftRefs.push_back(ref);
+            split.left.expandBy(ref.bbox);
+        } else if (ref.bbox.min[axis] >= pos) {
+            rightRefs.push_back(ref);
+            split.right.expandBy(ref.bbox);
+        } else {
+            straddling.push_back(&ref);
+        }
+    }
+
+    uint32_t duplicates = 0;
+    for (const Reference *ref : straddling) {
+        float splitCost = area(leftBBox) * leftCount + area(rightBBox) * rightCount;
+        BoundingBox3f leftUnsplit = BoundingBox3f::merge(leftBBox, ref->bbox);
+        BoundingBox3f rightUnsplit = BoundingBox3f::merge(rightBBox, ref->bbox);
+        float leftCost = area(leftUnsplit) * leftCount + area(rightBBox) * (rightCount - 1);
+        float rightCost = area(leftBBox) * (leftCount - 1) + area(rightUnsplit) * rightCount;
+
+        if (leftCost < splitCost && leftCost <= rightCost) {
+            leftRefs.push_back(*ref);
+            split.left.expandBy(ref->bbox);
+            leftBBox = leftUnsplit;
+            rightCount--;
+        } else if (rightCost < splitCost) {
+            rightRefs.push_back(*ref);
+            split.right.expandBy(ref->bbox);
+            rightBBox = rightUnsplit;
+            leftCount--;
+        } else {
+            Reference left { ref->idx, BoundingBox3f() }, right { ref->idx, BoundingBox3f() };
+            splitReference(*ref, axis, pos, left.bbox, right.bbox);
+            if (left.bbox.isValid()) {
+                leftRefs.push_back(left);
+                split.left.expandBy(left.bbox);
+            }
+            if (right.bbox.isValid()) {
+                rightRefs.push_back(right);
+                split.right.expandBy(right.bbox);
+            }
+            if (left.bbox.isValid() && right.bbox.isValid())
+                duplicates++;
+        }
+    }
+    return duplicates;
+}
+
+void SpatialBVHBuilder::build(Node &node, std::vector<Reference> &refs, const BoundingBox3f &bbox,
+                              uint32_t depth) {
+    uint32_t size = (uint32_t) refs.size();
+    node.bbox = bbox;
+    m_nodeCount++;
+
+    if (size == 1 || depth >= BVH_MAX_DEPTH)
+        return makeLeaf(node, refs);
+
+    BoundingBox3f centroidBBox;
+    for (const Reference &ref : refs)
+        centroidBBox.expandBy(ref.bbox.getCenter());
+
+    Split split = objectSplit(refs, centroidBBox);
+
+    /* Only look for a spatial split if the children of the object split
+       overlap significantly and the reference budget is not exhausted */
+    if (split.axis != -1 && m_duplicates < m_maxDuplicates) {
+        BoundingBox3f overlap = split.left;
+        overlap.clip(split.right);
+        if (area(overlap) > SBVH_OVERLAP_THRESHOLD * m_rootArea) {
+            Split spatial = spatialSplit(refs, bbox);
+            if (spatial.cost < split.cost)
+                split = spatial;
+        }
+    }
+
+    float invArea = 1.0f / bbox.getSurfaceArea();
+    float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * invArea * split.cost;
+    if (split.axis == -1 || !std::isfinite(cost)) {
+        /* All centroids coincide -- there is nothing to be gained from SAH */
+        if (size <= BVH_MAX_LEAF_SIZE)
+            return makeLeaf(node, refs);
+    } else if (cost >= blocks(size) * BVH_INTERSECTION_COST && size <= BVH_MAX_LEAF_SIZE) {
+        return makeLeaf(node, refs);
+    }
+
+    std::vector<Reference> leftRefs, rightRefs;
+    if (split.spatial) {
+        /* Reserve the duplicated references within the budget */
+        uint32_t expected = split.leftCount + split.rightCount - size;
+        if (m_duplicates.fetch_add(expected) + expected > m_maxDuplicates) {
+            m_duplicates -= expected;
+            split = objectSplit(refs, centroidBBox);
+        } else {
+            leftRefs.reserve(split.leftCount);
+            rightRefs.reserve(split.rightCount);
+            uint32_t duplicates = partitionSpatial(refs, split, leftRefs, rightRefs);
+            m_duplicates -= expected - duplicates;
+            if (leftRefs.empty() || rightRefs.empty()) {
+                /* Unsplitting moved all references into one child */
+                leftRefs.clear();
+                rightRefs.clear();
+                split = objectSplit(refs, centroidBBox);
+            }
+        }
+    }
+
+    if (!split.spatial || leftRefs.empty()) {
+        if (split.axis == -1) {
+            split.axis = 0;
+            split.left.reset();
+            split.right.reset();
+            for (uint32_t i = 0; i < size; ++i) {
+                (i < size / 2 ? leftRefs : rightRefs).push_back(refs[i]);
+                (i < size / 2 ? split.left : split.right).expandBy(refs[i].bbox);
+            }
+        } else {
+            int axis = split.axis;
+            float min = centroidBBox.min[axis],
+                  scale = BVH_BIN_COUNT / (centroidBBox.max[axis] - min);
+            leftRefs.reserve(split.leftCount);
+            rightRefs.reserve(split.rightCount);
+            for (const Reference &ref : refs) {
+                if (binIndex(ref.bbox.getCenter()[axis], min, scale) <= split.bin)
+                    leftRefs.push_back(ref);
+                else
+                    rightRefs.push_back(ref);
+            }
+        }
+    }
+
+    /* Release the memory of this node's references before recursing */
+    std::vector<Reference>().swap(refs);
+
+    node.axis = split.axis;
+    node.left.reset(new Node());
+    node.right.reset(new Node());
+    BoundingBox3f leftBBox = split.left, rightBBox = split.right;
+
+    if (size < BVH_PARALLEL_TASK_SIZE) {
+        build(*node.left, leftRefs, leftBBox, depth + 1);
+        build(*node.right, rightRefs, rightBBox, depth + 1);
+    } else {
+        tbb::parallel_invoke(
+            [&] { build(*node.left, leftRefs, leftBBox, depth + 1); },
+            [&] { build(*node.right, rightRefs, rightBBox, depth + 1); }
+        );
+    }
+}
+
+uint32_t SpatialBVHBuilder::flatten(const Node &node, std::vector<Accel::BVHNode> &nodes) {
+    std::vector<uint32_t> &indices = m_accel.m_indices;
+    uint32_t nodeIdx = (uint32_t) nodes.size();
+    nodes.emplace_back();
+    nodes[nodeIdx].bbox = node.bbox;
+
+    if (node.left) {
+        nodes[nodeIdx].inner.flag = 0;
+        nodes[nodeIdx].inner.axis = (uint32_t) node.axis;
+        flatten(*node.left, nodes);
+        uint32_t rightChild = flatten(*node.right, nodes);
+        nodes[nodeIdx].inner.children = rightChild;
+    } else {
+        nodes[nodeIdx].leaf.flag = 1;
+        nodes[nodeIdx].leaf.size = (uint32_t) node.indices.size();
+        nodes[nodeIdx].leaf.start = (uint32_t) indices.size();
+        indices.insert(indices.end(), node.indices.begin(), node.indices.end());
+    }
+    return nodeIdx;
+}
+
+NORI_NAMESPACE_END
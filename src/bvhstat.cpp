@@ -0,0 +1,381 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/timer.h>
+#include <nori/warp.h>
+#include <nori/stats.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_scheduler_init.h>
+#include <filesystem/resolver.h>
+#include <pcg32.h>
+#include <atomic>
+#include <functional>
+
+/*
+ * Builds the acceleration data structure of a scene with every available
+ * builder and compares the resulting hierarchies: SAH cost, depth and leaf
+ * size distributions, overlap of sibling nodes, memory usage, and build
+ * time. Optionally, a fixed set of random rays is traced through every
+ * hierarchy to measure the actual ray throughput.
+ *
+ * The lazily built BVH is analyzed after tracing the rays, i.e. only the
+ * nodes that the rays entered are split. When tracing rays, the binary SAH
+ * BVH is also built with every node layout to compare their throughput.
+ */
+
+using namespace nori;
+
+/// Configuration of one of the compared builders
+struct Builder {
+    std::string name;       ///< Column title
+    std::string className;  ///< Registered name of the \ref Accel subclass
+    PropertyList propList;  ///< Parameters of the builder
+};
+
+/// Results obtained for one of the builders
+struct Result {
+    Accel::Statistics stats;
+    uint32_t stackDepth = 0;
+    double buildTime = 0;   ///< In milliseconds
+    double raysPerSec = 0;
+    double hitRate = 0;
+    uint32_t packetMismatches = 0; ///< Rays whose packet and single-ray hits differ
+};
+
+/// Generate rays with origins inside the scene bounds and uniformly distributed directions
+static std::vector<Ray3f> generateRays(const BoundingBox3f &bbox, uint32_t count) {
+    std::vector<Ray3f> rays;
+    rays.reserve(count);
+    pcg32 rng;
+    for (uint32_t i = 0; i < count; ++i) {
+        Point3f o;
+        for (int axis = 0; axis < 3; ++axis)
+            o[axis] = bbox.min[axis] + rng.nextFloat() * (bbox.max[axis] - bbox.min[axis]);
+        Vector3f d = Warp::squareToUniformSphere(Point2f(rng.nextFloat(), rng.nextFloat()));
+        rays.push_back(Ray3f(o, d));
+    }
+    return rays;
+}
+
+/// Trace all rays in parallel and record the throughput and the fraction of hits
+static void traceRays(const Accel *accel, const std::vector<Ray3f> &rays, Result &result) {
+    std::atomic<uint32_t> hits { 0 };
+    Timer timer;
+    tbb::parallel_for(tbb::blocked_range<size_t>(0u, rays.size(), 1024u),
+        [&](const tbb::blocked_range<size_t> &range) {
+            uint32_t localHits = 0;
+            Intersection its;
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                if (accel->rayIntersect(rays[i], its, false))
+                    ++localHits;
+            }
+            hits += localHits;
+        }
+    );
+    double elapsed = std::max(timer.elapsed(), 1.0);
+    result.raysPerSec = rays.size() * 1000.0 / elapsed;
+    result.hitRate = (double) hits / rays.size();
+}
+
+/**
+ * \brief Tolerance for comparing packet and single-ray distances
+ *
+ * Hierarchies without triangle packets intersect packets using a vectorized
+ * Moeller-Trumbore test, which rounds differently than \ref Mesh::rayIntersect()
+ */
+#define BVHSTAT_T_EPSILON 1e-5f
+
+/// Check whether a packet hit matches the single-ray hit up to rounding
+static bool sameHit(const Intersection &single, const Intersection &packet) {
+    if (single.mesh != packet.mesh)
+        return false;
+    /* Adjacent triangles may both claim a hit on their shared edge, so a
+       different triangle is accepted when it ties up to rounding */
+    return std::abs(single.t - packet.t) <= BVHSTAT_T_EPSILON * std::max(single.t, 1.0f);
+}
+
+/// Trace all rays again in packets and count the rays whose hits differ from the single-ray queries
+static void checkPackets(const Accel *accel, const std::vector<Ray3f> &rays, Result &result) {
+    std::atomic<uint32_t> mismatches { 0 };
+    tbb::parallel_for(tbb::blocked_range<size_t>(0u, rays.size(), 1024u),
+        [&](const tbb::blocked_range<size_t> &range) {
+            uint32_t localMismatches = 0;
+            Intersection single, its[NORI_PACKET_SIZE];
+            for (size_t i = range.begin(); i < range.end(); i += NORI_PACKET_SIZE) {
+                uint32_t count = (uint32_t) std::min(range.end() - i, (size_t) NORI_PACKET_SIZE);
+                uint32_t hits = accel->rayIntersectPacket(&rays[i], count, its, false);
+                for (uint32_t j = 0; j < count; ++j) {
+                    bool hit = accel->rayIntersect(rays[i + j], single, false);
+                    if (hit != ((hits & (1u << j)) != 0) ||
+                        (hit && !sameHit(single, its[j])))
+                        ++localMismatches;
+                }
+            }
+            mismatches += localMismatches;
+        }
+    );
+    result.packetMismatches = mismatches;
+}
+
+/// Print one row of the comparison table
+static void printRow(const std::string &label, const std::vector<std::string> &values) {
+    cout << tfm::format("  %-22s", label);
+    for (const std::string &value : values)
+        cout << tfm::format(" %12s", value);
+    cout << endl;
+}
+
+/// Print a histogram (given as a function of the bin) with one column per builder, skipping empty rows
+template <typename Count>
+static void printHistogram(const std::string &title, const std::vector<std::string> &labels,
+                           const std::vector<Result> &results, const Count &count) {
+    cout << endl << title << endl;
+    for (size_t bin = 0; bin < labels.size(); ++bin) {
+        std::vector<std::string> values;
+        bool empty = true;
+        for (const Result &result : results) {
+            uint32_t n = count(result.stats, bin);
+            empty &= n == 0;
+            values.push_back(tfm::format("%.2f%%", 100.0 * n / std::max(result.stats.leaves, 1u)));
+        }
+        if (!empty)
+            printRow(labels[bin], values);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "Syntax: " << argv[0] << " [--threads N] [--width N] [--rays N] [--page-budget MiB] <scene.xml>" << endl;
+        return -1;
+    }
+
+    int threadCount = -1, width = 2, pageBudget = 0;
+    uint32_t rayCount = 0;
+    std::string sceneName = "";
+
+    for (int i = 1; i < argc; ++i) {
+        std::string token(argv[i]);
+        if (token == "-t" || token == "--threads" || token == "-w" || token == "--width" ||
+            token == "-r" || token == "--rays" || token == "-p" || token == "--page-budget") {
+            int value = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+            if (value <= 0) {
+                cerr << "\"" << token << "\" argument expects a positive integer following it." << endl;
+                return -1;
+            }
+            if (token == "-t" || token == "--threads")
+                threadCount = value;
+            else if (token == "-w" || token == "--width")
+                width = value; /* Applies to the BVH builders */
+            else if (token == "-p" || token == "--page-budget")
+                pageBudget = value; /* Page the leaf data of all builders */
+            else
+                rayCount = (uint32_t) value;
+            i++;
+            continue;
+        }
+
+        filesystem::path path(argv[i]);
+        if (path.extension() != "xml") {
+            cerr << "Fatal error: unknown file \"" << argv[i]
+                 << "\", expected an extension of type .xml" << endl;
+            return -1;
+        }
+        sceneName = argv[i];
+        getFileResolver()->prepend(path.parent_path());
+    }
+
+    if (sceneName == "") {
+        cerr << "Fatal error: no scene file was specified" << endl;
+        return -1;
+    }
+
+    tbb::task_scheduler_init init(threadCount < 0 ? tbb::task_scheduler_init::automatic : threadCount);
+
+    try {
+        std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+        if (root->getClassType() != NoriObject::EScene)
+            throw NoriException("The root object of \"%s\" is not a scene!", sceneName);
+        const Scene *scene = static_cast<const Scene *>(root.get());
+
+        std::vector<Builder> builders = {
+            { "sah", "bvh", PropertyList() },
+            { "sbvh", "bvh", PropertyList() },
+            { "lbvh", "bvh", PropertyList() },
+            { "lazy", "bvh", PropertyList() },
+            { "kdtree", "kdtree", PropertyList() }
+        };
+        builders[1].propList.setBoolean("spatialSplits", true);
+        builders[2].propList.setString("buildQuality", "fast");
+        builders[3].propList.setBoolean("lazyBuild", true); /* Binary and without packets */
+        for (int i = 0; i < 3; ++i)
+            builders[i].propList.setInteger("width", width);
+        if (pageBudget > 0) {
+            for (Builder &builder : builders) {
+                if (!builder.propList.getBoolean("lazyBuild", false))
+                    builder.propList.setFloat("pageBudget", (float) pageBudget);
+            }
+        }
+
+        std::vector<Ray3f> rays;
+        if (rayCount > 0)
+            rays = generateRays(scene->getAccel()->getBoundingBox(), rayCount);
+
+        std::vector<Result> results(builders.size());
+        for (size_t i = 0; i < builders.size(); ++i) {
+            cout << endl << "Analyzing the \"" << builders[i].name << "\" builder .." << endl;
+            std::unique_ptr<Accel> accel(static_cast<Accel *>(
+                NoriObjectFactory::createInstance(builders[i].className, builders[i].propList)));
+            for (Mesh *mesh : scene->getMeshes())
+                accel->addMesh(mesh);
+            for (Instance *instance : scene->getInstances())
+                accel->addInstance(instance);
+
+            Timer timer;
+            accel->build();
+            results[i].buildTime = timer.elapsed();
+
+            if (!rays.empty()) {
+                NORI_STATS(TraversalStats::reset());
+                traceRays(accel.get(), rays, results[i]);
+                NORI_STATS(cout << TraversalStats::summary());
+                if (accel->getPageCache())
+                    cout << "Leaf data: " << accel->getPageCache()->toString() << endl;
+                if (accel->getMeshPageCache())
+                    cout << "Meshes: " << accel->getMeshPageCache()->toString() << endl;
+                checkPackets(accel.get(), rays, results[i]);
+            }
+
+            results[i].stats = accel->getStatistics();
+            results[i].stackDepth = accel->getStackDepth();
+        }
+
+        cout << endl << "Statistics of the hierarchies over the triangles of \"" << sceneName
+             << "\" (" << scene->getAccel()->getTriangleCount() << " triangles, "
+             << scene->getInstances().size() << " instances):" << endl << endl;
+
+        std::vector<std::string> values;
+        auto row = [&](const std::string &label, const std::function<std::string(const Result &)> &f) {
+            values.clear();
+            for (const Result &result : results)
+                values.push_back(f(result));
+            printRow(label, values);
+        };
+
+        for (const Builder &builder : builders)
+            values.push_back(builder.name);
+        printRow("Builder", values);
+        row("Build time", [](const Result &r) { return timeString(r.buildTime, true); });
+        row("SAH cost", [](const Result &r) { return tfm::format("%.2f", r.stats.sahCost); });
+        row("Sibling overlap", [](const Result &r) { return tfm::format("%.3f", r.stats.overlap); });
+        row("Inner nodes", [](const Result &r) { return tfm::format("%i", r.stats.innerNodes); });
+        row("Leaves", [](const Result &r) { return tfm::format("%i", r.stats.leaves); });
+        row("Triangle references", [](const Result &r) { return tfm::format("%i", r.stats.references); });
+        row("Avg. leaf size", [](const Result &r) {
+            return tfm::format("%.2f", (double) r.stats.references / std::max(r.stats.leaves, 1u));
+        });
+        row("Avg. leaf depth", [](const Result &r) {
+            uint64_t sum = 0;
+            for (size_t depth = 0; depth < r.stats.leafDepth.size(); ++depth)
+                sum += depth * r.stats.leafDepth[depth];
+            return tfm::format("%.2f", (double) sum / std::max(r.stats.leaves, 1u));
+        });
+        row("Stack depth", [](const Result &r) { return tfm::format("%i", r.stackDepth); });
+        row("Node memory", [](const Result &r) { return memString(r.stats.nodeMemory); });
+        row("Leaf memory", [](const Result &r) { return memString(r.stats.leafMemory); });
+        if (!rays.empty()) {
+            row("Rays/sec", [](const Result &r) { return tfm::format("%.2fM", r.raysPerSec * 1e-6); });
+            row("Hit rate", [](const Result &r) { return tfm::format("%.1f%%", 100 * r.hitRate); });
+            row("Packet mismatches", [](const Result &r) { return tfm::format("%i", r.packetMismatches); });
+        }
+
+        /* Depths are grouped in bins of 4 levels, leaf sizes beyond 16 share a bin */
+        std::vector<std::string> labels;
+        for (uint32_t depth = 0; depth < 64; depth += 4)
+            labels.push_back(tfm::format("%i-%i", depth, depth + 3));
+        labels.push_back("64+");
+        printHistogram("Leaf depth distribution:", labels, results,
+            [&](const Accel::Statistics &stats, size_t bin) {
+                uint32_t n = 0;
+                for (size_t depth = 4 * bin; depth < stats.leafDepth.size(); ++depth) {
+                    if (bin + 1 < labels.size() && depth >= 4 * bin + 4)
+                        break;
+                    n += stats.leafDepth[depth];
+                }
+                return n;
+            });
+
+        labels.clear();
+        for (uint32_t size = 0; size <= 16; ++size)
+            labels.push_back(tfm::format("%i", size));
+        labels.push_back("17+");
+        printHistogram("Leaf size distribution (triangles):", labels, results,
+            [&](const Accel::Statistics &stats, size_t bin) {
+                uint32_t n = 0;
+                for (size_t size = bin; size < stats.leafSize.size(); ++size) {
+                    if (bin + 1 < labels.size() && size > bin)
+                        break;
+                    n += stats.leafSize[size];
+                }
+                return n;
+            });
+
+        if (!rays.empty()) {
+            /* The layouts apply to the binary nodes, and differ by a few percent
+               at most, hence the best of several passes is reported */
+            const char *layouts[] = { "depthfirst", "hotchild", "treelet" };
+            const int passes = 3;
+            std::vector<Result> layoutResults(3);
+            for (int i = 0; i < 3; ++i) {
+                cout << endl << "Analyzing the \"" << layouts[i] << "\" node layout .." << endl;
+                PropertyList propList;
+                propList.setString("nodeLayout", layouts[i]);
+                if (pageBudget > 0)
+                    propList.setFloat("pageBudget", (float) pageBudget);
+                std::unique_ptr<Accel> accel(static_cast<Accel *>(
+                    NoriObjectFactory::createInstance("bvh", propList)));
+                for (Mesh *mesh : scene->getMeshes())
+                    accel->addMesh(mesh);
+                for (Instance *instance : scene->getInstances())
+                    accel->addInstance(instance);
+                accel->build();
+
+                for (int pass = 0; pass < passes; ++pass) {
+                    Result result;
+                    traceRays(accel.get(), rays, result);
+                    layoutResults[i].raysPerSec = std::max(layoutResults[i].raysPerSec, result.raysPerSec);
+                }
+            }
+
+            cout << endl << "Throughput of the binary SAH BVH per node layout (best of "
+                 << passes << " passes):" << endl << endl;
+            printRow("Node layout", std::vector<std::string>(layouts, layouts + 3));
+            values.clear();
+            for (const Result &result : layoutResults)
+                values.push_back(tfm::format("%.2fM", result.raysPerSec * 1e-6));
+            printRow("Rays/sec", values);
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
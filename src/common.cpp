@@ -28,6 +28,11 @@
 
 #if defined(PLATFORM_WINDOWS)
 #include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 #if defined(PLATFORM_MACOS)
@@ -170,6 +175,53 @@ std::string memString(size_t size, bool precise) {
     return os.str();
 }
 
+const uint8_t *mapFile(const std::string &filename, size_t &size) {
+#if defined(PLATFORM_WINDOWS)
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        CloseHandle(file);
+        return nullptr;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping)
+        return nullptr;
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data)
+        return nullptr;
+    size = (size_t) fileSize.QuadPart;
+    return (const uint8_t *) data;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void *data = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+    size = (size_t) st.st_size;
+    return (const uint8_t *) data;
+#endif
+}
+
+void unmapFile(const uint8_t *data, size_t size) {
+#if defined(PLATFORM_WINDOWS)
+    UnmapViewOfFile(data);
+#else
+    munmap((void *) data, size);
+#endif
+}
+
 filesystem::resolver *getFileResolver() {
     static filesystem::resolver *resolver = new filesystem::resolver();
     return resolver;
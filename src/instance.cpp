@@ -0,0 +1,74 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/instance.h>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &propList) {
+    m_toWorld = propList.getTransform("toWorld", Transform());
+    m_toObject = m_toWorld.inverse();
+}
+
+void Instance::setToWorld(const Transform &toWorld) {
+    m_toWorld = toWorld;
+    m_toObject = toWorld.inverse();
+}
+
+BoundingBox3f Instance::getBoundingBox() const {
+    const BoundingBox3f &bbox = m_mesh->getBoundingBox();
+    BoundingBox3f result;
+    for (int i = 0; i < 8; ++i)
+        result.expandBy(m_toWorld * bbox.getCorner(i));
+    return result;
+}
+
+void Instance::addChild(NoriObject *obj) {
+    switch (obj->getClassType()) {
+        case EMesh:
+            if (m_mesh)
+                throw NoriException("Instance: tried to register multiple meshes!");
+            m_mesh = static_cast<Mesh *>(obj);
+            break;
+
+        default:
+            throw NoriException("Instance::addChild(<%s>) is not supported!",
+                                classTypeName(obj->getClassType()));
+    }
+}
+
+void Instance::activate() {
+    if (!m_mesh)
+        throw NoriException("Instance: no mesh was specified!");
+    if (m_mesh->isEmitter())
+        throw NoriException("Instance: instanced meshes cannot be emitters!");
+}
+
+std::string Instance::toString() const {
+    return tfm::format(
+        "Instance[\n"
+        "  mesh = \"%s\",\n"
+        "  toWorld = %s\n"
+        "]",
+        m_mesh ? m_mesh->getName() : std::string("null"),
+        indent(m_toWorld.toString(), 12)
+    );
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
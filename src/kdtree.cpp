@@ -0,0 +1,661 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/kdtree.h>
+#include <nori/instance.h>
+#include <nori/snapshot.h>
+#include <nori/stats.h>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#include <atomic>
+
+NORI_NAMESPACE_BEGIN
+
+/* Parameters of the SAH-based kd-tree construction */
+#define KD_TRAVERSAL_COST     1.0f   /* Relative cost of a node traversal */
+#define KD_INTERSECTION_COST  2.0f   /* Relative cost of a triangle (packet) test */
+#define KD_EMPTY_BONUS        0.2f   /* Cost reduction of splits that cut off empty space */
+#define KD_MAX_DEPTH          64     /* Bounds the size of the traversal stack */
+#define KD_MAX_BAD_REFINES    3      /* Splits that do not pay off before a leaf is created */
+#define KD_BIN_COUNT          32     /* Number of bins per axis */
+#define KD_SWEEP_SIZE         256    /* Nodes up to this size use an exact SAH sweep */
+#define KD_PARALLEL_TASK_SIZE 4096   /* Subtrees below this size are built serially */
+#define KD_PARALLEL_BIN_SIZE  65536  /* Nodes above this size are binned in parallel */
+
+/**
+ * \brief Builds the kd-tree of a \ref KDTree
+ *
+ * Every node records the (clipped) bounds of the triangles that overlap
+ * it. Candidate split planes are evaluated using the SAH: large nodes
+ * count the triangle bounds in bins along each axis, while small nodes
+ * sort them and sweep over all of their boundaries. Triangles lying in
+ * the split plane are assigned to the child below it. Since the size of
+ * the subtrees is not known in advance, the finished tree is flattened
+ * into \ref KDTree::m_kdNodes and \ref Accel::m_indices in depth-first order.
+ */
+class KDTreeBuilder {
+public:
+    /// (Possibly clipped) reference to a triangle
+    struct Reference {
+        uint32_t idx;
+        BoundingBox3f bbox;
+    };
+
+    /// Node of the temporary tree
+    struct Node {
+        int axis = -1;                 ///< Split axis (-1 for leaves)
+        float split = 0.0f;            ///< Position of the split plane (inner nodes)
+        std::unique_ptr<Node> below;   ///< Child below the split plane (inner nodes)
+        std::unique_ptr<Node> above;   ///< Child above the split plane (inner nodes)
+        std::vector<uint32_t> indices; ///< Referenced triangles (leaves)
+    };
+
+    /// Per-axis bins that count the lower and upper bounds of the references
+    struct Bins {
+        uint32_t lower[3][KD_BIN_COUNT];
+        uint32_t upper[3][KD_BIN_COUNT];
+
+        Bins() {
+            memset(lower, 0, sizeof(lower));
+            memset(upper, 0, sizeof(upper));
+        }
+
+        void merge(const Bins &bins) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int i = 0; i < KD_BIN_COUNT; ++i) {
+                    lower[axis][i] += bins.lower[axis][i];
+                    upper[axis][i] += bins.upper[axis][i];
+                }
+            }
+        }
+    };
+
+    /// Candidate split plane
+    struct Split {
+        int axis = -1;
+        float pos = 0.0f;
+        float cost = std::numeric_limits<float>::infinity();
+    };
+
+    /// Boundary of a reference along the sweep axis (ordered by position, then type)
+    struct Event {
+        enum EType { EEnd = 0, EPlanar = 1, EStart = 2 };
+        float pos;
+        int type;
+
+        bool operator<(const Event &event) const {
+            return pos < event.pos || (pos == event.pos && type < event.type);
+        }
+    };
+
+    /// Prepare the construction of a kd-tree over the triangles of all meshes registered with \c tree
+    KDTreeBuilder(KDTree &tree) : m_tree(tree), m_blockSize(std::max(tree.m_packetWidth, 1)) {
+        uint32_t size = tree.getTriangleCount();
+        m_maxDepth = std::min((uint32_t) (8 + 1.3f * std::log2((float) std::max(size, 1u))),
+                              (uint32_t) KD_MAX_DEPTH);
+    }
+
+    /// Build the full tree and store it in depth-first order
+    void build() {
+        uint32_t size = m_tree.getTriangleCount();
+        std::vector<Reference> refs(size);
+        m_vertices.resize(3 * (size_t) size);
+
+        for (uint32_t meshIdx = 0; meshIdx < m_tree.m_meshes.size(); ++meshIdx) {
+            const Mesh *mesh = m_tree.m_meshes[meshIdx];
+            uint32_t offset = m_tree.m_meshOffset[meshIdx];
+            tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, mesh->getTriangleCount(), 1024u),
+                [&](const tbb::blocked_range<uint32_t> &range) {
+                    MatrixXfMap V = mesh->getVertexPositionView();
+                    MatrixXuMap F = mesh->getIndexView();
+                    for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                        refs[offset + i].idx = offset + i;
+                        refs[offset + i].bbox = mesh->getBoundingBox(i);
+                        for (int v = 0; v < 3; ++v)
+                            m_vertices[3 * (offset + i) + v] = V.col(F(v, i));
+                    }
+                }
+            );
+        }
+
+        /* Triangles with invalid (e.g. NaN) vertices can never be hit */
+        refs.erase(std::remove_if(refs.begin(), refs.end(),
+            [](const Reference &ref) { return !ref.bbox.isValid(); }), refs.end());
+
+        BoundingBox3f bbox;
+        for (const Reference &ref : refs)
+            bbox.expandBy(ref.bbox);
+        m_tree.m_kdBBox = bbox;
+
+        Node root;
+        build(root, refs, bbox, 0, 0);
+
+        m_tree.m_kdNodes.clear();
+        m_tree.m_kdNodes.reserve(m_nodeCount + 1);
+        m_tree.m_indices.clear();
+        m_tree.m_indices.reserve(m_referenceCount);
+        flatten(root);
+    }
+
+protected:
+    /// Number of triangle packets needed to store the given number of triangles
+    uint32_t blocks(uint32_t count) const {
+        return (count + m_blockSize - 1) / m_blockSize;
+    }
+
+    /// Evaluate the SAH cost of splitting \c voxel at <tt>p[axis] == pos</tt>
+    float cost(const BoundingBox3f &voxel, float invArea, int axis, float pos,
+               uint32_t belowCount, uint32_t aboveCount) const {
+        Vector3f d = voxel.getExtents();
+        int axis1 = (axis + 1) % 3, axis2 = (axis + 2) % 3;
+        float faceArea = d[axis1] * d[axis2], perimeter = d[axis1] + d[axis2];
+        float belowArea = 2 * (faceArea + (pos - voxel.min[axis]) * perimeter);
+        float aboveArea = 2 * (faceArea + (voxel.max[axis] - pos) * perimeter);
+
+        float cost = KD_TRAVERSAL_COST + KD_INTERSECTION_COST * invArea *
+            (belowArea * blocks(belowCount) + aboveArea * blocks(aboveCount));
+        if (belowCount == 0 || aboveCount == 0)
+            cost *= 1.0f - KD_EMPTY_BONUS;
+        return cost;
+    }
+
+    /// Find the best split plane by counting the reference bounds in bins
+    Split binnedSplit(const std::vector<Reference> &refs, const BoundingBox3f &voxel) const {
+        Vector3f extents = voxel.getExtents(), scale;
+        for (int axis = 0; axis < 3; ++axis)
+            scale[axis] = extents[axis] > 0 ? KD_BIN_COUNT / extents[axis] : 0.0f;
+
+        auto binRange = [&](uint32_t start, uint32_t end, Bins &bins) {
+            for (uint32_t i = start; i < end; ++i) {
+                const BoundingBox3f &bbox = refs[i].bbox;
+                for (int axis = 0; axis < 3; ++axis) {
+                    bins.lower[axis][binIndex(bbox.min[axis], voxel.min[axis], scale[axis])]++;
+                    bins.upper[axis][binIndex(bbox.max[axis], voxel.min[axis], scale[axis])]++;
+                }
+            }
+        };
+
+        uint32_t size = (uint32_t) refs.size();
+        Bins bins;
+        if (size < KD_PARALLEL_BIN_SIZE) {
+            binRange(0, size, bins);
+        } else {
+            bins = tbb::parallel_reduce(
+                tbb::blocked_range<uint32_t>(0u, size, KD_PARALLEL_BIN_SIZE / 4), Bins(),
+                [&](const tbb::blocked_range<uint32_t> &range, Bins bins) {
+                    binRange(range.begin(), range.end(), bins);
+                    return bins;
+                },
+                [](Bins a, const Bins &b) { a.merge(b); return a; }
+            );
+        }
+
+        /* References that start in a bin below the plane overlap the child
+           below it, and those that end in a bin above it overlap the other one */
+        Split best;
+        float invArea = 1.0f / voxel.getSurfaceArea();
+        for (int axis = 0; axis < 3; ++axis) {
+            if (scale[axis] == 0)
+                continue;
+            uint32_t belowCount = 0, aboveCount = size;
+            for (int i = 1; i < KD_BIN_COUNT; ++i) {
+                belowCount += bins.lower[axis][i - 1];
+                aboveCount -= bins.upper[axis][i - 1];
+                float pos = voxel.min[axis] + i / scale[axis];
+                float splitCost = cost(voxel, invArea, axis, pos, belowCount, aboveCount);
+                if (splitCost < best.cost) {
+                    best.axis = axis;
+                    best.pos = pos;
+                    best.cost = splitCost;
+                }
+            }
+        }
+        return best;
+    }
+
+    /// Find the best split plane by sweeping over the sorted reference bounds
+    Split sweepSplit(const std::vector<Reference> &refs, const BoundingBox3f &voxel) const {
+        uint32_t size = (uint32_t) refs.size();
+        std::vector<Event> events;
+        events.reserve(2 * size);
+
+        Split best;
+        float invArea = 1.0f / voxel.getSurfaceArea();
+        for (int axis = 0; axis < 3; ++axis) {
+            if (voxel.max[axis] <= voxel.min[axis])
+                continue;
+
+            events.clear();
+            for (const Reference &ref : refs) {
+                float min = ref.bbox.min[axis], max = ref.bbox.max[axis];
+                if (min == max) {
+                    events.push_back(Event { min, Event::EPlanar });
+                } else {
+                    events.push_back(Event { min, Event::EStart });
+                    events.push_back(Event { max, Event::EEnd });
+                }
+            }
+            std::sort(events.begin(), events.end());
+
+            uint32_t belowCount = 0, aboveCount = size;
+            for (size_t i = 0; i < events.size(); ) {
+                float pos = events[i].pos;
+                uint32_t counts[3] = { 0, 0, 0 };
+                for (; i < events.size() && events[i].pos == pos; ++i)
+                    counts[events[i].type]++;
+
+                /* References ending at or lying in the plane are not above it */
+                aboveCount -= counts[Event::EEnd] + counts[Event::EPlanar];
+                if (pos > voxel.min[axis] && pos < voxel.max[axis]) {
+                    float splitCost = cost(voxel, invArea, axis, pos,
+                                           belowCount + counts[Event::EPlanar], aboveCount);
+                    if (splitCost < best.cost) {
+                        best.axis = axis;
+                        best.pos = pos;
+                        best.cost = splitCost;
+                    }
+                }
+                belowCount += counts[Event::EStart] + counts[Event::EPlanar];
+            }
+        }
+        return best;
+    }
+
+    /// Recursively build a subtree over the references overlapping \c voxel
+    void build(Node &node, std::vector<Reference> &refs, const BoundingBox3f &voxel,
+               uint32_t depth, uint32_t badRefines) {
+        uint32_t size = (uint32_t) refs.size();
+        m_nodeCount++;
+
+        if (size <= 1 || depth >= m_maxDepth || voxel.getSurfaceArea() <= 0) {
+            makeLeaf(node, refs);
+            return;
+        }
+
+        Split split = size > KD_SWEEP_SIZE ? binnedSplit(refs, voxel) : sweepSplit(refs, voxel);
+
+        /* Accept a few splits that do not pay off, since they may enable better ones below */
+        float leafCost = KD_INTERSECTION_COST * blocks(size);
+        if (split.cost > leafCost)
+            ++badRefines;
+        if (split.axis == -1 || badRefines >= KD_MAX_BAD_REFINES ||
+            (split.cost > 4 * leafCost && size < 16)) {
+            makeLeaf(node, refs);
+            return;
+        }
+
+        int axis = split.axis;
+        float pos = split.pos;
+        std::vector<Reference> belowRefs, aboveRefs;
+        for (const Reference &ref : refs) {
+            float min = ref.bbox.min[axis], max = ref.bbox.max[axis];
+            if (max <= pos) {
+                /* Planar references in the split plane also end up here */
+                belowRefs.push_back(ref);
+            } else if (min >= pos) {
+                aboveRefs.push_back(ref);
+            } else {
+                /* Straddling reference: clip the triangle against the plane */
+                Reference below { ref.idx, BoundingBox3f() }, above { ref.idx, BoundingBox3f() };
+                Accel::splitTriangle(&m_vertices[3 * ref.idx], ref.bbox, axis, pos,
+                                     below.bbox, above.bbox);
+                if (below.bbox.isValid())
+                    belowRefs.push_back(below);
+                if (above.bbox.isValid())
+                    aboveRefs.push_back(above);
+            }
+        }
+
+        /* Release the memory of this node's references before recursing */
+        std::vector<Reference>().swap(refs);
+
+        node.axis = axis;
+        node.split = pos;
+        node.below.reset(new Node());
+        node.above.reset(new Node());
+        BoundingBox3f belowVoxel = voxel, aboveVoxel = voxel;
+        belowVoxel.max[axis] = pos;
+        aboveVoxel.min[axis] = pos;
+
+        if (size < KD_PARALLEL_TASK_SIZE) {
+            build(*node.below, belowRefs, belowVoxel, depth + 1, badRefines);
+            build(*node.above, aboveRefs, aboveVoxel, depth + 1, badRefines);
+        } else {
+            tbb::parallel_invoke(
+                [&] { build(*node.below, belowRefs, belowVoxel, depth + 1, badRefines); },
+                [&] { build(*node.above, aboveRefs, aboveVoxel, depth + 1, badRefines); }
+            );
+        }
+    }
+
+    void makeLeaf(Node &node, std::vector<Reference> &refs) {
+        node.indices.reserve(refs.size());
+        for (const Reference &ref : refs)
+            node.indices.push_back(ref.idx);
+        m_referenceCount += (uint32_t) refs.size();
+        std::vector<Reference>().swap(refs);
+    }
+
+    /// Append the subtree to the node and index arrays of the \ref KDTree in depth-first order
+    uint32_t flatten(const Node &node) {
+        NodeVector<KDTree::KDNode> &nodes = m_tree.m_kdNodes;
+        std::vector<uint32_t> &indices = m_tree.m_indices;
+        uint32_t nodeIdx = (uint32_t) nodes.size();
+        nodes.emplace_back();
+
+        if (node.below) {
+            nodes[nodeIdx].split = node.split;
+            flatten(*node.below);
+            uint32_t aboveChild = flatten(*node.above);
+            nodes[nodeIdx].data = (aboveChild << 2) | (uint32_t) node.axis;
+        } else {
+            nodes[nodeIdx].start = (uint32_t) indices.size();
+            nodes[nodeIdx].data = ((uint32_t) node.indices.size() << 2) | 3u;
+            indices.insert(indices.end(), node.indices.begin(), node.indices.end());
+        }
+        return nodeIdx;
+    }
+
+    static int binIndex(float value, float min, float scale) {
+        return clamp((int) ((value - min) * scale), 0, KD_BIN_COUNT - 1);
+    }
+
+private:
+    KDTree &m_tree;
+    std::vector<Point3f> m_vertices; ///< Vertex positions of all triangles (used for clipping)
+    uint32_t m_blockSize;
+    uint32_t m_maxDepth;
+    std::atomic<uint32_t> m_nodeCount { 0 };
+    std::atomic<uint32_t> m_referenceCount { 0 };
+};
+
+KDTree::KDTree(const PropertyList &propList) : Accel(propList) {
+    if (m_lazyBuild)
+        throw NoriException("KDTree: lazy construction is only supported by the BVH!");
+    if (m_meshHierarchies)
+        throw NoriException("KDTree: separate mesh hierarchies are only supported by the BVH!");
+
+    /* Leaves use packets of 4 triangles; the BVH-specific node layouts do not apply */
+    m_width = 2;
+    m_compressed = false;
+    m_spatialSplits = false;
+    m_fastBuild = false;
+    if (m_packetWidth != 0)
+        m_packetWidth = 4;
+}
+
+void KDTree::buildTriangles() {
+    uint32_t size = getTriangleCount();
+    if (size == 0)
+        return;
+
+    cout << "Constructing a SAH kd-tree (" << m_meshes.size() << " meshes, " << size
+         << " triangles) .. ";
+    cout.flush();
+    Timer timer;
+
+    KDTreeBuilder(*this).build();
+    uint32_t referenceCount = (uint32_t) m_indices.size();
+
+    /* The depth of the tree bounds the traversal stack (parents precede their children) */
+    std::vector<uint32_t> depth(m_kdNodes.size(), 0);
+    m_stackDepth = 0;
+    for (uint32_t i = 0; i < m_kdNodes.size(); ++i) {
+        const KDNode &node = m_kdNodes[i];
+        if (node.isLeaf())
+            m_stackDepth = std::max(m_stackDepth, depth[i]);
+        else
+            depth[i + 1] = depth[node.aboveChild()] = depth[i] + 1;
+    }
+
+    std::vector<PacketRange> packetRanges;
+    if (m_packetWidth == 4) {
+        /* Determine where the packets of each leaf will be stored */
+        for (uint32_t i = 0; i < m_kdNodes.size(); ++i) {
+            KDNode &node = m_kdNodes[i];
+            if (!node.isLeaf() || node.size() == 0)
+                continue;
+            uint32_t first = node.start, size = node.size();
+            node.start = (uint32_t) packetRanges.size();
+            node.data = (((size + 3) / 4) << 2) | 3u;
+            for (uint32_t j = 0; j < size; j += 4)
+                packetRanges.emplace_back(first + j, std::min(size - j, 4u));
+        }
+
+        /* Paged packets are generated straight into the page file (see Accel::pageLeaves()) */
+        if (m_pageBudget <= 0) {
+            fillPackets<4>(packetRanges);
+            std::vector<PacketRange>().swap(packetRanges);
+        }
+    }
+
+    cout << "done. (" << getNodeCount() << " nodes, stack depth " << m_stackDepth << "/" << KD_MAX_DEPTH
+         << ", " << referenceCount << " triangle references, took " << timer.elapsedString() << " and "
+         << memString(sizeof(KDNode) * m_kdNodes.size()) << " + " << memString(leafMemory())
+         << " of leaf data)" << endl;
+
+    pageLeaves(packetRanges);
+}
+
+bool KDTree::refit() {
+    if (m_indices.empty())
+        return Accel::refit();
+
+    /* The split planes cannot be moved, hence the tree is rebuilt. The
+       base class refits the hierarchies of the instances (if any) */
+    m_kdNodes.clear();
+    m_indices.clear();
+    m_packets4.clear();
+    m_pageCache.reset();
+    Accel::refit();
+
+    m_bbox.reset();
+    for (const Mesh *mesh : m_meshes)
+        m_bbox.expandBy(mesh->getBoundingBox());
+    for (const Instance *instance : m_instances)
+        m_bbox.expandBy(instance->getBoundingBox());
+
+    buildTriangles();
+    return true;
+}
+
+bool KDTree::clipRay(const Ray3f &ray, float &mint, float &maxt) const {
+    if (!m_kdBBox.rayIntersect(ray, mint, maxt))
+        return false;
+    mint = std::max(mint, ray.mint);
+    maxt = std::min(maxt, ray.maxt);
+    return mint <= maxt;
+}
+
+bool KDTree::traverseTriangles(Ray3f &ray, Intersection &its, uint32_t &f, bool shadowRay) const {
+    float mint, maxt;
+    if (m_kdNodes.empty() || !clipRay(ray, mint, maxt))
+        return false;
+
+    /* Nodes that still need to be visited, along with the parametric range of the ray inside them */
+    struct Entry {
+        uint32_t node;
+        float mint, maxt;
+    } stack[KD_MAX_DEPTH];
+    uint32_t stackIdx = 0, nodeIdx = 0;
+    bool foundIntersection = false;
+    PacketRay pray(ray);
+
+    while (true) {
+        const KDNode &node = m_kdNodes[nodeIdx];
+        NORI_STATS(++TraversalStats::query.nodes);
+
+        if (!node.isLeaf()) {
+            /* Visit the child containing the ray origin first */
+            int axis = node.axis();
+            float origin = ray.o[axis], tSplit = (node.split - origin) * ray.dRcp[axis];
+            bool belowFirst = origin < node.split || (origin == node.split && ray.d[axis] <= 0);
+            uint32_t first = belowFirst ? nodeIdx + 1 : node.aboveChild(),
+                     second = belowFirst ? node.aboveChild() : nodeIdx + 1;
+
+            if (tSplit > maxt || tSplit <= 0) {
+                nodeIdx = first;
+            } else if (tSplit < mint) {
+                nodeIdx = second;
+            } else {
+                stack[stackIdx++] = Entry { second, tSplit, maxt };
+                nodeIdx = first;
+                maxt = tSplit;
+            }
+            continue;
+        }
+
+        if (node.size() > 0 &&
+            intersectLeaf(node.start, node.start + node.size(), pray, ray, its, f, shadowRay)) {
+            if (shadowRay)
+                return true;
+            foundIntersection = true;
+        }
+
+        /* Nodes are visited front to back: stop once the closest hit precedes the next node */
+        if (stackIdx == 0 || ray.maxt <= maxt)
+            break;
+        const Entry &entry = stack[--stackIdx];
+        if (ray.maxt < entry.mint)
+            break;
+        nodeIdx = entry.node;
+        mint = entry.mint;
+        maxt = entry.maxt;
+    }
+
+    return foundIntersection;
+}
+
+bool KDTree::occludedTriangles(const Ray3f &ray, uint32_t &triangle) const {
+    float mint, maxt;
+    if (m_kdNodes.empty() || !clipRay(ray, mint, maxt))
+        return false;
+
+    struct Entry {
+        uint32_t node;
+        float mint, maxt;
+    } stack[KD_MAX_DEPTH];
+    uint32_t stackIdx = 0, nodeIdx = 0;
+    PacketRay pray(ray);
+
+    while (true) {
+        const KDNode &node = m_kdNodes[nodeIdx];
+        NORI_STATS(++TraversalStats::query.nodes);
+
+        if (!node.isLeaf()) {
+            int axis = node.axis();
+            float origin = ray.o[axis], tSplit = (node.split - origin) * ray.dRcp[axis];
+            bool belowFirst = origin < node.split || (origin == node.split && ray.d[axis] <= 0);
+            uint32_t first = belowFirst ? nodeIdx + 1 : node.aboveChild(),
+                     second = belowFirst ? node.aboveChild() : nodeIdx + 1;
+
+            if (tSplit > maxt || tSplit <= 0) {
+                nodeIdx = first;
+            } else if (tSplit < mint) {
+                nodeIdx = second;
+            } else {
+                stack[stackIdx++] = Entry { second, tSplit, maxt };
+                nodeIdx = first;
+                maxt = tSplit;
+            }
+            continue;
+        }
+
+        if (node.size() > 0 &&
+            occludedLeaf(node.start, node.start + node.size(), pray, ray, triangle))
+            return true;
+
+        if (stackIdx == 0)
+            break;
+        const Entry &entry = stack[--stackIdx];
+        nodeIdx = entry.node;
+        mint = entry.mint;
+        maxt = entry.maxt;
+    }
+
+    return false;
+}
+
+void KDTree::serializeTriangles(Snapshot &snapshot) const {
+    snapshot.write(m_kdNodes);
+    snapshot.write(m_kdBBox);
+    snapshot.write(m_indices);
+    serializePackets<4>(snapshot);
+    snapshot.write(m_stackDepth);
+}
+
+void KDTree::loadTriangles(Snapshot &snapshot) {
+    snapshot.read(m_kdNodes);
+    snapshot.read(m_kdBBox);
+    snapshot.read(m_indices);
+    snapshot.read(m_packets4);
+    snapshot.read(m_stackDepth);
+}
+
+Accel::Statistics KDTree::getStatistics() const {
+    Statistics stats;
+    if (m_kdNodes.empty())
+        return stats;
+
+    /* The children of a node partition its bounds, hence siblings never overlap */
+    nodeStatistics(0, m_kdBBox, 0, stats);
+    stats.sahCost /= m_kdBBox.getSurfaceArea();
+    stats.nodeMemory = sizeof(KDNode) * m_kdNodes.size();
+    stats.leafMemory = leafMemory();
+    return stats;
+}
+
+void KDTree::nodeStatistics(uint32_t nodeIdx, const BoundingBox3f &bbox, uint32_t depth,
+                            Statistics &stats) const {
+    const KDNode &node = m_kdNodes[nodeIdx];
+    float area = bbox.getSurfaceArea();
+
+    if (node.isLeaf()) {
+        stats.sahCost += KD_INTERSECTION_COST * node.size() * area;
+        stats.addLeaf(depth, leafTriangleCount(node.start, node.size()));
+        return;
+    }
+
+    int axis = node.axis();
+    BoundingBox3f below = bbox, above = bbox;
+    below.max[axis] = above.min[axis] = node.split;
+    ++stats.innerNodes;
+    stats.sahCost += KD_TRAVERSAL_COST * area;
+    nodeStatistics(nodeIdx + 1, below, depth + 1, stats);
+    nodeStatistics(node.aboveChild(), above, depth + 1, stats);
+}
+
+std::string KDTree::toString() const {
+    return tfm::format(
+        "Accel[\n"
+        "  type = \"kdtree\",\n"
+        "  packets = %s,\n"
+        "  pageBudget = %f,\n"
+        "  instances = %i\n"
+        "]",
+        m_packetWidth > 0 ? "true" : "false",
+        m_pageBudget,
+        m_instances.size()
+    );
+}
+
+NORI_REGISTER_CLASS(KDTree, "kdtree");
+NORI_NAMESPACE_END
@@ -0,0 +1,192 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvhbuilder.h>
+
+NORI_NAMESPACE_BEGIN
+
+/* Parameters of the lazy BVH construction */
+#define BVH_LAZY_LOCK_COUNT    64     /* Number of locks shared by the nodes of lazily built hierarchies */
+
+void Accel::LazyNodes::reset(size_t capacity) {
+    for (size_t i = 0; i < m_segmentCount; ++i)
+        delete m_segments[i].load();
+    m_segmentCount = (capacity + (1u << BVH_LAZY_SEGMENT_BITS) - 1) >> BVH_LAZY_SEGMENT_BITS;
+    m_segments.reset(m_segmentCount > 0 ? new std::atomic<Segment *>[m_segmentCount] : nullptr);
+    for (size_t i = 0; i < m_segmentCount; ++i)
+        m_segments[i] = nullptr;
+    m_size = 0;
+}
+
+uint32_t Accel::LazyNodes::allocatePair() {
+    /* Segments hold an even number of nodes, hence pairs never straddle two of them */
+    uint32_t idx = m_size.fetch_add(2);
+    std::atomic<Segment *> &segment = m_segments[idx >> BVH_LAZY_SEGMENT_BITS];
+    if (!segment.load(std::memory_order_acquire)) {
+        /* Several threads may get here at once -- only one of the segments is kept */
+        Segment *expected = nullptr, *created = new Segment();
+        if (!segment.compare_exchange_strong(expected, created, std::memory_order_acq_rel))
+            delete created;
+    }
+    return idx;
+}
+
+size_t Accel::LazyNodes::memoryUsage() const {
+    size_t count = 0;
+    for (size_t i = 0; i < m_segmentCount; ++i)
+        count += m_segments[i].load() ? 1 : 0;
+    return count * sizeof(Segment) + m_segmentCount * sizeof(std::atomic<Segment *>);
+}
+
+void Accel::prepareExpansion() {
+    /* Every leaf covers at least one triangle, hence a hierarchy over n
+       triangles never has more than 2n nodes (including the padding) */
+    m_lazyNodes.reset(2 * (size_t) getTriangleCount());
+
+    /* Parents are stored before their children */
+    uint32_t maxDepth = 0;
+    for (uint32_t i = 0; i < m_nodes.size(); i += 2) {
+        uint32_t idx = m_lazyNodes.allocatePair();
+        for (uint32_t j = 0; j < 2; ++j) {
+            m_lazyNodes[idx + j] = m_nodes[i + j];
+            if (i == 0)
+                m_lazyNodes.depth(idx + j) = 0;
+        }
+        for (uint32_t j = 0; j < 2; ++j) {
+            const BVHNode &node = m_nodes[i + j];
+            if (node.isInner())
+                m_lazyNodes.depth(node.inner.children) = m_lazyNodes.depth(node.inner.children + 1) =
+                    m_lazyNodes.depth(i + j) + 1;
+            else
+                maxDepth = std::max(maxDepth, (uint32_t) m_lazyNodes.depth(i + j));
+        }
+    }
+    m_lazyDepth = maxDepth;
+    NodeVector<BVHNode>().swap(m_nodes);
+
+    m_expandMutex.reset(new std::mutex[BVH_LAZY_LOCK_COUNT]);
+}
+
+void Accel::expandNode(uint32_t nodeIdx) const {
+    std::lock_guard<std::mutex> lock(m_expandMutex[nodeIdx % BVH_LAZY_LOCK_COUNT]);
+
+    /* Splitting a node does not change the hierarchy as seen by the
+       traversal, hence the nodes and indices are modified in place */
+    const BVHNode &node = m_lazyNodes[nodeIdx];
+    uint32_t *indices = const_cast<uint32_t *>(m_indices.data());
+    if (node.isInner() || !node.leaf.unbuilt)
+        return; /* Another thread was faster */
+
+    uint32_t start = node.start(), end = node.end(), size = end - start;
+    uint8_t depth = m_lazyNodes.depth(nodeIdx);
+
+    auto centroid = [&](uint32_t idx) {
+        const Mesh *mesh = m_meshes[findMesh(idx)];
+        return mesh->getCentroid(idx);
+    };
+    auto bounds = [&](uint32_t start, uint32_t end) {
+        BVHBuilder::Bounds bounds;
+        for (uint32_t i = start; i < end; ++i) {
+            uint32_t idx = indices[i];
+            const Mesh *mesh = m_meshes[findMesh(idx)];
+            bounds.bbox.expandBy(mesh->getBoundingBox(idx));
+            bounds.centroidBBox.expandBy(mesh->getCentroid(idx));
+        }
+        return bounds;
+    };
+
+    /* Unless the node becomes a regular leaf, it is replaced by an inner node */
+    BVHNode result;
+    result.data = node.data;
+    result.leaf.unbuilt = 0;
+
+    if (size > 1 && depth < BVH_MAX_DEPTH) {
+        /* Binned SAH, computing the triangle bounds on the fly. This runs
+           serially, since the calling thread may be part of a parallel loop */
+        BVHBuilder::Bounds nodeBounds;
+        nodeBounds.bbox = node.bbox;
+        for (uint32_t i = start; i < end; ++i)
+            nodeBounds.centroidBBox.expandBy(centroid(indices[i]));
+
+        std::unique_ptr<BVHBuilder::Bins> bins(new BVHBuilder::Bins());
+        Vector3f scale = BVHBuilder::binScale(nodeBounds.centroidBBox);
+        for (uint32_t i = start; i < end; ++i) {
+            uint32_t idx = indices[i];
+            const Mesh *mesh = m_meshes[findMesh(idx)];
+            BoundingBox3f bbox = mesh->getBoundingBox(idx);
+            Point3f c = mesh->getCentroid(idx);
+            for (int axis = 0; axis < 3; ++axis) {
+                int bin = BVHBuilder::binIndex(c[axis], nodeBounds.centroidBBox.min[axis], scale[axis]);
+                bins->bbox[axis][bin].expandBy(bbox);
+                bins->centroidBBox[axis][bin].expandBy(c);
+                bins->count[axis][bin]++;
+            }
+        }
+
+        int bestBin;
+        BVHBuilder::Split split = BVHBuilder::findBinSplit(*bins, nodeBounds, size, 1, bestBin);
+        bool makeLeaf = false;
+        if (split.axis == -1) {
+            /* All centroids coincide -- there is nothing to be gained from SAH */
+            makeLeaf = size <= BVH_MAX_LEAF_SIZE;
+            if (!makeLeaf) {
+                split.mid = start + size / 2;
+                split.left = bounds(start, split.mid);
+                split.right = bounds(split.mid, end);
+            }
+        } else {
+            makeLeaf = split.cost >= size * BVH_INTERSECTION_COST && size <= BVH_MAX_LEAF_SIZE;
+            int axis = split.axis;
+            float min = nodeBounds.centroidBBox.min[axis];
+            split.mid = (uint32_t) (std::partition(indices + start, indices + end,
+                [&](uint32_t idx) {
+                    return BVHBuilder::binIndex(centroid(idx)[axis], min, scale[axis]) <= bestBin;
+                }) - indices);
+        }
+
+        if (!makeLeaf) {
+            /* The children are complete before the parent is published */
+            uint32_t children = m_lazyNodes.allocatePair();
+            uint32_t childStart[2] = { start, split.mid }, childEnd[2] = { split.mid, end };
+            BVHNode *child = &m_lazyNodes[children];
+            for (int i = 0; i < 2; ++i) {
+                child[i].data = 0;
+                child[i].leaf.flag = 1;
+                child[i].leaf.unbuilt = childEnd[i] - childStart[i] > 1 ? 1u : 0u;
+                child[i].leaf.size = childEnd[i] - childStart[i];
+                child[i].leaf.start = childStart[i];
+                child[i].bbox = i == 0 ? split.left.bbox : split.right.bbox;
+                m_lazyNodes.depth(children + i) = depth + 1;
+            }
+
+            uint32_t reached = m_lazyDepth.load(std::memory_order_relaxed);
+            while (reached < depth + 1u &&
+                   !m_lazyDepth.compare_exchange_weak(reached, depth + 1u, std::memory_order_relaxed))
+                ;
+
+            result.data = 0;
+            result.inner.flag = 0;
+            result.inner.axis = (uint32_t) std::max(split.axis, 0);
+            result.inner.children = children;
+        }
+    }
+
+    m_lazyNodes.store(nodeIdx, result.data);
+}
+
+NORI_NAMESPACE_END
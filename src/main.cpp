@@ -24,6 +24,7 @@
 #include <nori/bitmap.h>
 #include <nori/sampler.h>
 #include <nori/integrator.h>
+#include <nori/stats.h>
 #include <nori/gui.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
@@ -34,6 +35,21 @@
 using namespace nori;
 
 static int threadCount = -1;
+static bool useSnapshot = false;
+
+#if defined(NORI_TRAVERSAL_STATS)
+/* Traversal cost of every pixel, summed over its samples (see \ref TraversalStats) */
+static Bitmap::Channel nodeCost, triangleCost;
+
+/// Add the work done by the current thread since \c before to the pixel of a sample
+static void addCost(const Point2f &pixelSample, const TraversalStats::Counters &before) {
+    TraversalStats::Counters after = TraversalStats::getThreadTotal();
+    int x = clamp((int) pixelSample.x(), 0, (int) nodeCost.cols() - 1),
+        y = clamp((int) pixelSample.y(), 0, (int) nodeCost.rows() - 1);
+    nodeCost(y, x) += (float) (after.nodes - before.nodes);
+    triangleCost(y, x) += (float) (after.triangles - before.triangles);
+}
+#endif
 
 static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
     const Camera *camera = scene->getCamera();
@@ -49,6 +65,7 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     for (int y=0; y<size.y(); ++y) {
         for (int x=0; x<size.x(); ++x) {
             for (uint32_t i=0; i<sampler->getSampleCount(); ++i) {
+                NORI_STATS(TraversalStats::Counters before = TraversalStats::getThreadTotal());
                 Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
                 Point2f apertureSample = sampler->next2D();
 
@@ -61,6 +78,9 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
 
                 /* Store in the image block */
                 block.put(pixelSample, value);
+
+                /* Record the traversal cost of the sample */
+                NORI_STATS(addCost(pixelSample, before));
             }
         }
     }
@@ -78,6 +98,12 @@ static void render(Scene *scene, const std::string &filename) {
     ImageBlock result(outputSize, camera->getReconstructionFilter());
     result.clear();
 
+#if defined(NORI_TRAVERSAL_STATS)
+    nodeCost.setZero(outputSize.y(), outputSize.x());
+    triangleCost.setZero(outputSize.y(), outputSize.x());
+    TraversalStats::reset();
+#endif
+
     /* Create a window that visualizes the partially rendered result */
     nanogui::init();
     NoriScreen *screen = new NoriScreen(result);
@@ -123,7 +149,25 @@ static void render(Scene *scene, const std::string &filename) {
         /// (equivalent to the following single-threaded call)
         // map(range);
 
-        cout << "done. (took " << timer.elapsedString() << ")" << endl;
+        /* Report the ray throughput of the acceleration data structure
+           (the rays are counted along with the traversal statistics) */
+        double elapsed = timer.elapsed();
+        cout << "done. (took " << timeString(elapsed);
+#if defined(NORI_TRAVERSAL_STATS)
+        uint64_t rayCount = TraversalStats::getTotal().rays;
+        cout << ", " << rayCount << " rays, "
+             << tfm::format("%.2f", rayCount / (1000.0 * std::max(elapsed, 1.0))) << " Mrays/s";
+#endif
+        cout << ")" << endl;
+
+        /* Summarize the work done by the traversal kernels */
+        NORI_STATS(cout << TraversalStats::summary());
+
+        /* Report how often the paged leaf data and meshes had to be loaded */
+        if (const PageCache *pageCache = scene->getAccel()->getPageCache())
+            cout << "Leaf data: " << pageCache->toString() << endl;
+        if (const PageCache *pageCache = scene->getAccel()->getMeshPageCache())
+            cout << "Meshes: " << pageCache->toString() << endl;
     });
 
     /* Enter the application main loop */
@@ -145,8 +189,15 @@ static void render(Scene *scene, const std::string &filename) {
     if (lastdot != std::string::npos)
         outputName.erase(lastdot, std::string::npos);
 
-    /* Save using the OpenEXR format */
-    bitmap->saveEXR(outputName);
+    /* Save using the OpenEXR format (along with a heatmap of the
+       traversal cost per pixel sample, if it was recorded) */
+    std::map<std::string, Bitmap::Channel> extra;
+#if defined(NORI_TRAVERSAL_STATS)
+    float invSampleCount = 1.0f / scene->getSampler()->getSampleCount();
+    extra["cost.nodes"] = nodeCost * invSampleCount;
+    extra["cost.triangles"] = triangleCost * invSampleCount;
+#endif
+    bitmap->saveEXR(outputName, extra);
 
     /* Save tonemapped (sRGB) output using the PNG format */
     bitmap->savePNG(outputName);
@@ -154,7 +205,7 @@ static void render(Scene *scene, const std::string &filename) {
 
 int main(int argc, char **argv) {
     if (argc < 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml>" << endl;
+        cerr << "Syntax: " << argv[0] << " [--threads N] [--snapshot] <scene.xml>" << endl;
         return -1;
     }
 
@@ -177,6 +228,12 @@ int main(int argc, char **argv) {
             continue;
         }
 
+        if (token == "-s" || token == "--snapshot") {
+            /* Store (or reuse) the loaded meshes and the BVH in a snapshot file */
+            useSnapshot = true;
+            continue;
+        }
+
         filesystem::path path(argv[i]);
 
         try {
@@ -212,7 +269,14 @@ int main(int argc, char **argv) {
     }
 
     if (sceneName != "") {
-            std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+            /* Respect the thread count while loading the scene as well
+               (e.g. during the parallel BVH construction) */
+            std::unique_ptr<NoriObject> root;
+            {
+                tbb::task_scheduler_init init(threadCount);
+                root.reset(loadFromXML(sceneName, useSnapshot));
+            }
+
             /* When the XML root object is a scene, start rendering it .. */
             if (root->getClassType() == NoriObject::EScene)
                 render(static_cast<Scene *>(root.get()), sceneName);
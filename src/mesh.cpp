@@ -21,7 +21,9 @@
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
 #include <nori/warp.h>
+#include <nori/instance.h>
 #include <Eigen/Geometry>
+#include <algorithm>
 
 NORI_NAMESPACE_BEGIN
 
@@ -40,17 +42,140 @@ void Mesh::activate() {
     }
 }
 
+void Mesh::setVertexPositions(const MatrixXf &V) {
+    if (V.rows() != 3 || V.cols() != getVertexCount())
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertices, got %i!",
+                            getVertexCount(), V.cols());
+    if (m_pageCache) {
+        m_pageCache->write(m_paged[EPositions].offset, V.data(), sizeof(float) * V.size());
+    } else {
+        m_V = V;
+        m_mapped[EPositions] = MappedBuffer();
+    }
+    m_bbox.reset();
+    for (uint32_t i = 0; i < getVertexCount(); ++i)
+        m_bbox.expandBy(V.col(i));
+}
+
+void Mesh::page(const std::shared_ptr<PageCache> &pageCache, size_t offset) {
+    if (m_pageCache)
+        throw NoriException("Mesh::page(): the mesh \"%s\" is already paged!", m_name);
+
+    const MatrixXfMap attributes[3] = { getVertexPositionView(), getVertexNormalView(),
+                                        getVertexTexCoordView() };
+    for (int i = EPositions; i < EFaces; ++i) {
+        const MatrixXfMap &matrix = attributes[i];
+        m_paged[i] = PagedBuffer{ offset, matrix.rows(), matrix.cols() };
+        pageCache->write(offset, matrix.data(), sizeof(float) * matrix.size());
+        offset += sizeof(float) * matrix.size();
+    }
+    MatrixXuMap F = getIndexView();
+    m_paged[EFaces] = PagedBuffer{ offset, F.rows(), F.cols() };
+    pageCache->write(offset, F.data(), sizeof(uint32_t) * F.size());
+
+    m_pageCache = pageCache;
+    MatrixXf().swap(m_V);
+    MatrixXf().swap(m_N);
+    MatrixXf().swap(m_UV);
+    MatrixXu().swap(m_F);
+    for (int i = 0; i < EBufferCount; ++i)
+        m_mapped[i] = MappedBuffer();
+    m_mapping.reset();
+}
+
+void Mesh::mapBuffer(EBuffer index, const void *data, Eigen::Index rows, Eigen::Index cols) {
+    m_mapped[index].data = data;
+    m_mapped[index].rows = rows;
+    m_mapped[index].cols = cols;
+}
+
+void Mesh::copyMapped(EBuffer index) const {
+    std::call_once(m_copied[index], [&]() {
+        /* The matrices are logically part of the buffers, which are
+           unchanged by the copy, hence the const_cast */
+        Mesh *mesh = const_cast<Mesh *>(this);
+        const MappedBuffer &mapped = m_mapped[index];
+        if (index == EFaces) {
+            mesh->m_F = MatrixXuMap((const uint32_t *) mapped.data, mapped.rows, mapped.cols);
+        } else {
+            MatrixXf *attributes[3] = { &mesh->m_V, &mesh->m_N, &mesh->m_UV };
+            *attributes[index] = MatrixXfMap((const float *) mapped.data, mapped.rows, mapped.cols);
+        }
+    });
+}
+
+size_t Mesh::getBufferSize() const {
+    return sizeof(float) * (getVertexPositionView().size() + getVertexNormalView().size() +
+                            getVertexTexCoordView().size()) + sizeof(uint32_t) * getIndexView().size();
+}
+
+void Mesh::throwPaged(EBuffer index) const {
+    static const char *names[] = { "vertex positions", "vertex normals", "texture coordinates", "indices" };
+    throw NoriException("Mesh \"%s\": the %s were moved into a page file and can "
+                        "only be accessed through the view accessors (e.g. getVertexPositionView())",
+                        m_name, names[index]);
+}
+
+/// Sort a list of pages and remove duplicates (returns the new size)
+static size_t uniquePages(size_t *pages, size_t count) {
+    std::sort(pages, pages + count);
+    return (size_t) (std::unique(pages, pages + count) - pages);
+}
+
+void Mesh::touchPaged(const uint32_t *indices, size_t count) const {
+    /* The pages holding the faces of a batch of triangles are reported to
+       the page cache at once, followed by those of their vertex attributes */
+    const size_t batchSize = 8;
+    size_t pages[batchSize * 2 * 3 * (EBufferCount - 1)];
+    const PagedBuffer &faces = m_paged[EFaces];
+    const uint32_t *F = (const uint32_t *) (m_pageCache->getData() + faces.offset);
+
+    for (size_t start = 0; start < count; start += batchSize) {
+        size_t end = std::min(count, start + batchSize), n = 0;
+
+        for (size_t i = start; i < end; ++i) {
+            size_t offset = faces.offset + sizeof(uint32_t) * 3 * indices[i];
+            pages[n++] = m_pageCache->getPage(offset);
+            pages[n++] = m_pageCache->getPage(offset + sizeof(uint32_t) * 3 - 1);
+        }
+        m_pageCache->touch(pages, uniquePages(pages, n));
+
+        n = 0;
+        for (size_t i = start; i < end; ++i) {
+            const uint32_t *face = F + 3 * indices[i];
+            for (int j = EPositions; j < EFaces; ++j) {
+                const PagedBuffer &paged = m_paged[j];
+                if (paged.cols == 0)
+                    continue;
+                size_t size = sizeof(float) * paged.rows;
+                for (int v = 0; v < 3; ++v) {
+                    size_t offset = paged.offset + size * face[v];
+                    pages[n++] = m_pageCache->getPage(offset);
+                    pages[n++] = m_pageCache->getPage(offset + size - 1);
+                }
+            }
+        }
+        m_pageCache->touch(pages, uniquePages(pages, n));
+    }
+}
+
 float Mesh::surfaceArea(uint32_t index) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    touch(index);
+    MatrixXfMap V = getVertexPositionView();
+    MatrixXuMap F = getIndexView();
+    uint32_t i0 = F(0, index), i1 = F(1, index), i2 = F(2, index);
 
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
 
     return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    touch(index);
+    MatrixXfMap V = getVertexPositionView();
+    MatrixXuMap F = getIndexView();
+    uint32_t i0 = F(0, index), i1 = F(1, index), i2 = F(2, index);
+    const Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
 
     /* Find vectors for two edges sharing v[0] */
     Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
@@ -88,17 +213,23 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    touch(index);
+    MatrixXfMap V = getVertexPositionView();
+    MatrixXuMap F = getIndexView();
+    BoundingBox3f result(V.col(F(0, index)));
+    result.expandBy(V.col(F(1, index)));
+    result.expandBy(V.col(F(2, index)));
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
+    touch(index);
+    MatrixXfMap V = getVertexPositionView();
+    MatrixXuMap F = getIndexView();
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (V.col(F(0, index)) +
+         V.col(F(1, index)) +
+         V.col(F(2, index)));
 }
 
 void Mesh::addChild(NoriObject *obj) {
@@ -135,13 +266,77 @@ std::string Mesh::toString() const {
         "  emitter = %s\n"
         "]",
         m_name,
-        m_V.cols(),
-        m_F.cols(),
+        getVertexCount(),
+        getTriangleCount(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
     );
 }
 
+void Intersection::finalize() {
+    /* At this point, we know that there is an intersection,
+       and we know the triangle index of the closest such intersection.
+
+       The following computes a number of additional properties which
+       characterize the intersection (normals, texture coordinates, etc..)
+    */
+
+    /* Find the barycentric coordinates */
+    Vector3f b;
+    b << 1-bary.sum(), bary;
+
+    /* References to all relevant mesh buffers */
+    mesh->touch(f);
+    MatrixXfMap V  = mesh->getVertexPositionView();
+    MatrixXfMap N  = mesh->getVertexNormalView();
+    MatrixXfMap UV = mesh->getVertexTexCoordView();
+    MatrixXuMap F  = mesh->getIndexView();
+
+    /* Vertex indices of the triangle */
+    uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    p = b.x() * p0 + b.y() * p1 + b.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh
+       (otherwise, fall back to the barycentric coordinates) */
+    if (UV.size() > 0)
+        uv = b.x() * UV.col(idx0) +
+            b.y() * UV.col(idx1) +
+            b.z() * UV.col(idx2);
+    else
+        uv = bary;
+
+    /* Compute the geometry frame */
+    geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+    if (N.size() > 0) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        shFrame = Frame(
+            (b.x() * N.col(idx0) +
+             b.y() * N.col(idx1) +
+             b.z() * N.col(idx2)).normalized());
+    } else {
+        shFrame = geoFrame;
+    }
+
+    if (instance) {
+        /* The above was computed in object space -- transform to world space */
+        const Transform &toWorld = instance->getToWorld();
+        p = toWorld * p;
+        geoFrame = Frame((toWorld * Normal3f(geoFrame.n)).normalized());
+        shFrame = Frame((toWorld * Normal3f(shFrame.n)).normalized());
+    }
+}
+
 std::string Intersection::toString() const {
     if (!mesh)
         return "Intersection[invalid]";
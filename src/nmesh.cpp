@@ -0,0 +1,306 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/nmesh.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <zlib.h>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+#define NMESH_ALIGNMENT  64                /* Alignment of the header and of the arrays of uncompressed files (in bytes) */
+#define NMESH_ZLIB_BLOCK (64 * 1024 * 1024) /* Maximum number of bytes passed to zlib at once */
+
+NORI_NAMESPACE_BEGIN
+
+/// Properties of a binary mesh file
+enum ENMeshFlags {
+    ENMeshNormals    = 0x01, ///< The file contains vertex normals
+    ENMeshTexCoords  = 0x02, ///< The file contains texture coordinates
+    ENMeshCompressed = 0x04  ///< The arrays are zlib-compressed
+};
+
+/// Header at the beginning of every binary mesh file
+struct NMeshHeader {
+    char magic[8];          ///< Identifies binary mesh files ("NORIMESH")
+    uint32_t version;       ///< File format version (\ref NORI_NMESH_VERSION)
+    uint32_t flags;         ///< Combination of \ref ENMeshFlags
+    uint64_t vertexCount;   ///< Number of vertices
+    uint64_t triangleCount; ///< Number of triangles
+    float bbox[6];          ///< Bounding box of the vertex positions (minimum and maximum)
+    uint64_t dataSize;      ///< Number of bytes following the header
+};
+
+static_assert(sizeof(NMeshHeader) == NMESH_ALIGNMENT, "Unexpected size of the binary mesh header");
+
+static const char nmeshMagic[8] = { 'N', 'O', 'R', 'I', 'M', 'E', 'S', 'H' };
+
+static size_t align(size_t offset) {
+    return (offset + NMESH_ALIGNMENT - 1) / NMESH_ALIGNMENT * NMESH_ALIGNMENT;
+}
+
+/// Return the sizes (in bytes) of the positions, normals, texture coordinates, and indices
+static void getArraySizes(const NMeshHeader &header, size_t sizes[4]) {
+    size_t vertexCount = (size_t) header.vertexCount;
+    sizes[0] = sizeof(float) * 3 * vertexCount;
+    sizes[1] = (header.flags & ENMeshNormals) ? sizeof(float) * 3 * vertexCount : 0;
+    sizes[2] = (header.flags & ENMeshTexCoords) ? sizeof(float) * 2 * vertexCount : 0;
+    sizes[3] = sizeof(uint32_t) * 3 * (size_t) header.triangleCount;
+}
+
+/**
+ * \brief Triangle mesh stored in Nori's binary mesh format
+ *
+ * The file consists of a header followed by the vertex positions, normals
+ * (optional), texture coordinates (optional), and triangle indices in the
+ * column-major layout of the buffers of \ref Mesh. Files written by
+ * \ref saveNMesh() (e.g. using the \c obj2nmesh converter) therefore load
+ * without any parsing: uncompressed files stay memory-mapped for the lifetime
+ * of the mesh, whose buffers refer to the arrays (aligned to 64 bytes) within
+ * the mapping, while compressed files are inflated directly into the buffers.
+ * Buffers that must be modified (i.e. the positions and normals of meshes
+ * with a \c toWorld transformation) are copied.
+ */
+class NMesh : public Mesh {
+public:
+    NMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+
+        size_t size = 0;
+        const uint8_t *data = mapFile(filename.str(), size);
+        if (!data)
+            throw NoriException("Unable to open binary mesh file \"%s\"!", filename);
+        /* The mapping is released together with the mesh (or as soon as no buffer refers to it) */
+        m_mapping = std::shared_ptr<const uint8_t>(data, [size](const uint8_t *data) {
+            unmapFile(data, size);
+        });
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        Timer timer;
+
+        load(filename.str(), data, size);
+
+        MatrixXuMap F = getIndexView();
+        for (Eigen::Index i=0; i<F.size(); ++i) {
+            if (F.data()[i] >= getVertexCount())
+                throw NoriException("Binary mesh file \"%s\" contains an invalid vertex index (%i)!",
+                                    filename, F.data()[i]);
+        }
+
+        if (trafo.getMatrix() != Eigen::Matrix4f::Identity()) {
+            MatrixXf V = getVertexPositionView();
+            for (uint32_t i=0; i<V.cols(); ++i)
+                V.col(i) = trafo * Point3f(V.col(i));
+            setVertexPositions(V);
+
+            m_N = getVertexNormalView();
+            m_mapped[ENormals] = MappedBuffer();
+            for (uint32_t i=0; i<m_N.cols(); ++i)
+                m_N.col(i) = (trafo * Normal3f(m_N.col(i))).normalized();
+        }
+
+        m_name = filename.str();
+
+        cout << tfm::format("Loading \"%s\" .. done. (V=%i, F=%i, took %s and %s%s)\n",
+                            filename, getVertexCount(), getTriangleCount(), timer.elapsedString(),
+                            memString(getBufferSize()), m_mapping ? ", mapped" : "");
+        cout.flush();
+    }
+
+protected:
+    /// Validate the header and fill the buffers from the mapped file contents
+    void load(const std::string &filename, const uint8_t *data, size_t size) {
+        NMeshHeader header;
+        if (size < sizeof(NMeshHeader))
+            throw NoriException("\"%s\" is not a binary mesh file!", filename);
+        memcpy(&header, data, sizeof(NMeshHeader));
+        if (memcmp(header.magic, nmeshMagic, sizeof(nmeshMagic)) != 0)
+            throw NoriException("\"%s\" is not a binary mesh file!", filename);
+        if (header.version != NORI_NMESH_VERSION)
+            throw NoriException("Binary mesh file \"%s\" has version %i, expected version %i!",
+                                filename, header.version, NORI_NMESH_VERSION);
+        if (header.vertexCount > 0xFFFFFFFFull || header.triangleCount > 0xFFFFFFFFull)
+            throw NoriException("Binary mesh file \"%s\" is too large!", filename);
+
+        size_t sizes[4];
+        getArraySizes(header, sizes);
+
+        bool compressed = (header.flags & ENMeshCompressed) != 0;
+        size_t expectedSize = 0;
+        for (int i = 0; i < 4; ++i)
+            expectedSize = align(expectedSize) + sizes[i];
+        if (header.dataSize != size - sizeof(NMeshHeader) || (!compressed && header.dataSize != expectedSize))
+            throw NoriException("Binary mesh file \"%s\" has an unexpected size (it may be truncated)!", filename);
+
+        Eigen::Index rows[4] = { 3, 3, 2, 3 };
+        Eigen::Index cols[4] = { (Eigen::Index) header.vertexCount, (Eigen::Index) header.vertexCount,
+                                 (Eigen::Index) header.vertexCount, (Eigen::Index) header.triangleCount };
+        m_bbox = BoundingBox3f(Point3f(header.bbox[0], header.bbox[1], header.bbox[2]),
+                               Point3f(header.bbox[3], header.bbox[4], header.bbox[5]));
+        const uint8_t *source = data + sizeof(NMeshHeader);
+
+        if (!compressed) {
+            size_t offset = 0;
+            for (int i = 0; i < 4; ++i) {
+                offset = align(offset);
+                if (sizes[i] > 0)
+                    mapBuffer((EBuffer) i, source + offset, rows[i], cols[i]);
+                offset += sizes[i];
+            }
+            return;
+        }
+
+        m_V.resize(rows[0], cols[0]);
+        if (header.flags & ENMeshNormals)
+            m_N.resize(rows[1], cols[1]);
+        if (header.flags & ENMeshTexCoords)
+            m_UV.resize(rows[2], cols[2]);
+        m_F.resize(rows[3], cols[3]);
+
+        uint8_t *targets[4] = { (uint8_t *) m_V.data(), (uint8_t *) m_N.data(),
+                                (uint8_t *) m_UV.data(), (uint8_t *) m_F.data() };
+
+        /* The compressed stream contains the arrays without padding */
+        z_stream stream;
+        memset(&stream, 0, sizeof(z_stream));
+        if (inflateInit(&stream) != Z_OK)
+            throw NoriException("Unable to initialize zlib!");
+
+        size_t remainingInput = (size_t) header.dataSize;
+        int result = Z_OK;
+        auto decompress = [&](uint8_t *target, size_t size) {
+            while (size > 0 && result == Z_OK) {
+                if (stream.avail_in == 0) {
+                    stream.avail_in = (uInt) std::min(remainingInput, (size_t) NMESH_ZLIB_BLOCK);
+                    stream.next_in = (Bytef *) source;
+                    source += stream.avail_in;
+                    remainingInput -= stream.avail_in;
+                }
+                stream.avail_out = (uInt) std::min(size, (size_t) NMESH_ZLIB_BLOCK);
+                stream.next_out = target;
+                result = inflate(&stream, Z_NO_FLUSH);
+                size_t produced = (size_t) (stream.next_out - target);
+                target += produced;
+                size -= produced;
+            }
+            return size == 0;
+        };
+
+        bool valid = true;
+        for (int i = 0; i < 4; ++i)
+            valid &= decompress(targets[i], sizes[i]);
+
+        /* The stream must end here (which also verifies its checksum) */
+        uint8_t extra;
+        valid &= !decompress(&extra, 1) && result == Z_STREAM_END;
+        inflateEnd(&stream);
+
+        if (!valid)
+            throw NoriException("Binary mesh file \"%s\" is corrupt!", filename);
+
+        /* None of the buffers refer to the compressed data */
+        m_mapping.reset();
+    }
+};
+
+void saveNMesh(const Mesh *mesh, const std::string &filename, bool compress) {
+    NMeshHeader header;
+    memset(&header, 0, sizeof(NMeshHeader));
+    memcpy(header.magic, nmeshMagic, sizeof(nmeshMagic));
+    header.version = NORI_NMESH_VERSION;
+    header.vertexCount = mesh->getVertexCount();
+    header.triangleCount = mesh->getTriangleCount();
+    if (mesh->getVertexNormalView().size() > 0)
+        header.flags |= ENMeshNormals;
+    if (mesh->getVertexTexCoordView().size() > 0)
+        header.flags |= ENMeshTexCoords;
+    if (compress)
+        header.flags |= ENMeshCompressed;
+    const BoundingBox3f &bbox = mesh->getBoundingBox();
+    for (int i = 0; i < 3; ++i) {
+        header.bbox[i] = bbox.min[i];
+        header.bbox[i + 3] = bbox.max[i];
+    }
+
+    size_t sizes[4];
+    getArraySizes(header, sizes);
+    const uint8_t *sources[4] = {
+        (const uint8_t *) mesh->getVertexPositionView().data(),
+        (const uint8_t *) mesh->getVertexNormalView().data(),
+        (const uint8_t *) mesh->getVertexTexCoordView().data(),
+        (const uint8_t *) mesh->getIndexView().data()
+    };
+
+    std::ofstream os(filename, std::ios::binary);
+    if (os.fail())
+        throw NoriException("Unable to write binary mesh file \"%s\"!", filename);
+    os.write((const char *) &header, sizeof(NMeshHeader));
+
+    if (!compress) {
+        static const char padding[NMESH_ALIGNMENT] = { };
+        for (int i = 0; i < 4; ++i) {
+            os.write(padding, (std::streamsize) (align(header.dataSize) - header.dataSize));
+            header.dataSize = align(header.dataSize);
+            os.write((const char *) sources[i], (std::streamsize) sizes[i]);
+            header.dataSize += sizes[i];
+        }
+    } else {
+        z_stream stream;
+        memset(&stream, 0, sizeof(z_stream));
+        if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+            throw NoriException("Unable to initialize zlib!");
+
+        std::vector<uint8_t> buffer(1024 * 1024);
+        auto compressBlock = [&](int flush) {
+            stream.avail_out = (uInt) buffer.size();
+            stream.next_out = buffer.data();
+            int result = deflate(&stream, flush);
+            size_t produced = buffer.size() - stream.avail_out;
+            os.write((const char *) buffer.data(), (std::streamsize) produced);
+            header.dataSize += produced;
+            return result;
+        };
+
+        for (int i = 0; i < 4; ++i) {
+            const uint8_t *source = sources[i];
+            size_t remaining = sizes[i];
+            while (remaining > 0) {
+                stream.avail_in = (uInt) std::min(remaining, (size_t) NMESH_ZLIB_BLOCK);
+                stream.next_in = (Bytef *) source;
+                source += stream.avail_in;
+                remaining -= stream.avail_in;
+                while (stream.avail_in > 0)
+                    compressBlock(Z_NO_FLUSH);
+            }
+        }
+        while (compressBlock(Z_FINISH) == Z_OK)
+            ;
+        deflateEnd(&stream);
+    }
+
+    /* Now that the size of the data is known, complete the header */
+    os.seekp(0);
+    os.write((const char *) &header, sizeof(NMeshHeader));
+    if (os.fail())
+        throw NoriException("Error while writing binary mesh file \"%s\"!", filename);
+}
+
+NORI_REGISTER_CLASS(NMesh, "nmesh");
+NORI_NAMESPACE_END
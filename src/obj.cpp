@@ -19,88 +19,217 @@
 #include <nori/mesh.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
 #include <fstream>
+#include <iterator>
+#include <cstring>
+
+#define OBJ_CHUNK_SIZE (4 * 1024 * 1024) /* Approximate number of bytes parsed by one task */
 
 NORI_NAMESPACE_BEGIN
 
+/// Powers of ten that are exactly representable as single precision floats
+static const float objPowersOfTen[] = {
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+/**
+ * \brief Parse a floating point value that is not null-terminated
+ *
+ * Values with at most 2^24 as their decimal mantissa and a decimal exponent
+ * of at most 10 (which covers the coordinates found in typical OBJ files)
+ * are computed using a single floating point multiplication or division of
+ * exactly representable operands. Like \c strtof(), which handles all other
+ * values, this yields the correctly rounded result.
+ */
+static float parseFloat(const char *begin, const char *end) {
+    const char *ptr = begin;
+    bool negative = false;
+    if (ptr != end && (*ptr == '-' || *ptr == '+'))
+        negative = *ptr++ == '-';
+
+    uint64_t mantissa = 0;
+    int exponent = 0, digits = 0;
+    for (; ptr != end && *ptr >= '0' && *ptr <= '9'; ++ptr, ++digits)
+        mantissa = mantissa * 10 + (uint64_t) (*ptr - '0');
+    if (ptr != end && *ptr == '.') {
+        for (++ptr; ptr != end && *ptr >= '0' && *ptr <= '9'; ++ptr, ++digits, --exponent)
+            mantissa = mantissa * 10 + (uint64_t) (*ptr - '0');
+    }
+    if (ptr != end && (*ptr == 'e' || *ptr == 'E') && digits > 0) {
+        ++ptr;
+        bool negativeExponent = false;
+        if (ptr != end && (*ptr == '-' || *ptr == '+'))
+            negativeExponent = *ptr++ == '-';
+        int value = 0, exponentDigits = 0;
+        for (; ptr != end && *ptr >= '0' && *ptr <= '9'; ++ptr, ++exponentDigits)
+            value = std::min(value * 10 + (*ptr - '0'), 100000);
+        if (exponentDigits == 0)
+            digits = 0; /* Malformed */
+        exponent += negativeExponent ? -value : value;
+    }
+
+    if (ptr == end && digits > 0 && digits <= 18 && mantissa <= (1u << 24) &&
+        exponent >= -10 && exponent <= 10) {
+        float value = (float) mantissa;
+        value = exponent < 0 ? value / objPowersOfTen[-exponent] : value * objPowersOfTen[exponent];
+        return negative ? -value : value;
+    }
+
+    /* Fall back to the C library (e.g. for more than 7 significant digits) */
+    char buffer[64];
+    std::string string;
+    const char *str = buffer;
+    size_t length = (size_t) (end - begin);
+    if (length < sizeof(buffer)) {
+        memcpy(buffer, begin, length);
+        buffer[length] = '\0';
+    } else {
+        string.assign(begin, end);
+        str = string.c_str();
+    }
+    return strtof(str, nullptr);
+}
+
+/// Parse a vertex index that is not null-terminated (like \ref toUInt())
+static uint32_t parseIndex(const char *begin, const char *end) {
+    uint32_t value = 0;
+    for (const char *ptr = begin; ptr != end; ++ptr) {
+        if (*ptr < '0' || *ptr > '9')
+            throw NoriException("Could not parse integer value \"%s\"", std::string(begin, end));
+        value = value * 10 + (uint32_t) (*ptr - '0');
+    }
+    return value;
+}
+
+/// Splits a line of an OBJ file into whitespace-separated tokens (without copying them)
+class OBJTokenizer {
+public:
+    OBJTokenizer(const char *begin, const char *end) : m_ptr(begin), m_end(end) { }
+
+    /// Return the next token as the range <tt>[begin, end)</tt> (which is empty at the end of the line)
+    void next(const char *&begin, const char *&end) {
+        while (m_ptr != m_end && isSpace(*m_ptr))
+            ++m_ptr;
+        begin = m_ptr;
+        while (m_ptr != m_end && !isSpace(*m_ptr))
+            ++m_ptr;
+        end = m_ptr;
+    }
+
+    /// Parse the next token as a floating point value (zero if the line ends)
+    float nextFloat() {
+        const char *begin, *end;
+        next(begin, end);
+        return begin == end ? 0.0f : parseFloat(begin, end);
+    }
+
+private:
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    const char *m_ptr, *m_end;
+};
+
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory-mapped and split into chunks of whole lines, which
+ * are parsed in parallel. The vertices of the faces are then merged into
+ * an indexed vertex list in the order of the file.
+ *
+ * Files that cannot be mapped (e.g. empty ones) are read into memory using
+ * a stream instead, which the \c mapFile property (default: \c true) can
+ * also force. The \c chunkSize property (default: 4 MiB) sets the number of
+ * bytes after which the next chunk starts. Neither changes the resulting
+ * mesh, and the \c objtest tool checks that this is the case.
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
 
-        std::ifstream is(filename.str());
-        if (is.fail())
-            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
+        int chunkSize = propList.getInteger("chunkSize", OBJ_CHUNK_SIZE);
+        if (chunkSize <= 0)
+            throw NoriException("The chunk size of OBJ files must be positive!");
+
+        size_t size = 0;
+        const uint8_t *data = propList.getBoolean("mapFile", true) ? mapFile(filename.str(), size) : nullptr;
+        std::string contents;
+        if (!data) {
+            /* Empty files (and ones that cannot be mapped) are read using a stream */
+            std::ifstream is(filename.str(), std::ios::binary);
+            if (is.fail())
+                throw NoriException("Unable to open OBJ file \"%s\"!", filename);
+            contents.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+            size = contents.size();
+        }
         Transform trafo = propList.getTransform("toWorld", Transform());
 
-        cout << "Loading \"" << filename << "\" .. ";
-        cout.flush();
         Timer timer;
 
+        /* Split the file at the line breaks following every chunkSize bytes */
+        const char *text = data ? (const char *) data : contents.data();
+        std::vector<size_t> bounds { 0 };
+        while (bounds.back() < size) {
+            size_t pos = std::min(bounds.back() + (size_t) chunkSize, size);
+            const char *newline = (const char *) memchr(text + pos, '\n', size - pos);
+            bounds.push_back(newline ? (size_t) (newline - text) + 1 : size);
+        }
+
+        std::vector<Chunk> chunks(bounds.size() - 1);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0u, chunks.size(), 1u),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    parseChunk(text + bounds[i], text + bounds[i + 1], trafo, chunks[i]);
+            }
+        );
+        if (data)
+            unmapFile(data, size);
+
+        /* Report the first error in the order of the file */
+        for (const Chunk &chunk : chunks) {
+            if (!chunk.error.empty())
+                throw NoriException("%s", chunk.error);
+        }
+
         std::vector<Vector3f>   positions;
         std::vector<Vector2f>   texcoords;
         std::vector<Vector3f>   normals;
         std::vector<uint32_t>   indices;
         std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
+
+        size_t faceVertexCount = 0;
+        for (Chunk &chunk : chunks) {
+            positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+            texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+            normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+            m_bbox.expandBy(chunk.bbox);
+            faceVertexCount += chunk.vertices.size();
+            std::vector<Vector3f>().swap(chunk.positions);
+            std::vector<Vector2f>().swap(chunk.texcoords);
+            std::vector<Vector3f>().swap(chunk.normals);
+        }
+
+        /* Most meshes have about as many distinct vertices as the largest
+           number of 'v', 'vt' or 'vn' lines, which sizes the table */
+        size_t expectedVertexCount = std::min(faceVertexCount,
+            std::max(positions.size(), std::max(texcoords.size(), normals.size())));
+        OBJVertexMap vertexMap(expectedVertexCount);
+        vertices.reserve(expectedVertexCount);
+        indices.reserve(faceVertexCount);
+
+        /* Convert to an indexed vertex list */
+        for (const Chunk &chunk : chunks) {
+            for (const OBJVertex &v : chunk.vertices) {
+                uint32_t index = vertexMap.insert(v, (uint32_t) vertices.size());
+                if (index == vertices.size())
+                    vertices.push_back(v);
+                indices.push_back(index);
             }
         }
 
@@ -124,11 +253,14 @@ public:
         }
 
         m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+
+        /* Meshes are loaded in parallel (see loadFromXML()), hence the
+           report is printed in one piece once the mesh is complete */
+        cout << tfm::format("Loading \"%s\" .. done. (V=%i, F=%i, took %s and %s)\n",
+                            filename, m_V.cols(), m_F.cols(), timer.elapsedString(),
+                            memString(m_F.size() * sizeof(uint32_t) +
+                                      sizeof(float) * (m_V.size() + m_N.size() + m_UV.size())));
+        cout.flush();
     }
 
 protected:
@@ -140,19 +272,22 @@ protected:
 
         inline OBJVertex() { }
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+        /// Parse a vertex of a face (<tt>p</tt>, <tt>p/uv</tt>, <tt>p//n</tt>, or <tt>p/uv/n</tt>)
+        inline OBJVertex(const char *begin, const char *end) {
+            const char *slash1 = std::find(begin, end, '/');
+            p = parseIndex(begin, slash1);
+            if (slash1 == end)
+                return;
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+            const char *slash2 = std::find(slash1 + 1, end, '/');
+            if (slash2 != end && std::find(slash2 + 1, end, '/') != end)
+                throw NoriException("Invalid vertex data: \"%s\"", std::string(begin, end));
 
-            p = toUInt(tokens[0]);
+            if (slash2 != slash1 + 1)
+                uv = parseIndex(slash1 + 1, slash2);
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
-
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+            if (slash2 != end && slash2 + 1 != end)
+                n = parseIndex(slash2 + 1, end);
         }
 
         inline bool operator==(const OBJVertex &v) const {
@@ -160,15 +295,155 @@ protected:
         }
     };
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash : std::unary_function<OBJVertex, size_t> {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+    /**
+     * \brief Open-addressing hash table that maps vertices of the faces to
+     * their index in the vertex list
+     *
+     * The entries are stored in a flat power-of-two sized array and
+     * collisions are resolved using linear probing.
+     */
+    class OBJVertexMap {
+    public:
+        /// Create a table with room for about \c expectedSize entries
+        OBJVertexMap(size_t expectedSize) {
+            size_t capacity = 16;
+            while (capacity < 2 * expectedSize)
+                capacity *= 2;
+            m_entries.resize(capacity);
+            m_mask = capacity - 1;
+        }
+
+        /**
+         * \brief Insert the vertex \c v with the given index unless it is
+         * already present
+         *
+         * \return The index associated with \c v, which equals \c index
+         *    if the vertex was newly inserted
+         */
+        uint32_t insert(const OBJVertex &v, uint32_t index) {
+            if (2 * (m_size + 1) > m_entries.size())
+                grow();
+            for (size_t i = hash(v) & m_mask; ; i = (i + 1) & m_mask) {
+                Entry &entry = m_entries[i];
+                if (entry.index == Empty) {
+                    entry.vertex = v;
+                    entry.index = index;
+                    ++m_size;
+                    return index;
+                } else if (entry.vertex == v) {
+                    return entry.index;
+                }
+            }
+        }
+
+    private:
+        static const uint32_t Empty = (uint32_t) -1;
+
+        struct Entry {
+            OBJVertex vertex;
+            uint32_t index = Empty;
+        };
+
+        /// Hash all 96 bits of the key (based on the MurmurHash3 finalizer)
+        static size_t hash(const OBJVertex &v) {
+            uint64_t h = (((uint64_t) v.p << 32) | v.uv) * 0x9e3779b97f4a7c15ull;
+            h ^= (uint64_t) v.n * 0xc2b2ae3d27d4eb4full;
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ull;
+            h ^= h >> 33;
+            return (size_t) h;
         }
+
+        /// Double the capacity of the table
+        void grow() {
+            std::vector<Entry> entries(m_entries.size() * 2);
+            m_entries.swap(entries);
+            m_mask = m_entries.size() - 1;
+            for (const Entry &entry : entries) {
+                if (entry.index == Empty)
+                    continue;
+                size_t i = hash(entry.vertex) & m_mask;
+                while (m_entries[i].index != Empty)
+                    i = (i + 1) & m_mask;
+                m_entries[i] = entry;
+            }
+        }
+
+        std::vector<Entry> m_entries;
+        size_t m_mask;
+        size_t m_size = 0;
     };
+
+    /// Contents of a range of lines of the file
+    struct Chunk {
+        std::vector<Vector3f>  positions;
+        std::vector<Vector2f>  texcoords;
+        std::vector<Vector3f>  normals;
+        std::vector<OBJVertex> vertices; ///< Vertices of the faces (split into triangles)
+        BoundingBox3f bbox;              ///< Bounds of the positions
+        std::string error;               ///< Parse error (if any)
+    };
+
+    /// Parse the lines in <tt>[begin, end)</tt>
+    static void parseChunk(const char *begin, const char *end, const Transform &trafo, Chunk &chunk) {
+        try {
+            while (begin != end) {
+                const char *lineEnd = (const char *) memchr(begin, '\n', (size_t) (end - begin));
+                if (!lineEnd)
+                    lineEnd = end;
+                OBJTokenizer line(begin, lineEnd);
+                begin = lineEnd == end ? end : lineEnd + 1;
+
+                const char *prefix, *prefixEnd;
+                line.next(prefix, prefixEnd);
+                size_t length = (size_t) (prefixEnd - prefix);
+
+                if (length == 1 && prefix[0] == 'v') {
+                    Point3f p;
+                    p.x() = line.nextFloat();
+                    p.y() = line.nextFloat();
+                    p.z() = line.nextFloat();
+                    p = trafo * p;
+                    chunk.bbox.expandBy(p);
+                    chunk.positions.push_back(p);
+                } else if (length == 2 && prefix[0] == 'v' && prefix[1] == 't') {
+                    Point2f tc;
+                    tc.x() = line.nextFloat();
+                    tc.y() = line.nextFloat();
+                    chunk.texcoords.push_back(tc);
+                } else if (length == 2 && prefix[0] == 'v' && prefix[1] == 'n') {
+                    Normal3f n;
+                    n.x() = line.nextFloat();
+                    n.y() = line.nextFloat();
+                    n.z() = line.nextFloat();
+                    chunk.normals.push_back((trafo * n).normalized());
+                } else if (length == 1 && prefix[0] == 'f') {
+                    OBJVertex verts[6];
+                    int nVertices = 3;
+
+                    const char *token, *tokenEnd;
+                    for (int i = 0; i < 3; ++i) {
+                        line.next(token, tokenEnd);
+                        verts[i] = OBJVertex(token, tokenEnd);
+                    }
+
+                    line.next(token, tokenEnd);
+                    if (token != tokenEnd) {
+                        /* This is a quad, split into two triangles */
+                        verts[3] = OBJVertex(token, tokenEnd);
+                        verts[4] = verts[0];
+                        verts[5] = verts[2];
+                        nVertices = 6;
+                    }
+                    chunk.vertices.insert(chunk.vertices.end(), verts, verts + nVertices);
+                }
+            }
+        } catch (const NoriException &e) {
+            chunk.error = e.what();
+        }
+    }
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -0,0 +1,75 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/nmesh.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <memory>
+
+/*
+ * Converts Wavefront OBJ files into Nori's binary mesh format, which
+ * can be loaded much faster using <mesh type="nmesh">.
+ */
+
+using namespace nori;
+
+int main(int argc, char **argv) {
+    bool compress = false;
+    std::vector<std::string> filenames;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string token(argv[i]);
+        if (token == "-c" || token == "--compress")
+            compress = true;
+        else
+            filenames.push_back(token);
+    }
+
+    if (filenames.empty() || filenames.size() > 2) {
+        cerr << "Syntax: " << argv[0] << " [--compress] <mesh.obj> [mesh.nmesh]" << endl;
+        return -1;
+    }
+
+    filesystem::path path(filenames[0]);
+    if (path.extension() != "obj") {
+        cerr << "Fatal error: unknown file \"" << filenames[0]
+             << "\", expected an extension of type .obj" << endl;
+        return -1;
+    }
+
+    std::string outputName = filenames.size() > 1 ? filenames[1]
+        : filenames[0].substr(0, filenames[0].size() - 4) + ".nmesh";
+
+    try {
+        PropertyList propList;
+        propList.setString("filename", filenames[0]);
+        std::unique_ptr<Mesh> mesh(static_cast<Mesh *>(
+            NoriObjectFactory::createInstance("obj", propList)));
+
+        cout << "Writing \"" << outputName << "\" .. ";
+        cout.flush();
+        Timer timer;
+        saveNMesh(mesh.get(), outputName, compress);
+        cout << "done. (took " << timer.elapsedString() << ")" << endl;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <pcg32.h>
+#include <fstream>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+
+/*
+ * Checks that the OBJ loader produces the same mesh regardless of how it
+ * reads the file: every file is loaded through a stream (as a single chunk)
+ * and compared bit by bit against memory-mapped loads that are split into
+ * chunks of many different sizes, so that the chunk boundaries fall into the
+ * middle of all kinds of lines. Without arguments, a test file is generated
+ * that mixes line endings (LF and CRLF), comments, blank lines, tabs, and
+ * floats with exponents. Its vertex attributes must also parse to exactly
+ * the values that were written.
+ */
+
+using namespace nori;
+
+/// Chunk sizes (in bytes) of the memory-mapped loads
+static const int chunkSizes[] = { 1, 2, 3, 5, 7, 11, 16, 31, 64, 100, 257, 1000, 4096 };
+
+/// Vertex attributes that were written to the generated test file
+struct Expected {
+    MatrixXf V, N, UV;
+};
+
+/// Format a float such that it parses to the same value, using an exponent every now and then
+static std::string formatFloat(float value, pcg32 &rng) {
+    char buffer[64];
+    switch (rng.nextUInt(4)) {
+        case 0: snprintf(buffer, sizeof(buffer), "%.9e", value); break;
+        case 1: snprintf(buffer, sizeof(buffer), "%.9E", value); break;
+        default: snprintf(buffer, sizeof(buffer), "%.9g", value); break;
+    }
+    return buffer;
+}
+
+/// Write an OBJ file with one vertex per face corner (in order) and varied formatting
+static Expected generate(const std::string &filename, uint32_t triangleCount) {
+    pcg32 rng;
+    Expected expected;
+    uint32_t vertexCount = 3 * triangleCount;
+    expected.V.resize(3, vertexCount);
+    expected.N.resize(3, vertexCount);
+    expected.UV.resize(2, vertexCount);
+
+    std::ofstream os(filename, std::ios::binary);
+    auto endLine = [&]() { os << (rng.nextUInt(2) ? "\r\n" : "\n"); };
+    auto separator = [&]() { return rng.nextUInt(4) == 0 ? "\t" : " "; };
+
+    os << "# Generated by objtest";
+    endLine();
+    for (uint32_t i = 0; i < vertexCount; ++i) {
+        /* Magnitudes from 1e-6 to 1e6, so that both parsing paths are used */
+        Vector3f p, n;
+        for (int k = 0; k < 3; ++k) {
+            p[k] = (rng.nextFloat() - 0.5f) * std::pow(10.0f, (float) rng.nextUInt(13) - 6.0f);
+            n[k] = rng.nextFloat() - 0.5f;
+        }
+        n.normalize();
+        Vector2f uv(rng.nextFloat(), rng.nextFloat());
+        expected.V.col(i) = p;
+        expected.N.col(i) = n;
+        expected.UV.col(i) = uv;
+
+        os << "v";
+        for (int k = 0; k < 3; ++k)
+            os << separator() << formatFloat(p[k], rng);
+        endLine();
+        os << "vn";
+        for (int k = 0; k < 3; ++k)
+            os << separator() << formatFloat(n[k], rng);
+        endLine();
+        os << "vt " << formatFloat(uv[0], rng) << " " << formatFloat(uv[1], rng);
+        endLine();
+        if (rng.nextUInt(8) == 0) {
+            os << (rng.nextUInt(2) ? "# comment" : "");
+            endLine();
+        }
+    }
+    for (uint32_t i = 0; i < triangleCount; ++i) {
+        os << "f";
+        for (uint32_t k = 0; k < 3; ++k) {
+            uint32_t idx = 3 * i + k + 1;
+            os << separator() << idx << "/" << idx << "/" << idx;
+        }
+        endLine();
+    }
+
+    if (os.fail())
+        throw NoriException("Unable to write \"%s\"!", filename);
+    return expected;
+}
+
+/// Load an OBJ file using the given options
+static std::unique_ptr<Mesh> load(const std::string &filename, bool mapFile, int chunkSize) {
+    PropertyList propList;
+    propList.setString("filename", filename);
+    propList.setBoolean("mapFile", mapFile);
+    propList.setInteger("chunkSize", chunkSize);
+    return std::unique_ptr<Mesh>(static_cast<Mesh *>(
+        NoriObjectFactory::createInstance("obj", propList)));
+}
+
+/// Check whether two matrices have the same size and bitwise identical contents
+template <typename MatrixA, typename MatrixB> static bool identical(const MatrixA &a, const MatrixB &b) {
+    return a.rows() == b.rows() && a.cols() == b.cols() &&
+        (a.size() == 0 || memcmp(a.data(), b.data(), sizeof(a(0, 0)) * a.size()) == 0);
+}
+
+/// Compare all buffers (and the bounding boxes) of two meshes
+static bool identicalMeshes(const Mesh *a, const Mesh *b) {
+    return identical(a->getVertexPositions(), b->getVertexPositions()) &&
+           identical(a->getVertexNormals(), b->getVertexNormals()) &&
+           identical(a->getVertexTexCoords(), b->getVertexTexCoords()) &&
+           identical(a->getIndices(), b->getIndices()) &&
+           a->getBoundingBox().min == b->getBoundingBox().min &&
+           a->getBoundingBox().max == b->getBoundingBox().max;
+}
+
+/// Compare the loads of a file and return the number of mismatches
+static int check(const std::string &filename, const Expected *expected) {
+    cout << "Checking \"" << filename << "\" .." << endl;
+    std::unique_ptr<Mesh> reference = load(filename, false, std::numeric_limits<int>::max());
+    int mismatches = 0;
+
+    if (expected) {
+        /* Normals are normalized by the loader, hence only up to rounding */
+        bool valid = identical(reference->getVertexPositions(), expected->V) &&
+                     identical(reference->getVertexTexCoords(), expected->UV) &&
+                     reference->getVertexNormals().cols() == expected->N.cols() &&
+                     (reference->getVertexNormals() - expected->N).cwiseAbs().maxCoeff() < 1e-6f;
+        if (!valid) {
+            cout << "  The vertex attributes differ from the values that were written!" << endl;
+            ++mismatches;
+        }
+    }
+
+    std::vector<int> sizes(std::begin(chunkSizes), std::end(chunkSizes));
+    sizes.push_back(std::numeric_limits<int>::max());
+    for (int chunkSize : sizes) {
+        std::unique_ptr<Mesh> mesh = load(filename, true, chunkSize);
+        if (!identicalMeshes(mesh.get(), reference.get())) {
+            cout << "  The memory-mapped load with chunks of " << chunkSize
+                 << " bytes differs from the stream!" << endl;
+            ++mismatches;
+        }
+    }
+
+    return mismatches;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && (std::string(argv[1]) == "-h" || std::string(argv[1]) == "--help")) {
+        cerr << "Syntax: " << argv[0] << " [mesh.obj ...]" << endl;
+        return -1;
+    }
+
+    int mismatches = 0;
+    try {
+        if (argc == 1) {
+            std::string filename = "objtest.obj";
+            Expected expected = generate(filename, 200);
+            mismatches += check(filename, &expected);
+            std::remove(filename.c_str());
+        }
+        for (int i = 1; i < argc; ++i)
+            mismatches += check(argv[i], nullptr);
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+
+    if (mismatches > 0) {
+        cout << mismatches << " load(s) differ!" << endl;
+        return -1;
+    }
+    cout << "All loads are identical." << endl;
+    return 0;
+}
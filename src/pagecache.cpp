@@ -0,0 +1,236 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/pagecache.h>
+#include <cstring>
+
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+PageCache::PageCache(size_t size, size_t pageSize, size_t budget, const std::string &directory)
+    : m_size(size), m_pageSize(pageSize) {
+    if (size == 0 || pageSize == 0 || (pageSize & (pageSize - 1)) != 0)
+        throw NoriException("PageCache: invalid file size (%i) or page size (%i)!", size, pageSize);
+
+    m_pageShift = 0;
+    while (((size_t) 1 << m_pageShift) < pageSize)
+        ++m_pageShift;
+    m_pageCount = (size + pageSize - 1) / pageSize;
+    m_maxResident = std::max(budget / pageSize, (size_t) 1);
+    m_state.reset(new std::atomic<uint8_t>[m_pageCount]);
+    for (size_t i = 0; i < m_pageCount; ++i)
+        m_state[i].store(0, std::memory_order_relaxed);
+
+#if defined(PLATFORM_WINDOWS)
+    char tempDir[MAX_PATH], filename[MAX_PATH];
+    if (directory.empty() && GetTempPathA(MAX_PATH, tempDir) == 0)
+        throw NoriException("PageCache: could not determine the temporary directory!");
+    if (GetTempFileNameA(directory.empty() ? tempDir : directory.c_str(), "nori", 0, filename) == 0)
+        throw NoriException("PageCache: could not create a temporary file in \"%s\"!",
+                            directory.empty() ? tempDir : directory);
+
+    HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw NoriException("PageCache: could not open the temporary file \"%s\"!", filename);
+    m_file = file;
+
+    LARGE_INTEGER fileSize;
+    fileSize.QuadPart = (LONGLONG) size;
+    HANDLE mapping = nullptr;
+    if (SetFilePointerEx(file, fileSize, nullptr, FILE_BEGIN) && SetEndOfFile(file))
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+    if (mapping) {
+        m_data = (uint8_t *) MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        CloseHandle(mapping);
+    }
+    if (!m_data) {
+        CloseHandle(file);
+        throw NoriException("PageCache: could not map the temporary file \"%s\" (%s)!",
+                            filename, memString(size));
+    }
+#else
+    std::string dir = directory;
+    if (dir.empty())
+        dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    std::string filename = dir + "/nori-pages-XXXXXX";
+    m_file = mkstemp(&filename[0]);
+    if (m_file == -1)
+        throw NoriException("PageCache: could not create a temporary file in \"%s\": %s",
+                            dir, strerror(errno));
+
+    /* The file disappears as soon as it is closed */
+    unlink(filename.c_str());
+
+    void *data = MAP_FAILED;
+    if (ftruncate(m_file, (off_t) size) == 0)
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+    if (data == MAP_FAILED) {
+        int error = errno;
+        close(m_file);
+        throw NoriException("PageCache: could not map a temporary file of %s in \"%s\": %s",
+                            memString(size), dir, strerror(error));
+    }
+    m_data = (uint8_t *) data;
+#endif
+}
+
+PageCache::~PageCache() {
+#if defined(PLATFORM_WINDOWS)
+    UnmapViewOfFile(m_data);
+    CloseHandle((HANDLE) m_file);
+#else
+    munmap(m_data, m_size);
+    close(m_file);
+#endif
+}
+
+void PageCache::write(size_t offset, const void *data, size_t size) {
+    if (offset + size > m_size)
+        throw NoriException("PageCache::write(): out of bounds!");
+    const char *ptr = (const char *) data;
+
+#if defined(PLATFORM_WINDOWS)
+    while (size > 0) {
+        DWORD chunk = (DWORD) std::min(size, (size_t) 1 << 30), written = 0;
+        OVERLAPPED overlapped = { };
+        overlapped.Offset = (DWORD) offset;
+        overlapped.OffsetHigh = (DWORD) ((uint64_t) offset >> 32);
+        if (!WriteFile((HANDLE) m_file, ptr, chunk, &written, &overlapped) || written == 0)
+            throw NoriException("PageCache::write(): could not write to the temporary file!");
+        ptr += written;
+        offset += written;
+        size -= written;
+    }
+#else
+    while (size > 0) {
+        ssize_t written = pwrite(m_file, ptr, size, (off_t) offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            throw NoriException("PageCache::write(): could not write to the temporary file: %s",
+                                strerror(errno));
+        ptr += written;
+        offset += (size_t) written;
+        size -= (size_t) written;
+    }
+#endif
+}
+
+void PageCache::touch(const size_t *pages, size_t count) const {
+    for (size_t i = 0; i < count; ++i) {
+        if (!mark(pages[i])) {
+            /* Load this and the remaining pages at once */
+            fault(pages + i, count - i);
+            return;
+        }
+    }
+}
+
+void PageCache::fault(size_t first, size_t last) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t page = first; page <= last; ++page)
+        load(page);
+    evict();
+}
+
+void PageCache::fault(const size_t *pages, size_t count) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < count; ++i)
+        load(pages[i]);
+    evict();
+}
+
+void PageCache::load(size_t page) const {
+    if (m_state[page].load(std::memory_order_relaxed) & EResident) {
+        /* Already resident, or loaded by another thread in the meantime */
+        m_state[page].store(EResident | EReferenced, std::memory_order_relaxed);
+        ++m_hits.local();
+        return;
+    }
+
+    m_state[page].store(EResident | EReferenced, std::memory_order_relaxed);
+    ++m_resident;
+    ++m_misses;
+}
+
+void PageCache::evict() const {
+    /* CLOCK algorithm: the hand sweeps over the pages and releases the first
+       one that was not referenced since the previous sweep. Referenced pages
+       receive a second chance. The sweep ends after two rounds at the latest */
+    while (m_resident > m_maxResident) {
+        size_t victim = m_clockHand;
+        m_clockHand = (m_clockHand + 1) % m_pageCount;
+
+        uint8_t state = m_state[victim].load(std::memory_order_relaxed);
+        if (state & EReferenced) {
+            m_state[victim].store(EResident, std::memory_order_relaxed);
+        } else if (state & EResident) {
+            m_state[victim].store(0, std::memory_order_relaxed);
+            release(victim);
+            --m_resident;
+            ++m_evictions;
+        }
+    }
+}
+
+void PageCache::release(size_t page) const {
+    size_t offset = page * m_pageSize;
+    size_t size = std::min(m_pageSize, m_size - offset);
+
+#if defined(PLATFORM_WINDOWS)
+    /* Unlocking pages that are not locked removes them from the working set */
+    VirtualUnlock(m_data + offset, size);
+#else
+    /* Drop the page from the address space. It stays in the file system
+       cache for now, and its next access maps it again (or reads it from
+       the file, if the operating system needed the memory elsewhere) */
+    madvise(m_data + offset, size, MADV_DONTNEED);
+#endif
+}
+
+PageCache::Statistics PageCache::getStatistics() const {
+    Statistics stats;
+    stats.hits = m_hits.combine([](uint64_t a, uint64_t b) { return a + b; });
+    std::lock_guard<std::mutex> lock(m_mutex);
+    stats.misses = m_misses;
+    stats.evictions = m_evictions;
+    stats.resident = m_resident;
+    return stats;
+}
+
+std::string PageCache::toString() const {
+    Statistics stats = getStatistics();
+    uint64_t accesses = std::max(stats.hits + stats.misses, (uint64_t) 1);
+    return tfm::format(
+        "PageCache[size = %s, pages = %i, budget = %i pages, resident = %i pages, "
+        "accesses = %i, hits = %.2f%%, loads = %i, evictions = %i]",
+        memString(m_size), m_pageCount, m_maxResident, stats.resident,
+        stats.hits + stats.misses, 100.0 * stats.hits / accesses,
+        stats.misses, stats.evictions);
+}
+
+NORI_NAMESPACE_END
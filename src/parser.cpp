@@ -18,14 +18,19 @@
 
 #include <nori/parser.h>
 #include <nori/proplist.h>
+#include <nori/scene.h>
+#include <nori/snapshot.h>
 #include <Eigen/Geometry>
 #include <pugixml.hpp>
+#include <tbb/task_group.h>
+#include <algorithm>
+#include <exception>
 #include <fstream>
 #include <set>
 
 NORI_NAMESPACE_BEGIN
 
-NoriObject *loadFromXML(const std::string &filename) {
+NoriObject *loadFromXML(const std::string &filename, bool useSnapshot) {
     /* Load the XML file using 'pugi' (a tiny self-contained XML parser implemented in C++) */
     pugi::xml_document doc;
     pugi::xml_parse_result result = doc.load_file(filename.c_str());
@@ -53,6 +58,29 @@ NoriObject *loadFromXML(const std::string &filename) {
     if (!result) /* There was a parser / file IO error */
         throw NoriException("Error while parsing \"%s\": %s (at %s)", filename, result.description(), offset(result.offset));
 
+    /* Look for a snapshot of the meshes and the acceleration data structure
+       that was created by a previous run (keyed by the scene description
+       and all files referenced by it) */
+    std::unique_ptr<Snapshot> snapshot;
+    if (useSnapshot) {
+        std::vector<std::string> files;
+        std::function<void(const pugi::xml_node &)> findFiles = [&](const pugi::xml_node &node) {
+            if (strcmp(node.name(), "string") == 0 && strcmp(node.attribute("name").value(), "filename") == 0)
+                files.push_back(node.attribute("value").value());
+            for (const pugi::xml_node &ch : node.children())
+                findFiles(ch);
+        };
+        findFiles(doc);
+
+        std::string snapshotName = filename;
+        size_t lastdot = snapshotName.find_last_of(".");
+        if (lastdot != std::string::npos)
+            snapshotName.erase(lastdot, std::string::npos);
+        snapshotName += ".snapshot";
+
+        snapshot.reset(new Snapshot(snapshotName, Snapshot::computeKey(filename, files)));
+    }
+
     /* Set of supported XML tags */
     enum ETag {
         /* Object classes */
@@ -67,6 +95,8 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EAccel                = NoriObject::EAccel,
+        EInstance             = NoriObject::EInstance,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -83,6 +113,9 @@ NoriObject *loadFromXML(const std::string &filename) {
         EScale,
         ELookAt,
 
+        /* Reference to a previously declared object */
+        ERef,
+
         EInvalid
     };
 
@@ -99,6 +132,9 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["accel"]      = EAccel;
+    tags["instance"]   = EInstance;
+    tags["ref"]        = ERef;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -129,9 +165,68 @@ NoriObject *loadFromXML(const std::string &filename) {
 
     Eigen::Affine3f transform;
 
+    /* An object of the scene description. Meshes are constructed (i.e. loaded
+       from disk) by TBB tasks, hence several of them are loaded in parallel
+       while the rest of the file is parsed. The parent of a mesh waits for
+       it right before the parent itself is instantiated */
+    struct ParsedObject {
+        NoriObject *object = nullptr; ///< The object (once it is constructed)
+        tbb::task_group task;         ///< Task that constructs a mesh
+        std::exception_ptr error;     ///< Error raised by the task
+        int tag = EInvalid;           ///< Tag of the element (checked by <ref>)
+
+        /// Wait until the object is constructed and return it
+        NoriObject *get() {
+            task.wait();
+            if (error)
+                std::rethrow_exception(error);
+            return object;
+        }
+    };
+    std::vector<std::unique_ptr<ParsedObject>> objects;
+
+    /* Meshes in the order of their declaration (as recorded by snapshots) */
+    std::vector<ParsedObject *> meshes;
+
+    /* Acceleration data structure of the scene, which is instantiated before
+       the meshes so that they can build their bottom-level hierarchies as
+       soon as they are loaded (see \ref Accel::buildMesh()) */
+    Accel *sceneAccel = nullptr;
+
+    /* Objects that were declared with an 'id' attribute */
+    std::map<std::string, ParsedObject *> ids;
+
+    /* Helper function to instantiate an object and register its children */
+    auto createObject = [&](const std::string &type, int tag, const PropertyList &propList,
+                            const std::vector<NoriObject *> &children) {
+        NoriObject *result;
+        if (tag == EMesh && snapshot && snapshot->isLoaded()) {
+            /* Restore the mesh buffers from the snapshot instead */
+            result = snapshot->loadMesh();
+        } else {
+            result = NoriObjectFactory::createInstance(type, propList);
+        }
+
+        if (result->getClassType() != (int) tag) {
+            throw NoriException(
+                "Unexpectedly constructed an object "
+                "of type <%s> (expected type <%s>): %s",
+                NoriObject::classTypeName(result->getClassType()),
+                NoriObject::classTypeName((NoriObject::EClassType) tag),
+                result->toString());
+        }
+
+        /* Add all children */
+        for (auto ch: children) {
+            result->addChild(ch);
+            ch->setParent(result);
+        }
+        return result;
+    };
+
     /* Helper function to parse a Nori XML node (recursive) */
-    std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
-        pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
+    std::function<ParsedObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
+        pugi::xml_node &node, PropertyList &list, int parentTag) -> ParsedObject * {
         /* Skip over comments */
         if (node.type() == pugi::node_comment || node.type() == pugi::node_declaration)
             return nullptr;
@@ -152,6 +247,7 @@ NoriObject *loadFromXML(const std::string &filename) {
         bool hasParent            = parentTag != EInvalid;
         bool parentIsObject       = hasParent && parentTag < NoriObject::EClassTypeCount;
         bool currentIsObject      = tag < NoriObject::EClassTypeCount;
+        bool currentIsRef         = tag == ERef;
         bool parentIsTransform    = parentTag == ETransform;
         bool currentIsTransformOp = tag == ETranslate || tag == ERotate || tag == EScale || tag == ELookAt || tag == EMatrix;
 
@@ -168,47 +264,113 @@ NoriObject *loadFromXML(const std::string &filename) {
             throw NoriException("Error while parsing \"%s\": node \"%s\" requires a Nori object as parent (at %s)",
                                 filename, node.name(), offset(node.offset_debug()));
 
+        if (currentIsRef) {
+            /* Hand the referenced object to the parent once more */
+            check_attributes(node, { "id" });
+            auto it = ids.find(node.attribute("id").value());
+            if (it == ids.end())
+                throw NoriException("Error while parsing \"%s\": reference to unknown object \"%s\" (at %s)",
+                                    filename, node.attribute("id").value(), offset(node.offset_debug()));
+
+            /* Only meshes can be shared, and only by instances (e.g. a mesh that is
+               added to the scene twice would enter its hierarchy twice, and other
+               objects would be released by more than one parent) */
+            if (parentTag != EInstance || it->second->tag != EMesh)
+                throw NoriException("Error while parsing \"%s\": <ref> can only be used within an <instance> "
+                                    "to refer to a mesh (at %s)",
+                                    filename, offset(node.offset_debug()));
+            return it->second;
+        }
+
         if (tag == EScene)
             node.append_attribute("type") = "scene";
+        else if (tag == EInstance && !node.attribute("type"))
+            node.append_attribute("type") = "instance";
         else if (tag == ETransform)
             transform.setIdentity();
 
+        /* The acceleration data structure of a scene is parsed first */
+        auto range = node.children();
+        std::vector<pugi::xml_node> childNodes(range.begin(), range.end());
+        if (tag == EScene)
+            std::stable_partition(childNodes.begin(), childNodes.end(),
+                [](const pugi::xml_node &ch) { return strcmp(ch.name(), "accel") == 0; });
+
         PropertyList propList;
-        std::vector<NoriObject *> children;
-        for (pugi::xml_node &ch: node.children()) {
-            NoriObject *child = parseTag(ch, propList, tag);
+        std::vector<ParsedObject *> children;
+        for (pugi::xml_node &ch: childNodes) {
+            ParsedObject *child = parseTag(ch, propList, tag);
             if (child)
                 children.push_back(child);
         }
 
-        NoriObject *result = nullptr;
+        /* Wait for the meshes among the children (their errors already refer to their own tags) */
+        std::vector<NoriObject *> childObjects;
+        for (ParsedObject *child : children)
+            childObjects.push_back(child->get());
+
+        ParsedObject *result = nullptr;
         try {
             if (currentIsObject) {
-                check_attributes(node, { "type" });
-
-                /* This is an object, first instantiate it */
-                result = NoriObjectFactory::createInstance(
-                    node.attribute("type").value(),
-                    propList
-                );
-
-                if (result->getClassType() != (int) tag) {
-                    throw NoriException(
-                        "Unexpectedly constructed an object "
-                        "of type <%s> (expected type <%s>): %s",
-                        NoriObject::classTypeName(result->getClassType()),
-                        NoriObject::classTypeName((NoriObject::EClassType) tag),
-                        result->toString());
+                if (node.attribute("id"))
+                    check_attributes(node, { "type", "id" });
+                else
+                    check_attributes(node, { "type" });
+
+                objects.emplace_back(new ParsedObject());
+                result = objects.back().get();
+                result->tag = tag;
+                std::string type = node.attribute("type").value();
+
+                if (tag == EMesh && !(snapshot && snapshot->isLoaded())) {
+                    /* Load the mesh in a separate task, and build its
+                       bottom-level hierarchy right away if it receives one */
+                    Accel *accel = sceneAccel && (parentTag == EInstance ||
+                        sceneAccel->hasMeshHierarchies()) ? sceneAccel : nullptr;
+                    ptrdiff_t position = node.offset_debug();
+                    meshes.push_back(result);
+                    result->task.run([&, result, type, tag, propList, childObjects, accel, position] {
+                        try {
+                            NoriObject *mesh = createObject(type, tag, propList, childObjects);
+                            mesh->activate();
+                            if (accel)
+                                accel->buildMesh(static_cast<Mesh *>(mesh));
+                            result->object = mesh;
+                        } catch (const NoriException &e) {
+                            result->error = std::make_exception_ptr(NoriException(
+                                "Error while parsing \"%s\": %s (at %s)", filename, e.what(), offset(position)));
+                        } catch (...) {
+                            result->error = std::current_exception();
+                        }
+                    });
+                } else {
+                    /* This is an object, first instantiate it */
+                    NoriObject *object = createObject(type, tag, propList, childObjects);
+
+                    /* The meshes (and the scene's acceleration data structure)
+                       are written to or restored from the snapshot */
+                    if (tag == EScene && snapshot) {
+                        if (!snapshot->isLoaded()) {
+                            for (ParsedObject *mesh : meshes)
+                                snapshot->addMesh(static_cast<Mesh *>(mesh->get()));
+                        }
+                        static_cast<Scene *>(object)->setSnapshot(snapshot.get());
+                    }
+
+                    /* Activate / configure the object */
+                    object->activate();
+                    if (tag == EAccel && parentTag == EScene)
+                        sceneAccel = static_cast<Accel *>(object);
+                    result->object = object;
                 }
 
-                /* Add all children */
-                for (auto ch: children) {
-                    result->addChild(ch);
-                    ch->setParent(result);
+                /* Make the object available to later <ref> tags */
+                if (node.attribute("id")) {
+                    std::string id = node.attribute("id").value();
+                    if (ids.find(id) != ids.end())
+                        throw NoriException("Duplicate object id \"%s\"", id);
+                    ids[id] = result;
                 }
-
-                /* Activate / configure the object */
-                result->activate();
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -313,7 +475,14 @@ NoriObject *loadFromXML(const std::string &filename) {
     };
 
     PropertyList list;
-    return parseTag(*doc.begin(), list, EInvalid);
+    try {
+        return parseTag(*doc.begin(), list, EInvalid)->get();
+    } catch (...) {
+        /* Let the remaining tasks finish before their state is released */
+        for (const std::unique_ptr<ParsedObject> &object : objects)
+            object->task.wait();
+        throw;
+    }
 }
 
 NORI_NAMESPACE_END
@@ -0,0 +1,536 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvhbuilder.h>
+#include <nori/stats.h>
+#include <nori/simd.h>
+#include <bitset>
+
+NORI_NAMESPACE_BEGIN
+
+/* Parameters of the ray stream traversal */
+#define BVH_STREAM_SIZE        1024   /* Rays of a stream that are traversed together */
+#define BVH_STREAM_ORIGIN_BITS 9      /* Bits per axis of the ray origin sort key */
+
+/**
+ * \brief SoA copy of a packet of rays that are traversed together
+ *
+ * The rays are processed in SIMD groups of four. Unused lanes receive an
+ * empty ray segment, so that they never intersect anything. When the
+ * direction components of all rays agree in sign along every axis, the
+ * packet additionally records intervals bounding the ray origins and
+ * reciprocal directions, which are used to cull nodes conservatively.
+ */
+struct Accel::RayPacket {
+    typedef SimdFloat<4> Float4;
+
+    float o[3][NORI_PACKET_SIZE];
+    float d[3][NORI_PACKET_SIZE];
+    float rcp[3][NORI_PACKET_SIZE];
+    float mint[NORI_PACKET_SIZE];
+    float maxt[NORI_PACKET_SIZE];
+    float u[NORI_PACKET_SIZE];
+    float v[NORI_PACKET_SIZE];
+    uint32_t f[NORI_PACKET_SIZE];
+    PacketRay shear[NORI_PACKET_SIZE];
+    uint32_t count, groups, valid;
+
+    bool coherent;
+    float oMin[3], oMax[3];
+    float rcpMin[3], rcpMax[3];
+    float minMint;
+
+    RayPacket(const Ray3f *rays, uint32_t count)
+        : count(count), groups((count + 3) / 4), valid((1u << count) - 1) {
+        coherent = count > 0;
+        minMint = std::numeric_limits<float>::infinity();
+
+        for (int axis = 0; axis < 3; ++axis) {
+            oMin[axis] = rcpMin[axis] = std::numeric_limits<float>::infinity();
+            oMax[axis] = rcpMax[axis] = -std::numeric_limits<float>::infinity();
+        }
+
+        for (uint32_t i = 0; i < NORI_PACKET_SIZE; ++i) {
+            f[i] = (uint32_t) -1;
+            u[i] = v[i] = 0.0f;
+
+            if (i >= count) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    o[axis][i] = 0.0f;
+                    d[axis][i] = rcp[axis][i] = 1.0f;
+                }
+                mint[i] = std::numeric_limits<float>::infinity();
+                maxt[i] = -std::numeric_limits<float>::infinity();
+                continue;
+            }
+
+            const Ray3f &ray = rays[i];
+            for (int axis = 0; axis < 3; ++axis) {
+                /* Avoid infinite reciprocals (see \ref SlabRay) */
+                float dv = ray.d[axis];
+                if (std::abs(dv) < 1e-20f)
+                    dv = std::copysign(1e-20f, dv);
+                o[axis][i] = ray.o[axis];
+                d[axis][i] = ray.d[axis];
+                rcp[axis][i] = 1.0f / dv;
+
+                oMin[axis] = std::min(oMin[axis], o[axis][i]);
+                oMax[axis] = std::max(oMax[axis], o[axis][i]);
+                rcpMin[axis] = std::min(rcpMin[axis], rcp[axis][i]);
+                rcpMax[axis] = std::max(rcpMax[axis], rcp[axis][i]);
+            }
+            shear[i] = PacketRay(ray);
+            mint[i] = ray.mint;
+            maxt[i] = ray.maxt;
+            minMint = std::min(minMint, ray.mint);
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (rcpMin[axis] < 0 && rcpMax[axis] > 0)
+                coherent = false;
+        }
+    }
+
+    /// Largest remaining ray segment end of the given rays
+    float maxMaxt(uint32_t active) const {
+        float result = -std::numeric_limits<float>::infinity();
+        for (uint32_t i = 0; i < count; ++i) {
+            if (active & (1u << i))
+                result = std::max(result, maxt[i]);
+        }
+        return result;
+    }
+
+    /**
+     * \brief Conservatively check whether all rays of a coherent packet
+     * miss the given bounding box
+     *
+     * Computes a lower bound of the entry distance and an upper bound of
+     * the exit distance of every ray in the packet using interval
+     * arithmetic over the ray origins and reciprocal directions.
+     */
+    bool missesAll(const BoundingBox3f &bbox, float maxt) const {
+        float tNear = minMint, tFar = maxt;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            float lo, hi;
+            if (rcpMin[axis] >= 0) {
+                float a = bbox.min[axis] - oMax[axis];
+                float b = bbox.max[axis] - oMin[axis];
+                lo = a * (a >= 0 ? rcpMin[axis] : rcpMax[axis]);
+                hi = b * (b >= 0 ? rcpMax[axis] : rcpMin[axis]);
+            } else {
+                float a = bbox.max[axis] - oMin[axis];
+                float b = bbox.min[axis] - oMax[axis];
+                lo = a * (a >= 0 ? rcpMin[axis] : rcpMax[axis]);
+                hi = b * (b < 0 ? rcpMin[axis] : rcpMax[axis]);
+            }
+            tNear = std::max(tNear, lo);
+            tFar = std::min(tFar, hi);
+        }
+
+        return tNear > tFar;
+    }
+
+    /// Return a bit mask of the rays (among \c active) that intersect the given bounding box
+    uint32_t intersect(const BoundingBox3f &bbox, uint32_t active) const {
+        uint32_t result = 0;
+
+        for (uint32_t g = 0; g < groups; ++g) {
+            uint32_t groupActive = (active >> (4 * g)) & 0xF;
+            if (!groupActive)
+                continue;
+
+            Float4 tNear = Float4::load(mint + 4 * g), tFar = Float4::load(maxt + 4 * g);
+            for (int axis = 0; axis < 3; ++axis) {
+                Float4 o4 = Float4::load(o[axis] + 4 * g), rcp4 = Float4::load(rcp[axis] + 4 * g);
+                Float4 t0 = (Float4(bbox.min[axis]) - o4) * rcp4;
+                Float4 t1 = (Float4(bbox.max[axis]) - o4) * rcp4;
+                tNear = Float4::max(tNear, Float4::min(t0, t1));
+                tFar = Float4::min(tFar, Float4::max(t0, t1));
+            }
+
+            result |= ((uint32_t) (tNear <= tFar).movemask() & groupActive) << (4 * g);
+        }
+
+        return result;
+    }
+
+    /**
+     * \brief Intersect the given rays with a packet of triangles
+     *
+     * Every ray is tested against all triangles of the packet at once, using
+     * the watertight test of the single-ray traversal (see \ref
+     * TrianglePacket::intersect()). Packets and single rays hence report
+     * exactly the same hits. Closer intersections update the ray segments and
+     * hit information. Returns a bit mask of the rays that intersect one of
+     * the triangles.
+     */
+    template <int Width> uint32_t intersect(const TrianglePacket<Width> &triangles, uint32_t active) {
+        uint32_t result = 0;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!(active & (1u << i)))
+                continue;
+
+            float tValues[Width], uValues[Width], vValues[Width];
+            int bits = triangles.intersect(shear[i], mint[i], maxt[i], tValues, uValues, vValues);
+            if (bits == 0)
+                continue;
+
+            /* Find the closest intersected triangle within the packet */
+            int best = -1;
+            for (int k = 0; k < Width; ++k) {
+                if ((bits & (1 << k)) && tValues[k] <= maxt[i]) {
+                    maxt[i] = tValues[k];
+                    best = k;
+                }
+            }
+            if (best == -1)
+                continue;
+
+            u[i] = uValues[best];
+            v[i] = vValues[best];
+            f[i] = triangles.index[best];
+            result |= 1u << i;
+        }
+
+        return result;
+    }
+
+    /**
+     * \brief Intersect the given rays with a single triangle using a
+     * vectorized version of the Moeller-Trumbore test (see \ref Mesh::rayIntersect())
+     *
+     * Used by hierarchies without triangle packets. The single rays of these
+     * hierarchies evaluate the same test in a different order, hence the
+     * distances can differ from theirs by a few ULPs.
+     *
+     * Closer intersections update the ray segments and hit information.
+     * Returns a bit mask of the rays that intersect the triangle.
+     */
+    uint32_t intersect(const Point3f &p0, const Point3f &p1, const Point3f &p2,
+                       uint32_t index, uint32_t active) {
+        const Vector3f e1 = p1 - p0, e2 = p2 - p0;
+        const Float4 zero(0.0f), one(1.0f);
+        uint32_t result = 0;
+
+        for (uint32_t g = 0; g < groups; ++g) {
+            uint32_t groupActive = (active >> (4 * g)) & 0xF;
+            if (!groupActive)
+                continue;
+
+            const uint32_t k = 4 * g;
+            const Float4 dx = Float4::load(d[0] + k), dy = Float4::load(d[1] + k), dz = Float4::load(d[2] + k);
+
+            /* Begin calculating the determinant -- also used to calculate the U parameter */
+            const Float4 px = dy * Float4(e2.z()) - dz * Float4(e2.y());
+            const Float4 py = dz * Float4(e2.x()) - dx * Float4(e2.z());
+            const Float4 pz = dx * Float4(e2.y()) - dy * Float4(e2.x());
+            const Float4 det = Float4(e1.x()) * px + Float4(e1.y()) * py + Float4(e1.z()) * pz;
+            const Float4 invDet = one / det;
+
+            /* Distance from the first vertex to the ray origins */
+            const Float4 tx = Float4::load(o[0] + k) - Float4(p0.x());
+            const Float4 ty = Float4::load(o[1] + k) - Float4(p0.y());
+            const Float4 tz = Float4::load(o[2] + k) - Float4(p0.z());
+
+            const Float4 u4 = (tx * px + ty * py + tz * pz) * invDet;
+
+            const Float4 qx = ty * Float4(e1.z()) - tz * Float4(e1.y());
+            const Float4 qy = tz * Float4(e1.x()) - tx * Float4(e1.z());
+            const Float4 qz = tx * Float4(e1.y()) - ty * Float4(e1.x());
+
+            const Float4 v4 = (dx * qx + dy * qy + dz * qz) * invDet;
+            const Float4 t4 = (Float4(e2.x()) * qx + Float4(e2.y()) * qy + Float4(e2.z()) * qz) * invDet;
+
+            const Float4 maxt4 = Float4::load(maxt + k);
+            Float4 mask = ((det < Float4(-1e-8f)) | (det > Float4(1e-8f)))
+                & (u4 >= zero) & (u4 <= one) & (v4 >= zero) & (u4 + v4 <= one)
+                & (t4 >= Float4::load(mint + k)) & (t4 <= maxt4);
+
+            uint32_t bits = (uint32_t) mask.movemask() & groupActive;
+            if (!bits)
+                continue;
+
+            Float4::select(mask, t4, maxt4).store(maxt + k);
+            Float4::select(mask, u4, Float4::load(u + k)).store(u + k);
+            Float4::select(mask, v4, Float4::load(v + k)).store(v + k);
+            for (uint32_t i = 0; i < 4; ++i) {
+                if (bits & (1u << i))
+                    f[k + i] = index;
+            }
+            result |= bits << k;
+        }
+
+        return result;
+    }
+};
+
+uint32_t Accel::traversePacket(RayPacket &packet, bool shadowRay) const {
+    uint32_t hits = 0;
+
+    /* Every stack entry records a node and the rays that still need to visit it */
+    struct StackEntry {
+        uint32_t node, active;
+    };
+    StackEntry stack[BVH_MAX_DEPTH + 1];
+    uint32_t stackIdx = 0;
+    stack[stackIdx++] = StackEntry { 0u, packet.valid };
+    float maxt = packet.maxMaxt(packet.valid);
+
+    BVHNode lazyNode; /* Copy of the current node (lazy construction) */
+    while (stackIdx > 0) {
+        StackEntry entry = stack[--stackIdx];
+
+        /* Rays of a shadow ray packet are done once they hit something */
+        uint32_t active = entry.active & ~(shadowRay ? hits : 0u);
+        if (!active)
+            continue;
+
+        const BVHNode &node = m_lazyBuild ? m_lazyNodes.load(entry.node, lazyNode) : m_nodes[entry.node];
+        NORI_STATS(++TraversalStats::query.nodes);
+        if (packet.coherent && packet.missesAll(node.bbox, maxt))
+            continue;
+
+        active = packet.intersect(node.bbox, active);
+        if (!active)
+            continue;
+
+        if (node.isInner()) {
+            /* Visit the child closer to the first active ray first */
+            uint32_t first = 0;
+            while (!(active & (1u << first)))
+                ++first;
+            uint32_t nearChild = node.inner.children, farChild = node.inner.children + 1;
+            if ((packet.d[node.inner.axis][first] < 0) != (bool) node.inner.reversed)
+                std::swap(nearChild, farChild);
+            stack[stackIdx++] = StackEntry { farChild, active };
+            stack[stackIdx++] = StackEntry { nearChild, active };
+            continue;
+        }
+
+        if (m_lazyBuild && node.leaf.unbuilt) {
+            expandNode(entry.node);
+            stack[stackIdx++] = StackEntry { entry.node, active };
+            continue;
+        }
+
+        uint32_t leafHits = 0;
+        if (m_packetWidth > 0) {
+            const TrianglePacket<4> *packets4 = m_packetWidth == 4 ? leafPackets<4>(node.start(), node.end()) : nullptr;
+            const TrianglePacket<8> *packets8 = m_packetWidth == 8 ? leafPackets<8>(node.start(), node.end()) : nullptr;
+            for (uint32_t i = 0; i < node.leaf.size; ++i) {
+                NORI_STATS(++TraversalStats::query.triangles);
+                uint32_t rays = active & ~(shadowRay ? leafHits : 0u);
+                leafHits |= packets4 ? packet.intersect(packets4[i], rays) : packet.intersect(packets8[i], rays);
+            }
+        } else {
+            touchTriangles(m_indices.data() + node.start(), node.leaf.size);
+            for (uint32_t i = node.start(); i < node.end(); ++i) {
+                uint32_t index = m_indices[i], idx = index;
+                const Mesh *mesh = m_meshes[findMesh(idx)];
+                MatrixXfMap V = mesh->getVertexPositionView();
+                MatrixXuMap F = mesh->getIndexView();
+                NORI_STATS(++TraversalStats::query.triangles);
+                leafHits |= packet.intersect(V.col(F(0, idx)), V.col(F(1, idx)), V.col(F(2, idx)),
+                                             index, active & ~(shadowRay ? leafHits : 0u));
+            }
+        }
+
+        if (leafHits) {
+            hits |= leafHits;
+            if (shadowRay && hits == packet.valid)
+                return hits;
+            maxt = packet.maxMaxt(packet.valid & ~(shadowRay ? hits : 0u));
+        }
+    }
+
+    return hits;
+}
+
+uint32_t Accel::rayIntersectPacket(const Ray3f *rays, uint32_t count, Intersection *its,
+                                   bool shadowRay) const {
+    if (count > NORI_PACKET_SIZE)
+        throw NoriException("Accel::rayIntersectPacket(): packets can contain at most %i rays!",
+                            NORI_PACKET_SIZE);
+
+    if (m_width != 2 || !m_instances.empty() || Accel::getNodeCount() == 0) {
+        /* Packets are only supported by the binary hierarchy */
+        uint32_t hits = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (rayIntersect(rays[i], its[i], shadowRay))
+                hits |= 1u << i;
+        }
+        return hits;
+    }
+
+    NORI_STATS(TraversalStats::beginQuery());
+
+    RayPacket packet(rays, count);
+    uint32_t hits = traversePacket(packet, shadowRay);
+    NORI_STATS(TraversalStats::endQuery(count, (uint32_t) std::bitset<32>(hits).count()));
+
+    if (!shadowRay) {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!(hits & (1u << i)))
+                continue;
+            uint32_t f = packet.f[i];
+            its[i].t = packet.maxt[i];
+            its[i].bary = Point2f(packet.u[i], packet.v[i]);
+            its[i].mesh = m_meshes[findMesh(f)];
+            its[i].f = f;
+            its[i].instance = nullptr;
+        }
+    }
+
+    return hits;
+}
+
+uint32_t Accel::intersectStream(const Ray3f *rays, uint32_t count, Intersection *its, bool *hits,
+                                bool shadowRay) const {
+    uint32_t hitCount = 0;
+
+    if (m_width != 2 || !m_instances.empty() || Accel::getNodeCount() == 0) {
+        /* Streams are only supported by the binary hierarchy */
+        for (uint32_t i = 0; i < count; ++i) {
+            hits[i] = rayIntersect(rays[i], its[i], shadowRay);
+            hitCount += hits[i] ? 1 : 0;
+        }
+        return hitCount;
+    }
+
+    NORI_STATS(TraversalStats::beginQuery());
+
+    /* Sort the rays by direction octant, and then along a Morton
+       curve through the ray origins (relative to the scene bounds) */
+    std::vector<uint64_t> keys(count);
+    const float scale = (float) ((1 << BVH_STREAM_ORIGIN_BITS) - 1);
+    const Vector3f invExtents = m_bbox.getExtents().cwiseMax(Vector3f::Constant(Epsilon)).cwiseInverse();
+    for (uint32_t i = 0; i < count; ++i) {
+        const Ray3f &ray = rays[i];
+        uint32_t octant = (ray.d.x() < 0 ? 1 : 0) | (ray.d.y() < 0 ? 2 : 0) | (ray.d.z() < 0 ? 4 : 0);
+        Vector3f p = (ray.o - m_bbox.min).cwiseProduct(invExtents).cwiseMax(Vector3f::Zero())
+                                                                 .cwiseMin(Vector3f::Ones()) * scale;
+        uint32_t morton = (expandBits((uint32_t) p.x()) << 2) | (expandBits((uint32_t) p.y()) << 1) |
+                           expandBits((uint32_t) p.z());
+        keys[i] = ((uint64_t) ((octant << (3 * BVH_STREAM_ORIGIN_BITS)) | morton) << 32) | i;
+    }
+    std::sort(keys.begin(), keys.end());
+
+    /* Per-ray traversal state in sorted order */
+    struct StreamRay {
+        Ray3f ray;
+        PacketRay pray;
+        uint32_t index, f;
+        bool hit;
+
+        StreamRay(const Ray3f &ray, uint32_t index)
+            : ray(ray), pray(ray), index(index), f((uint32_t) -1), hit(false) { }
+    };
+    std::vector<StreamRay> state;
+    state.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t index = (uint32_t) keys[i];
+        state.emplace_back(rays[index], index);
+    }
+
+    /* Every stack entry records a node and a range of the 'active' list,
+       which contains the rays that still need to visit the node */
+    struct StackEntry {
+        uint32_t node, begin, end;
+    } stack[BVH_MAX_DEPTH + 1];
+    uint32_t stackIdx = 0;
+    std::vector<uint32_t> active;
+
+    for (uint32_t start = 0; start < count; ) {
+        /* Trace chunks of rays within the same octant together, so that they
+           visit the children of every node in the same (front-to-back) order */
+        uint32_t octant = (uint32_t) (keys[start] >> (32 + 3 * BVH_STREAM_ORIGIN_BITS)), end = start;
+        while (end < count && end - start < BVH_STREAM_SIZE &&
+               (uint32_t) (keys[end] >> (32 + 3 * BVH_STREAM_ORIGIN_BITS)) == octant)
+            ++end;
+
+        active.clear();
+        for (uint32_t i = start; i < end; ++i)
+            active.push_back(i);
+        stack[stackIdx++] = StackEntry { 0u, 0u, end - start };
+
+        BVHNode lazyNode; /* Copy of the current node (lazy construction) */
+        while (stackIdx > 0) {
+            StackEntry entry = stack[--stackIdx];
+
+            /* Discard the ray lists of subtrees that have already been processed */
+            active.resize(entry.end);
+
+            /* Intersect the node's bounding box with all rays that reached it */
+            const BVHNode &node = m_lazyBuild ? m_lazyNodes.load(entry.node, lazyNode) : m_nodes[entry.node];
+            NORI_STATS(TraversalStats::query.nodes += entry.end - entry.begin);
+            uint32_t first = (uint32_t) active.size();
+            for (uint32_t i = entry.begin; i < entry.end; ++i) {
+                uint32_t r = active[i];
+                if (shadowRay && state[r].hit)
+                    continue; /* Shadow rays are done after the first hit */
+                if (node.bbox.rayIntersect(state[r].ray))
+                    active.push_back(r);
+            }
+            uint32_t last = (uint32_t) active.size();
+            if (first == last)
+                continue;
+
+            if (node.isInner()) {
+                uint32_t nearChild = node.inner.children, farChild = node.inner.children + 1;
+                if (((octant >> node.inner.axis) & 1) != node.inner.reversed)
+                    std::swap(nearChild, farChild);
+                stack[stackIdx++] = StackEntry { farChild, first, last };
+                stack[stackIdx++] = StackEntry { nearChild, first, last };
+                continue;
+            }
+
+            if (m_lazyBuild && node.leaf.unbuilt) {
+                expandNode(entry.node);
+                stack[stackIdx++] = StackEntry { entry.node, first, last };
+                continue;
+            }
+
+            for (uint32_t i = first; i < last; ++i) {
+                StreamRay &sr = state[active[i]];
+                if (intersectLeaf(node.start(), node.end(), sr.pray, sr.ray, its[sr.index], sr.f, shadowRay))
+                    sr.hit = true;
+            }
+        }
+
+        start = end;
+    }
+
+    for (const StreamRay &sr : state) {
+        hits[sr.index] = sr.hit;
+        if (!sr.hit)
+            continue;
+        ++hitCount;
+        if (!shadowRay) {
+            its[sr.index].f = sr.f;
+            its[sr.index].instance = nullptr;
+        }
+    }
+
+    NORI_STATS(TraversalStats::endQuery(count, hitCount));
+    return hitCount;
+}
+
+NORI_NAMESPACE_END
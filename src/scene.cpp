@@ -22,22 +22,42 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
+#include <nori/snapshot.h>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
-}
+Scene::Scene(const PropertyList &) { }
 
 Scene::~Scene() {
     delete m_accel;
     delete m_sampler;
     delete m_camera;
     delete m_integrator;
+    for (Instance *instance : m_instances)
+        delete instance;
 }
 
 void Scene::activate() {
-    m_accel->build();
+    if (!m_accel) {
+        /* Create a default acceleration data structure (binary BVH) */
+        m_accel = static_cast<Accel *>(
+            NoriObjectFactory::createInstance("bvh", PropertyList()));
+    }
+
+    for (Mesh *mesh : m_meshes)
+        m_accel->addMesh(mesh);
+    for (Instance *instance : m_instances)
+        m_accel->addInstance(instance);
+
+    if (m_snapshot && m_snapshot->isLoaded()) {
+        m_accel->unserialize(*m_snapshot);
+    } else {
+        m_accel->build();
+        if (m_snapshot)
+            m_snapshot->save(m_accel);
+    }
+    m_snapshot = nullptr;
 
     if (!m_integrator)
         throw NoriException("No integrator was specified!");
@@ -59,11 +79,14 @@ void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Mesh *mesh = static_cast<Mesh *>(obj);
-                m_accel->addMesh(mesh);
                 m_meshes.push_back(mesh);
             }
             break;
         
+        case EInstance:
+            m_instances.push_back(static_cast<Instance *>(obj));
+            break;
+
         case EEmitter: {
                 //Emitter *emitter = static_cast<Emitter *>(obj);
                 /* TBD */
@@ -83,6 +106,12 @@ void Scene::addChild(NoriObject *obj) {
             m_camera = static_cast<Camera *>(obj);
             break;
         
+        case EAccel:
+            if (m_accel)
+                throw NoriException("There can only be one acceleration data structure per scene!");
+            m_accel = static_cast<Accel *>(obj);
+            break;
+
         case EIntegrator:
             if (m_integrator)
                 throw NoriException("There can only be one integrator per scene!");
@@ -109,13 +138,17 @@ std::string Scene::toString() const {
         "  integrator = %s,\n"
         "  sampler = %s\n"
         "  camera = %s,\n"
+        "  accel = %s,\n"
         "  meshes = {\n"
-        "  %s  }\n"
+        "  %s  },\n"
+        "  instances = %i\n"
         "]",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
-        indent(meshes, 2)
+        indent(m_accel->toString()),
+        indent(meshes, 2),
+        m_instances.size()
     );
 }
 
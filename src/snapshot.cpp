@@ -0,0 +1,252 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/snapshot.h>
+#include <nori/accel.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <sys/stat.h>
+#include <cstdio>
+
+#define SNAPSHOT_ALIGNMENT 64 /* Alignment of the header and of all blocks (in bytes) */
+
+NORI_NAMESPACE_BEGIN
+
+/// Header at the beginning of every snapshot file
+struct SnapshotHeader {
+    char magic[8];     ///< Identifies snapshot files ("NORISNAP")
+    uint32_t version;  ///< File format version (\ref NORI_SNAPSHOT_VERSION)
+    uint32_t reserved; ///< Unused (zero)
+    uint64_t key;      ///< Hash of the scene (see \ref Snapshot::computeKey())
+    uint64_t size;     ///< Total size of the file (in bytes)
+};
+
+static const char snapshotMagic[8] = { 'N', 'O', 'R', 'I', 'S', 'N', 'A', 'P' };
+
+static size_t align(size_t offset) {
+    return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+}
+
+/**
+ * \brief Triangle mesh whose buffers are restored from a snapshot
+ *
+ * Replaces the mesh (e.g. an OBJ file) that was originally
+ * specified by the scene description.
+ */
+class SnapshotMesh : public Mesh {
+public:
+    SnapshotMesh(Snapshot &snapshot) {
+        snapshot.read(m_name);
+        snapshot.read(m_V);
+        snapshot.read(m_N);
+        snapshot.read(m_UV);
+        snapshot.read(m_F);
+        snapshot.read(m_bbox);
+    }
+};
+
+Snapshot::Snapshot(const std::string &filename, uint64_t key)
+    : m_filename(filename), m_key(key) {
+    size_t size = 0;
+    const uint8_t *data = mapFile(filename, size);
+    if (!data)
+        return;
+
+    /* Ignore snapshots of other scenes (or of previous versions of this scene) */
+    SnapshotHeader header;
+    bool valid = size >= sizeof(SnapshotHeader);
+    if (valid) {
+        memcpy(&header, data, sizeof(SnapshotHeader));
+        valid = memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) == 0 &&
+                header.version == NORI_SNAPSHOT_VERSION && header.key == key &&
+                header.size == size;
+    }
+
+    if (!valid) {
+        unmapFile(data, size);
+        return;
+    }
+
+    m_data = data;
+    m_size = size;
+    m_offset = align(sizeof(SnapshotHeader));
+
+    cout << "Mapped the snapshot \"" << filename << "\" (" << memString(size) << ")" << endl;
+}
+
+Snapshot::~Snapshot() {
+    if (m_data)
+        unmapFile(m_data, m_size);
+}
+
+uint64_t Snapshot::computeKey(const std::string &xmlFilename, const std::vector<std::string> &files) {
+    /* 64-bit FNV-1a hash */
+    uint64_t hash = 14695981039346656037ull;
+    auto combine = [&](const void *data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= ((const uint8_t *) data)[i];
+            hash *= 1099511628211ull;
+        }
+    };
+
+    uint32_t version = NORI_SNAPSHOT_VERSION;
+    combine(&version, sizeof(uint32_t));
+
+    /* The scene description (including all transformations and parameters) */
+    std::ifstream is(xmlFilename, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    combine(contents.data(), contents.size());
+
+    /* Referenced files are identified by their path, size, and modification time */
+    for (const std::string &file : files) {
+        std::string path = getFileResolver()->resolve(file).str();
+        combine(path.data(), path.size());
+
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            uint64_t size = (uint64_t) st.st_size, mtime = (uint64_t) st.st_mtime;
+            combine(&size, sizeof(uint64_t));
+            combine(&mtime, sizeof(uint64_t));
+        }
+    }
+
+    return hash;
+}
+
+Mesh *Snapshot::loadMesh() {
+    if (!m_data)
+        throw NoriException("Snapshot::loadMesh(): the snapshot \"%s\" was not loaded!", m_filename);
+    return new SnapshotMesh(*this);
+}
+
+void Snapshot::read(std::string &string) {
+    size_t size;
+    const void *data = readBlock(size, 1);
+    string.assign((const char *) data, size);
+}
+
+const void *Snapshot::readBlock(size_t &size, size_t unit) {
+    if (!m_data || m_offset + SNAPSHOT_ALIGNMENT > m_size)
+        throw NoriException("Snapshot \"%s\" is corrupt (unexpected end of file)!", m_filename);
+
+    /* Every block starts with its size, followed by padding */
+    uint64_t blockSize;
+    memcpy(&blockSize, m_data + m_offset, sizeof(uint64_t));
+    size_t start = m_offset + SNAPSHOT_ALIGNMENT;
+    if (blockSize > m_size - start || blockSize % unit != 0)
+        throw NoriException("Snapshot \"%s\" is corrupt (invalid block size)!", m_filename);
+
+    m_offset = align(start + (size_t) blockSize);
+    size = (size_t) blockSize;
+    return m_data + start;
+}
+
+const void *Snapshot::readBlock(size_t size) {
+    size_t actual;
+    const void *data = readBlock(actual, 1);
+    if (actual != size)
+        throw NoriException("Snapshot \"%s\" is corrupt (unexpected block size)!", m_filename);
+    return data;
+}
+
+void Snapshot::addMesh(const Mesh *mesh) {
+    m_meshes.push_back(mesh);
+}
+
+void Snapshot::save(const Accel *accel) {
+    if (m_data)
+        throw NoriException("Snapshot::save(): the snapshot \"%s\" was loaded from disk!", m_filename);
+
+    cout << "Writing the snapshot \"" << m_filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    /* Write to a temporary file first, which is renamed once it is complete */
+    std::string tempFilename = m_filename + ".tmp";
+    m_file.reset(new std::ofstream(tempFilename, std::ios::binary | std::ios::trunc));
+    if (m_file->fail()) {
+        m_file.reset();
+        cout << "failed (unable to create \"" << tempFilename << "\")" << endl;
+        return;
+    }
+
+    /* The header is written again once the total size is known */
+    SnapshotHeader header;
+    memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.version = NORI_SNAPSHOT_VERSION;
+    header.reserved = 0;
+    header.key = m_key;
+    header.size = 0;
+    char padding[SNAPSHOT_ALIGNMENT] = { 0 };
+    m_file->write((const char *) &header, sizeof(SnapshotHeader));
+    m_file->write(padding, align(sizeof(SnapshotHeader)) - sizeof(SnapshotHeader));
+    m_offset = align(sizeof(SnapshotHeader));
+
+    for (const Mesh *mesh : m_meshes) {
+        write(mesh->getName());
+        write(mesh->getVertexPositionView());
+        write(mesh->getVertexNormalView());
+        write(mesh->getVertexTexCoordView());
+        write(mesh->getIndexView());
+        write(mesh->getBoundingBox());
+    }
+    accel->serialize(*this);
+
+    header.size = m_offset;
+    m_file->seekp(0);
+    m_file->write((const char *) &header, sizeof(SnapshotHeader));
+    m_file->close();
+    bool failed = m_file->fail();
+    m_file.reset();
+
+    /* Replace the previous snapshot (if any) */
+    if (!failed) {
+        std::remove(m_filename.c_str());
+        failed = std::rename(tempFilename.c_str(), m_filename.c_str()) != 0;
+    }
+
+    if (failed) {
+        std::remove(tempFilename.c_str());
+        cout << "failed (unable to write \"" << m_filename << "\")" << endl;
+        return;
+    }
+
+    cout << "done. (took " << timer.elapsedString() << " and " << memString(header.size) << ")" << endl;
+}
+
+void Snapshot::write(const std::string &string) {
+    writeBlock(string.data(), string.size());
+}
+
+void Snapshot::writeBlock(const void *data, size_t size) {
+    if (!m_file)
+        throw NoriException("Snapshot::writeBlock(): the snapshot \"%s\" is not being written!", m_filename);
+
+    /* Every block starts with its size, followed by padding */
+    char padding[SNAPSHOT_ALIGNMENT] = { 0 };
+    uint64_t blockSize = (uint64_t) size;
+    memcpy(padding, &blockSize, sizeof(uint64_t));
+    m_file->write(padding, SNAPSHOT_ALIGNMENT);
+    memset(padding, 0, sizeof(uint64_t));
+
+    m_file->write((const char *) data, (std::streamsize) size);
+    m_file->write(padding, (std::streamsize) (align(size) - size));
+    m_offset += SNAPSHOT_ALIGNMENT + align(size);
+}
+
+NORI_NAMESPACE_END
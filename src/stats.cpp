@@ -0,0 +1,112 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/stats.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/cache_aligned_allocator.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Statistics of the queries finished by one thread
+struct ThreadStats {
+    TraversalStats::Counters total;
+    uint64_t nodeHistogram[TraversalStats::BinCount] = { };
+    uint64_t triangleHistogram[TraversalStats::BinCount] = { };
+};
+
+static tbb::enumerable_thread_specific<ThreadStats,
+    tbb::cache_aligned_allocator<ThreadStats>, tbb::ets_key_per_instance> threadStats;
+
+thread_local TraversalStats::Counters TraversalStats::query;
+
+/// Histogram bin of the given cost (0, 1, 2-3, 4-7, ..)
+static int bin(uint64_t value) {
+    int result = 0;
+    while (value > 0 && result < TraversalStats::BinCount - 1) {
+        value >>= 1;
+        ++result;
+    }
+    return result;
+}
+
+void TraversalStats::endQuery(uint32_t rays, uint32_t hits) {
+    ThreadStats &stats = threadStats.local();
+    stats.total.rays += rays;
+    stats.total.hits += hits;
+    stats.total.nodes += query.nodes;
+    stats.total.triangles += query.triangles;
+
+    if (rays > 0) {
+        stats.nodeHistogram[bin((query.nodes + rays / 2) / rays)] += rays;
+        stats.triangleHistogram[bin((query.triangles + rays / 2) / rays)] += rays;
+    }
+}
+
+TraversalStats::Counters TraversalStats::getThreadTotal() {
+    return threadStats.local().total;
+}
+
+TraversalStats::Counters TraversalStats::getTotal() {
+    Counters sum;
+    for (const ThreadStats &stats : threadStats) {
+        sum.rays += stats.total.rays;
+        sum.hits += stats.total.hits;
+        sum.nodes += stats.total.nodes;
+        sum.triangles += stats.total.triangles;
+    }
+    return sum;
+}
+
+std::string TraversalStats::summary() {
+    ThreadStats sum;
+    sum.total = getTotal();
+    for (const ThreadStats &stats : threadStats) {
+        for (int i = 0; i < BinCount; ++i) {
+            sum.nodeHistogram[i] += stats.nodeHistogram[i];
+            sum.triangleHistogram[i] += stats.triangleHistogram[i];
+        }
+    }
+
+    double rays = (double) std::max(sum.total.rays, (uint64_t) 1);
+    std::string result = tfm::format(
+        "Traversal statistics: %i rays, %.1f%% hits, %.1f nodes and %.1f triangle (packet) tests per ray\n"
+        "  Rays per cost     nodes  triangles\n",
+        sum.total.rays, 100.0 * sum.total.hits / rays,
+        sum.total.nodes / rays, sum.total.triangles / rays);
+
+    for (int i = 0; i < BinCount; ++i) {
+        std::string range;
+        if (i <= 1)
+            range = tfm::format("%i", i);
+        else if (i == BinCount - 1)
+            range = tfm::format("%i+", 1u << (i - 1));
+        else
+            range = tfm::format("%i-%i", 1u << (i - 1), (1u << i) - 1);
+        result += tfm::format("  %13s  %7.2f%%   %7.2f%%\n", range,
+                              100.0 * sum.nodeHistogram[i] / rays,
+                              100.0 * sum.triangleHistogram[i] / rays);
+    }
+
+    return result;
+}
+
+void TraversalStats::reset() {
+    threadStats.clear();
+}
+
+NORI_NAMESPACE_END